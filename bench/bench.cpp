@@ -0,0 +1,334 @@
+// Loopback benchmarks for the server and client hot paths.
+//
+// For every send mode an in-process seeder (Network + FileServer) shares a
+// scratch folder on 127.0.0.1, and the client side is driven against it:
+//   range  sequential download_range() calls, one v1 connection per piece
+//   get    download_file() over a matrix of file size x piece size x threads
+//   write  download_file() once per output write mode
+//   lz4    download_file() of a compressible file with --compress lz4
+// Each case prints one JSON object per line on stdout (progress goes to
+// stderr): throughput, p50/p99 per-piece latency, CPU seconds and the peak
+// RSS so far. Client and seeder share the process, so CPU and RSS cover both.
+//
+//   p2p_bench [--quick] [--sizes 16M,128M] [--pieces 256K,1M,4M]
+//             [--threads 1,4,0] [--modes sendfile,splice,buffered]
+//             [--port 19100] [--dir /tmp]
+
+#include "network.hpp"
+#include "server.hpp"
+#include "downloader.hpp"
+#include "shaper.hpp"
+#include "utils.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Config {
+    std::vector<uint64_t> sizes = {16u << 20, 128u << 20};
+    std::vector<uint64_t> pieces = {256u << 10, 1u << 20, 4u << 20};
+    std::vector<int> threads = {1, 4, 0};
+    std::vector<SendMode> modes = {SendMode::Sendfile, SendMode::Splice, SendMode::Buffered};
+    int port = 19100;
+    std::string dir = "/tmp";
+};
+
+struct Sample {
+    double cpu = 0;
+    std::chrono::steady_clock::time_point wall;
+};
+
+Sample now_sample() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    Sample s;
+    s.cpu = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6 +
+            (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    s.wall = std::chrono::steady_clock::now();
+    return s;
+}
+
+long peak_rss_kib() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min<double>((double)v.size() - 1, p * (double)(v.size() - 1) + 0.5);
+    return v[i];
+}
+
+// The library reports progress on std::cout; keep it off the result stream.
+class Quiet {
+public:
+    Quiet() : null_("/dev/null"), old_(std::cout.rdbuf(null_.rdbuf())) {}
+    ~Quiet() { std::cout.rdbuf(old_); }
+private:
+    std::ofstream null_;
+    std::streambuf *old_;
+};
+
+bool parse_list(const std::string& s, std::vector<uint64_t>& out) {
+    out.clear();
+    for (auto &part : split(s, ',')) {
+        uint64_t v = 0;
+        if (!parse_bytes(trim(part), v)) return false;
+        out.push_back(v);
+    }
+    return !out.empty();
+}
+
+void make_file(const std::string& path, uint64_t size, bool compressible) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    std::mt19937_64 rng(size);
+    std::string chunk;
+    uint64_t written = 0;
+    while (written < size) {
+        chunk.clear();
+        if (compressible) {
+            // log-like lines: a few varying fields in a lot of repetition
+            while (chunk.size() < (1u << 20)) {
+                chunk += std::to_string(written + chunk.size()) + ",host" + std::to_string(rng() % 40) +
+                         ".example.com,GET /api/v1/items/" + std::to_string(rng() % 500) + " 200\n";
+            }
+        } else {
+            chunk.resize(1u << 20);
+            for (size_t i = 0; i + 8 <= chunk.size(); i += 8) {
+                uint64_t v = rng();
+                std::copy((const char*)&v, (const char*)&v + 8, &chunk[i]);
+            }
+        }
+        size_t n = (size_t)std::min<uint64_t>(chunk.size(), size - written);
+        out.write(chunk.data(), (std::streamsize)n);
+        written += n;
+    }
+}
+
+std::string file_name(uint64_t size, bool compressible) {
+    return (compressible ? "text_" : "bin_") + std::to_string(size >> 20) + "M.dat";
+}
+
+struct Result {
+    std::string bench;
+    std::string send_mode;
+    uint64_t size = 0;
+    uint64_t piece = 0;
+    int threads = -1;                   // -1: not applicable
+    std::string write_mode;
+    bool compress = false;
+    bool ok = false;
+    double seconds = 0;
+    double cpu = 0;
+    std::vector<double> latencies;      // seconds per piece
+};
+
+void emit(const Result& r) {
+    double mib_s = r.seconds > 0 ? (double)r.size / (1024.0 * 1024.0) / r.seconds : 0;
+    std::printf("{\"bench\":\"%s\",\"send_mode\":\"%s\",\"size\":%llu,\"piece\":%llu,\"threads\":%d,"
+                "\"write_mode\":\"%s\",\"compress\":%s,\"ok\":%s,\"seconds\":%.4f,\"mib_s\":%.1f,"
+                "\"pieces\":%zu,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"cpu_s\":%.3f,\"peak_rss_kib\":%ld}\n",
+                r.bench.c_str(), r.send_mode.c_str(), (unsigned long long)r.size, (unsigned long long)r.piece,
+                r.threads, r.write_mode.c_str(), r.compress ? "true" : "false", r.ok ? "true" : "false",
+                r.seconds, mib_s, r.latencies.size(), percentile(r.latencies, 0.50) * 1e3,
+                percentile(r.latencies, 0.99) * 1e3, r.cpu, peak_rss_kib());
+    std::fflush(stdout);
+}
+
+// Sequential v1 range requests, one connection each: the per-request cost
+// of the server's accept/parse/open/send path.
+Result bench_range(int port, const std::string& name, uint64_t size, uint64_t piece) {
+    Result r;
+    r.bench = "range";
+    r.size = size;
+    r.piece = piece;
+    std::vector<char> buf(piece);
+    r.ok = true;
+    Sample a = now_sample();
+    for (uint64_t start = 0; start < size && r.ok; start += piece) {
+        uint64_t end = std::min(size, start + piece);
+        auto t = std::chrono::steady_clock::now();
+        r.ok = download_range("127.0.0.1", port, name, start, end, buf.data());
+        r.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count());
+    }
+    Sample b = now_sample();
+    r.seconds = std::chrono::duration<double>(b.wall - a.wall).count();
+    r.cpu = b.cpu - a.cpu;
+    return r;
+}
+
+Result bench_get(int port, const std::string& name, uint64_t size, uint64_t piece, int threads,
+                 WriteMode write_mode, bool compress) {
+    Result r;
+    r.bench = "get";
+    r.size = size;
+    r.piece = piece;
+    r.threads = threads;
+    r.write_mode = write_mode_name(write_mode);
+    r.compress = compress;
+
+    std::error_code ec;
+    fs::remove(name, ec);
+    fs::remove(name + ".p2pstate", ec);
+
+    std::vector<Source> sources = {{"127.0.0.1", port, PeerStats{}}};
+    DownloadOptions opts;
+    opts.threads = threads;
+    opts.piece_size = piece;
+    opts.write_mode = write_mode;
+    opts.compress = compress;
+    std::mutex mu;
+    opts.on_piece = [&](double secs) {
+        std::lock_guard<std::mutex> lock(mu);
+        r.latencies.push_back(secs);
+    };
+
+    Sample a = now_sample();
+    {
+        Quiet quiet;
+        r.ok = download_file(name, size, sources, opts);
+    }
+    Sample b = now_sample();
+    r.seconds = std::chrono::duration<double>(b.wall - a.wall).count();
+    r.cpu = b.cpu - a.cpu;
+    fs::remove(name, ec);
+    return r;
+}
+
+void usage() {
+    std::cerr << "Usage: p2p_bench [--quick] [--sizes 16M,128M] [--pieces 256K,1M,4M] [--threads 1,4,0]\n"
+                 "                 [--modes sendfile,splice,buffered] [--port 19100] [--dir /tmp]\n"
+                 "  threads 0 = adaptive. One JSON object per case on stdout.\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--quick") {
+            cfg.sizes = {16u << 20};
+            cfg.pieces = {1u << 20};
+            cfg.threads = {1, 0};
+            continue;
+        }
+        if (opt == "--help" || opt == "-h") { usage(); return 0; }
+        if (i + 1 >= argc) { usage(); return 1; }
+        std::string val = argv[++i];
+        bool ok = true;
+        if (opt == "--sizes") ok = parse_list(val, cfg.sizes);
+        else if (opt == "--pieces") ok = parse_list(val, cfg.pieces);
+        else if (opt == "--threads") {
+            cfg.threads.clear();
+            for (auto &t : split(val, ',')) cfg.threads.push_back(atoi(t.c_str()));
+        }
+        else if (opt == "--modes") {
+            cfg.modes.clear();
+            for (auto &m : split(val, ',')) {
+                SendMode mode;
+                if (!parse_send_mode(trim(m), mode)) { ok = false; break; }
+                cfg.modes.push_back(mode);
+            }
+        }
+        else if (opt == "--port") cfg.port = atoi(val.c_str());
+        else if (opt == "--dir") cfg.dir = val;
+        else ok = false;
+        if (!ok) { usage(); return 1; }
+    }
+
+    // scratch layout: <dir>/p2p_bench.XXXXXX/{share,dl}
+    std::string tmpl = cfg.dir + "/p2p_bench.XXXXXX";
+    if (!mkdtemp(&tmpl[0])) {
+        std::cerr << "cannot create scratch directory under " << cfg.dir << "\n";
+        return 1;
+    }
+    fs::path root = tmpl, share = root / "share", dl = root / "dl";
+    fs::create_directories(share);
+    fs::create_directories(dl);
+
+    std::cerr << "[bench] generating files in " << share << "\n";
+    for (uint64_t size : cfg.sizes) make_file((share / file_name(size, false)).string(), size, false);
+    uint64_t text_size = cfg.sizes.front();
+    make_file((share / file_name(text_size, true)).string(), text_size, true);
+
+    // downloads land in the working directory
+    fs::path old_cwd = fs::current_path();
+    fs::current_path(dl);
+
+    int port = cfg.port;
+    for (SendMode mode : cfg.modes) {
+        ServerConfig scfg;
+        scfg.send_mode = mode;
+        scfg.report_interval = 0;
+        Network net(port);
+        bool started;
+        {
+            Quiet quiet;
+            started = net.start_tcp_server(share.string(), scfg);
+        }
+        if (!started) {
+            std::cerr << "[bench] could not start a seeder on port " << port << "\n";
+            port++;
+            continue;
+        }
+        std::cerr << "[bench] seeder on 127.0.0.1:" << port << " (" << send_mode_name(mode) << ")\n";
+
+        // have the seeder hash every piece size up front, so manifest
+        // computation isn't part of any timed case
+        std::vector<Source> sources = {{"127.0.0.1", port, PeerStats{}}};
+        for (uint64_t size : cfg.sizes) {
+            for (uint64_t piece : cfg.pieces) {
+                Manifest m;
+                fetch_manifest(sources, file_name(size, false), size, piece, 60, m);
+            }
+        }
+        Manifest m;
+        fetch_manifest(sources, file_name(text_size, true), text_size, 1u << 20, 60, m);
+
+        auto tag = [&](Result r) {
+            r.send_mode = send_mode_name(mode);
+            emit(r);
+        };
+        for (uint64_t size : cfg.sizes) {
+            std::string name = file_name(size, false);
+            for (uint64_t piece : cfg.pieces) {
+                tag(bench_range(port, name, size, piece));
+                for (int t : cfg.threads) tag(bench_get(port, name, size, piece, t, WriteMode::Pwrite, false));
+            }
+        }
+
+        uint64_t big = cfg.sizes.back();
+        for (WriteMode w : {WriteMode::Mmap, WriteMode::Uring}) {
+            Result r = bench_get(port, file_name(big, false), big, 1u << 20, 0, w, false);
+            r.bench = "write";
+            tag(r);
+        }
+        Result z = bench_get(port, file_name(text_size, true), text_size, 1u << 20, 0, WriteMode::Pwrite, true);
+        z.bench = "lz4";
+        tag(z);
+        port++;
+    }
+
+    fs::current_path(old_cwd);
+    std::error_code ec;
+    fs::remove_all(root, ec);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Self-checks for code that parses what peers send, starting with the LZ4
+// codec: compressed blocks arrive from the network, so the decoder must turn
+// down anything malformed without touching memory outside its buffers.
+//
+//   p2p_check [--rounds 2000] [--seed 1]
+//
+// Round-trips a set of inputs (empty, tiny, text, runs, random, and sizes
+// around the encoder's end-of-block limits), then feeds the decoder
+// truncated, corrupted and random blocks and wrong output sizes. Prints one
+// line per failure and exits non-zero if there was any. Build it with
+// -fsanitize=address to have out-of-bounds accesses reported too.
+
+#include "compress.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+namespace {
+
+int failures = 0;
+
+void fail(const std::string &what) {
+    std::cerr << "[check] FAIL " << what << "\n";
+    failures++;
+}
+
+std::vector<char> compress(const std::vector<char> &in) {
+    std::vector<char> out(lz4_bound(in.size()));
+    size_t z = lz4_compress(in.data(), in.size(), out.data(), out.size());
+    out.resize(z);
+    return out;
+}
+
+// Decodes into a buffer sized exactly `out_len`, so an overrun is caught by
+// the sanitizer rather than landing in slack.
+bool decode(const std::vector<char> &block, size_t out_len, std::vector<char> &out) {
+    out.assign(out_len, 0);
+    std::unique_ptr<char[]> src(new char[block.size() ? block.size() : 1]);
+    if (!block.empty()) std::memcpy(src.get(), block.data(), block.size());
+    return lz4_decompress(src.get(), block.size(), out.data(), out_len);
+}
+
+std::vector<char> sample(const std::string &kind, size_t n, std::mt19937_64 &rng) {
+    std::vector<char> v(n);
+    if (kind == "zeros") return v;
+    if (kind == "random") {
+        for (auto &c : v) c = (char)rng();
+    } else if (kind == "text") {
+        static const char *words[] = {"piece ", "seeder ", "manifest ", "range ", "GET ", "\n", "12000 "};
+        std::string s;
+        while (s.size() < n) s += words[rng() % 7];
+        std::copy(s.begin(), s.begin() + n, v.begin());
+    } else if (kind == "runs") {
+        // short periods exercise the overlapping match copy
+        for (size_t i = 0; i < n;) {
+            size_t period = 1 + rng() % 9, len = std::min<size_t>(n - i, rng() % 300);
+            for (size_t k = 0; k < len; ++k) v[i + k] = (char)('a' + (k % period));
+            i += len ? len : 1;
+        }
+    }
+    return v;
+}
+
+void round_trips(std::mt19937_64 &rng) {
+    std::vector<size_t> sizes = {0, 1, 4, 11, 12, 13, 16, 17, 64, 255, 256, 4096, 65535, 65536, 65537,
+                                 1 << 20};
+    for (const char *kind : {"zeros", "random", "text", "runs"}) {
+        for (size_t n : sizes) {
+            std::vector<char> in = sample(kind, n, rng), out;
+            std::vector<char> z = compress(in);
+            std::string name = std::string(kind) + " " + std::to_string(n);
+            if (z.empty()) { fail("compress " + name); continue; }
+            if (!decode(z, n, out) || out != in) fail("round trip " + name);
+            // the decoder wants the exact size
+            if (decode(z, n + 1, out)) fail("accepted a longer output " + name);
+            if (n > 0 && decode(z, n - 1, out)) fail("accepted a shorter output " + name);
+        }
+    }
+    // a destination that is too small fails instead of overrunning
+    std::vector<char> in = sample("random", 4096, rng);
+    std::vector<char> dst(100);
+    if (lz4_compress(in.data(), in.size(), dst.data(), dst.size()) != 0) fail("compress into a short buffer");
+}
+
+void bad_blocks(std::mt19937_64 &rng, int rounds) {
+    // hand-made blocks: a match before the start, offset 0, a length run
+    // past the end, a match with no literals before it
+    const std::vector<std::vector<char>> crafted = {
+        {'\x10', 'a', '\x05', '\x00'},
+        {'\x10', 'a', '\x00', '\x00'},
+        {'\xf0', '\xff', '\xff'},
+        {'\x0f', '\x01', '\x00', '\xff', '\xff', '\xff'},
+        {'\x00', '\x01'},
+        {'\x1f', 'a', '\x01', '\x00', '\xff', '\xff', '\xff', '\xff', '\x10'},
+    };
+    std::vector<char> out;
+    for (size_t i = 0; i < crafted.size(); ++i) {
+        for (size_t len : {0, 1, 16, 1000}) {
+            if (decode(crafted[i], len, out)) fail("accepted crafted block " + std::to_string(i));
+        }
+    }
+
+    std::vector<char> in = sample("text", 8192, rng);
+    std::vector<char> z = compress(in);
+    for (size_t cut = 0; cut < z.size(); cut += 1 + cut / 8) {
+        std::vector<char> part(z.begin(), z.begin() + cut);
+        if (decode(part, in.size(), out)) fail("accepted a block cut at " + std::to_string(cut));
+    }
+    for (int r = 0; r < rounds; ++r) {
+        // flipped bytes may still decode to the right length; they must never
+        // read or write out of bounds, which the sanitizer would report
+        std::vector<char> bad = z;
+        for (int k = 0; k < 1 + (int)(rng() % 4); ++k) bad[rng() % bad.size()] ^= (char)(1 + rng() % 255);
+        decode(bad, in.size(), out);
+
+        std::vector<char> junk(rng() % 512);
+        for (auto &c : junk) c = (char)rng();
+        decode(junk, rng() % 4096, out);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    int rounds = 2000;
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--rounds" && i + 1 < argc) rounds = std::atoi(argv[++i]);
+        else if (a == "--seed" && i + 1 < argc) seed = std::strtoull(argv[++i], nullptr, 10);
+        else {
+            std::cerr << "usage: p2p_check [--rounds N] [--seed N]\n";
+            return 2;
+        }
+    }
+    std::mt19937_64 rng(seed);
+    round_trips(rng);
+    bad_blocks(rng, rounds);
+    std::cerr << "[check] lz4: " << (failures ? "FAILED" : "ok") << "\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,868 @@
+// Deterministic simulation of a network segment full of peers.
+//
+// Every peer runs discovery the way Network does: an announce datagram
+// (bloom_build + encode_announce) every ANNOUNCE_INTERVAL_MS, who-has queries
+// (encode_query) answered by unicast, CATALOG fetches of the peers whose
+// digest changed and whose Bloom filter may hold the wanted file, and a real
+// PeerTable running on virtual time. Downloaders then fetch one file the way
+// get does with a fixed connection count: a rarest-first PieceScheduler fed
+// by the full seeds and by each other's finished pieces (HAVE maps polled
+// from partial sources), endgame duplicates included. Sources are the ones
+// discovery found, as in get; one that leaves is dropped.
+//
+// Sockets are replaced by a virtual transport: per-peer one-way latency and
+// upload / download bandwidth, datagram loss (which also caps each TCP flow
+// at the Mathis rate for that RTT), and churn (peers leaving and coming back
+// as new processes). A flow's rate is fixed when it starts, from the flows
+// its two ends have open at that moment. One thread, one event queue and one
+// seeded RNG: the same arguments always print the same result.
+//
+//   p2p_sim [--peers 200] [--seeds 2] [--downloaders 40] [--file 128M] [--piece 1M]
+//           [--conns 4] [--files 20] [--latency 2-40] [--up 2M-20M] [--down 10M-100M]
+//           [--loss 0] [--churn 0] [--session 120] [--warmup 5] [--stagger 10]
+//           [--linger 0] [--time 3600] [--seed 1] [--per-peer]
+//
+// Prints one JSON object on stdout: completion times, bytes per peer, the
+// discovery traffic (announces, queries, catalogs, HAVE) and peer-table
+// memory; with --per-peer also one line per peer. Progress goes to stderr.
+
+#include "discovery.hpp"
+#include "peer_table.hpp"
+#include "catalog.hpp"
+#include "scheduler.hpp"
+#include "shaper.hpp"
+#include "utils.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+using SteadyClock = std::chrono::steady_clock;
+
+constexpr int PORT = 12000;
+const std::string WANTED = "data.bin";
+// Downloader timing, as in downloader.cpp.
+constexpr double HAVE_POLL = 0.250;
+constexpr int STARVE_POLLS = 8;
+constexpr double BUSY_WAIT = 0.100;
+constexpr double QUERY_GRACE = 0.050;       // query_peers' default grace
+constexpr double CONNECT_TIMEOUT = 1.0;     // what reaching a peer that has left costs
+constexpr double MSS = 1448;
+constexpr size_t MESSAGE_HEADER = 40;       // request line plus "OK <id> <len>\n", roughly
+
+struct Range {
+    double lo = 0, hi = 0;
+};
+
+struct Config {
+    int peers = 200;
+    int seeds = 2;
+    int downloaders = 40;
+    uint64_t file = 128u << 20;
+    uint64_t piece = 1u << 20;
+    int conns = 4;                  // connections per downloader
+    int files = 20;                 // unrelated files each peer shares
+    Range latency = {0.002, 0.040}; // one way, seconds
+    Range up = {2e6, 20e6};         // bytes/s
+    Range down = {10e6, 100e6};
+    double loss = 0;                // datagram / packet loss probability
+    double churn = 0;               // share of non-downloading peers that come and go
+    double session = 120;           // mean seconds online (and offline) of a churning peer
+    double warmup = 5;              // seconds before the first get
+    double stagger = 10;            // gets start spread over this many seconds
+    double linger = 0;              // seconds a finished downloader keeps seeding
+    int discover_ms = 3000;
+    int min_sources = 1;
+    double time = 3600;             // simulated seconds at most
+    uint64_t seed = 1;
+    bool per_peer = false;
+};
+
+enum class Role { Idle, Seed, Downloader };
+
+const char* role_name(Role r) {
+    switch (r) {
+        case Role::Seed:       return "seed";
+        case Role::Downloader: return "downloader";
+        default:               return "idle";
+    }
+}
+
+// One download connection of a downloader.
+struct Conn {
+    int source = 0;                 // index into Download::sources
+    uint64_t source_id = 0;         // the source's peer ID when connected
+    bool warm = false;              // requests already pipelined: no round trip per piece
+    std::vector<bool> have;         // a partial source's HAVE map, as last fetched
+    int idle_polls = 0;
+};
+
+struct Download {
+    double start = -1, resolved = -1, done = -1;
+    bool failed = false;
+    bool querying = false;
+    int query_sends = 0;
+    std::set<uint64_t> answered;
+    int pending_catalogs = 0;
+    std::vector<int> sources;       // peer indices, full copies first
+    std::vector<uint64_t> source_ids;
+    std::vector<bool> partial;
+    std::unique_ptr<PieceScheduler> sched;
+    std::vector<Conn> conns;
+    uint64_t dup_bytes = 0;         // endgame copies that lost the race
+};
+
+struct Peer {
+    std::string addr;
+    Role role = Role::Idle;
+    double latency = 0, up = 0, down = 0;
+    bool online = true;
+    bool churns = false;
+    uint64_t peer_id = 0;           // new on every (re)start, like a process
+    bool full = false;              // has the whole wanted file
+    bool partial = false;           // downloading it and seeding finished pieces
+    std::vector<bool> have;
+    CatalogFiles files;             // everything else it shares
+    std::string announce;
+    std::string query_reply;        // the announce without its Bloom filter
+    bool announce_dirty = true;
+    std::unique_ptr<PeerTable> table;
+    int active_up = 0, active_down = 0;
+
+    uint64_t sent = 0, received = 0;                    // piece bodies
+    uint64_t control_sent = 0, control_received = 0;    // announces, queries, catalogs, HAVE
+    size_t table_peak = 0;
+    Download dl;
+};
+
+enum class Ev { Tick, Datagram, GetStart, QueryResend, QueryDone, CatalogDone, ConnReady, ConnNext,
+                HaveDone, PieceDone, Leave, Join };
+
+struct Event {
+    double t = 0;
+    uint64_t seq = 0;
+    Ev kind = Ev::Tick;
+    int peer = -1;
+    int other = -1;                 // sender, source, ...
+    int conn = -1;
+    uint64_t id = 0;                // peer ID the event belongs to; stale ones are dropped
+    Piece piece;
+    std::shared_ptr<const std::string> msg;
+};
+
+struct Later {
+    bool operator()(const Event& a, const Event& b) const { return a.t != b.t ? a.t > b.t : a.seq > b.seq; }
+};
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min<double>((double)v.size() - 1, p * (double)(v.size() - 1) + 0.5);
+    return v[i];
+}
+
+class Simulation {
+public:
+    explicit Simulation(const Config& cfg) : cfg_(cfg), rng_(cfg.seed) {}
+
+    void run();
+    void report() const;
+
+private:
+    Config cfg_;
+    std::mt19937_64 rng_;
+    std::vector<Peer> peers_;
+    std::map<std::string, int> by_addr_;
+    std::priority_queue<Event, std::vector<Event>, Later> queue_;
+    double now_ = 0;
+    uint64_t seq_ = 0;
+    uint64_t events_ = 0;
+    int active_downloads_ = 0;
+
+    uint64_t announces_ = 0, queries_ = 0, query_replies_ = 0, datagrams_lost_ = 0;
+    uint64_t announce_bytes_ = 0, query_bytes_ = 0;
+    uint64_t catalog_fetches_ = 0, catalog_failures_ = 0, catalog_bytes_ = 0, bloom_false_positives_ = 0;
+    uint64_t have_requests_ = 0, have_bytes_ = 0;
+    uint64_t pieces_failed_ = 0, departures_ = 0;
+
+    double uniform(const Range& r) {
+        return r.lo + (r.hi - r.lo) * std::uniform_real_distribution<double>(0, 1)(rng_);
+    }
+    bool chance(double p) { return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < p; }
+    double exponential(double mean) { return std::exponential_distribution<double>(1.0 / mean)(rng_); }
+
+    void at(double t, Event e) {
+        e.t = t;
+        e.seq = seq_++;
+        queue_.push(std::move(e));
+    }
+    Event event(Ev kind, int peer, int other = -1, int conn = -1) {
+        Event e;
+        e.kind = kind;
+        e.peer = peer;
+        e.other = other;
+        e.conn = conn;
+        e.id = peers_[peer].peer_id;
+        return e;
+    }
+    SteadyClock::time_point clock() const {
+        // an hour in, so "never" (a zero time point) is long ago
+        return SteadyClock::time_point{} + std::chrono::hours(1) +
+               std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(now_));
+    }
+
+    double rtt(const Peer& a, const Peer& b) const { return 2 * (a.latency + b.latency); }
+    // Rate of a new flow from `src` to `dst`: an even share of each end's
+    // link, and no more than TCP sustains at this RTT and loss.
+    double flow_rate(const Peer& src, const Peer& dst) const {
+        double r = std::min(src.up / (src.active_up + 1), dst.down / (dst.active_down + 1));
+        if (cfg_.loss > 0) r = std::min(r, MSS / rtt(src, dst) * 1.22 / std::sqrt(cfg_.loss));
+        return r;
+    }
+
+    void setup();
+    void start_peer(int i);
+    CatalogFiles shared_files(const Peer& p) const;
+    CatalogFiles partial_files(const Peer& p) const;
+    const std::string& announce_of(Peer& p);
+    bool offers(const Peer& p, const std::string& name) const;
+    void broadcast(int from, std::shared_ptr<const std::string> msg);
+    void unicast(int from, int to, std::shared_ptr<const std::string> msg, bool reply);
+    bool alive(const Download& d, int s) const;
+
+    void on_tick(const Event& e);
+    void on_datagram(const Event& e);
+    void on_get_start(int i);
+    void on_query_resend(int i);
+    void on_query_done(int i);
+    void on_catalog_done(const Event& e);
+    void begin_download(int i);
+    void connect(int i, int c);
+    void on_conn_ready(int i, int c);
+    void on_conn_next(int i, int c);
+    void on_have_done(int i, int c);
+    void on_piece_done(const Event& e);
+    void finish(int i, bool ok);
+    void leave(int i);
+    void join(int i);
+};
+
+
+// ---------------------------------------------------------------
+// Setup
+// ---------------------------------------------------------------
+void Simulation::setup() {
+    peers_.resize((size_t)cfg_.peers);
+    size_t pieces = (size_t)((cfg_.file + cfg_.piece - 1) / cfg_.piece);
+    for (int i = 0; i < cfg_.peers; ++i) {
+        Peer &p = peers_[(size_t)i];
+        p.addr = "10." + std::to_string(i / 65536) + "." + std::to_string(i / 256 % 256) + "." + std::to_string(i % 256);
+        by_addr_[p.addr] = i;
+        p.latency = uniform(cfg_.latency);
+        p.up = uniform(cfg_.up);
+        p.down = uniform(cfg_.down);
+        p.role = i < cfg_.seeds ? Role::Seed : i < cfg_.seeds + cfg_.downloaders ? Role::Downloader : Role::Idle;
+        p.full = p.role == Role::Seed;
+        p.have.assign(pieces, p.full);
+        for (int k = 0; k < cfg_.files; ++k) {
+            p.files["p" + std::to_string(i) + "/file" + std::to_string(k) + ".dat"].size = 1024 + rng_() % (64u << 20);
+        }
+        // the first seed stays, so the file never disappears from the swarm
+        p.churns = p.role != Role::Downloader && i > 0 && chance(cfg_.churn);
+        start_peer(i);
+        if (p.churns) at(exponential(cfg_.session), event(Ev::Leave, i));
+        if (p.role == Role::Downloader) {
+            active_downloads_++;
+            at(cfg_.warmup + uniform({0, cfg_.stagger}), event(Ev::GetStart, i));
+        }
+    }
+}
+
+// A fresh process: new peer ID, empty peer table, first announce somewhere
+// in the next interval.
+void Simulation::start_peer(int i) {
+    Peer &p = peers_[(size_t)i];
+    p.online = true;
+    p.peer_id = rng_();
+    p.announce_dirty = true;
+    p.table = std::make_unique<PeerTable>(std::chrono::seconds(PEER_TTL_SECS), [this] { return clock(); });
+    at(now_ + uniform({0, ANNOUNCE_INTERVAL_MS / 1000.0}), event(Ev::Tick, i));
+}
+
+CatalogFiles Simulation::shared_files(const Peer& p) const {
+    CatalogFiles files = p.files;
+    if (p.full) files[WANTED].size = cfg_.file;
+    return files;
+}
+
+CatalogFiles Simulation::partial_files(const Peer& p) const {
+    CatalogFiles part;
+    if (p.partial) part[WANTED].size = cfg_.file;
+    return part;
+}
+
+const std::string& Simulation::announce_of(Peer& p) {
+    if (!p.announce_dirty) return p.announce;
+    CatalogFiles files = shared_files(p), part = partial_files(p);
+    Announce a;
+    a.peer_id = p.peer_id;
+    a.port = PORT;
+    a.digest = catalog_digest(files, part);
+    a.file_count = (uint32_t)(files.size() + part.size());
+    std::vector<std::string> names;
+    for (auto &kv : files) names.push_back(kv.first);
+    for (auto &kv : part) names.push_back(kv.first);
+    bloom_build(names, a);
+    p.announce = encode_announce(a);
+    p.query_reply = encode_query_reply(a);
+    p.announce_dirty = false;
+    return p.announce;
+}
+
+// Whether `p` answers a query for `name`, as announce_message() decides.
+bool Simulation::offers(const Peer& p, const std::string& name) const {
+    if (name.empty()) return true;
+    if (name == WANTED) return p.full || p.partial;
+    return p.files.count(name) > 0;
+}
+
+bool Simulation::alive(const Download& d, int s) const {
+    const Peer &src = peers_[(size_t)d.sources[(size_t)s]];
+    return src.online && src.peer_id == d.source_ids[(size_t)s];
+}
+
+
+// ---------------------------------------------------------------
+// Virtual transport
+// ---------------------------------------------------------------
+void Simulation::broadcast(int from, std::shared_ptr<const std::string> msg) {
+    Peer &src = peers_[(size_t)from];
+    src.control_sent += msg->size();
+    for (int to = 0; to < cfg_.peers; ++to) {
+        if (to == from || !peers_[(size_t)to].online) continue;
+        if (chance(cfg_.loss)) {
+            datagrams_lost_++;
+            continue;
+        }
+        Event e = event(Ev::Datagram, to, from);
+        e.msg = msg;
+        at(now_ + src.latency + peers_[(size_t)to].latency, std::move(e));
+    }
+}
+
+// `reply`: an answer to a query, which arrives on the asker's query socket.
+void Simulation::unicast(int from, int to, std::shared_ptr<const std::string> msg, bool reply) {
+    peers_[(size_t)from].control_sent += msg->size();
+    if (chance(cfg_.loss)) {
+        datagrams_lost_++;
+        return;
+    }
+    Event e = event(Ev::Datagram, to, from, reply ? 1 : 0);
+    e.msg = std::move(msg);
+    at(now_ + peers_[(size_t)from].latency + peers_[(size_t)to].latency, std::move(e));
+}
+
+
+// ---------------------------------------------------------------
+// Discovery
+// ---------------------------------------------------------------
+void Simulation::on_tick(const Event& e) {
+    Peer &p = peers_[(size_t)e.peer];
+    // the listener's expiry, folded into the announce loop
+    p.table->expire();
+    p.table_peak = std::max(p.table_peak, p.table->memory_bytes());
+    auto msg = std::make_shared<const std::string>(announce_of(p));
+    announces_++;
+    announce_bytes_ += msg->size();
+    broadcast(e.peer, std::move(msg));
+    at(now_ + ANNOUNCE_INTERVAL_MS / 1000.0, event(Ev::Tick, e.peer));
+}
+
+void Simulation::on_datagram(const Event& e) {
+    Peer &p = peers_[(size_t)e.peer];
+    const std::string &data = *e.msg;
+    p.control_received += data.size();
+    Query q;
+    Announce a;
+    if (decode_query(data.data(), data.size(), q)) {
+        if (q.peer_id == p.peer_id || !offers(p, q.name)) return;
+        query_replies_++;
+        announce_of(p);
+        unicast(e.peer, e.other, std::make_shared<const std::string>(p.query_reply), true);
+    } else if (decode_announce(data.data(), data.size(), a)) {
+        if (a.peer_id == p.peer_id) return;
+        p.table->announce(peers_[(size_t)e.other].addr, a);
+        Download &d = p.dl;
+        // only replies to the query count towards settling it
+        if (e.conn == 1 && d.querying && d.answered.insert(a.peer_id).second &&
+            (int)d.answered.size() == std::max(1, cfg_.min_sources)) {
+            at(now_ + QUERY_GRACE, event(Ev::QueryDone, e.peer));
+        }
+    }
+}
+
+void Simulation::on_get_start(int i) {
+    Download &d = peers_[(size_t)i].dl;
+    d.start = now_;
+    d.querying = true;
+    std::cerr << "[sim] " << now_ << " s: peer " << i << " starts get\n";
+    on_query_resend(i);
+    at(now_ + cfg_.discover_ms / 1000.0, event(Ev::QueryDone, i));
+}
+
+void Simulation::on_query_resend(int i) {
+    Peer &p = peers_[(size_t)i];
+    if (!p.dl.querying || p.dl.query_sends >= QUERY_SENDS) return;
+    Query q;
+    q.peer_id = p.peer_id;
+    q.name = WANTED;
+    auto msg = std::make_shared<const std::string>(encode_query(q));
+    queries_++;
+    query_bytes_ += msg->size();
+    broadcast(i, std::move(msg));
+    p.dl.query_sends++;
+    at(now_ + QUERY_RESEND_MS / 1000.0, event(Ev::QueryResend, i));
+}
+
+// find_peers(): fetch the catalogs that are out of date and may list the
+// file, then take the holders.
+void Simulation::on_query_done(int i) {
+    Peer &p = peers_[(size_t)i];
+    Download &d = p.dl;
+    if (!d.querying) return;
+    d.querying = false;
+    for (auto &ep : p.table->stale_catalogs(&WANTED, std::chrono::seconds(CATALOG_RETRY_SECS))) {
+        auto it = by_addr_.find(ep.addr);
+        if (it == by_addr_.end()) continue;
+        Peer &src = peers_[(size_t)it->second];
+        Event e = event(Ev::CatalogDone, i, it->second);
+        d.pending_catalogs++;
+        catalog_fetches_++;
+        if (!src.online) {
+            at(now_ + CONNECT_TIMEOUT, std::move(e));
+            continue;
+        }
+        CatalogFiles files = shared_files(src), part = partial_files(src);
+        e.msg = std::make_shared<const std::string>(serialize_catalog(files, catalog_digest(files, part), part));
+        // connect + HELLO, then CATALOG and its body
+        double secs = 2 * rtt(p, src) + (double)(e.msg->size() + MESSAGE_HEADER) / flow_rate(src, p);
+        at(now_ + secs, std::move(e));
+    }
+    if (d.pending_catalogs == 0) begin_download(i);
+}
+
+void Simulation::on_catalog_done(const Event& e) {
+    Peer &p = peers_[(size_t)e.peer];
+    Peer &src = peers_[(size_t)e.other];
+    CatalogFiles files, part;
+    uint64_t digest = 0;
+    if (e.msg && parse_catalog(*e.msg, files, digest, &part)) {
+        catalog_bytes_ += e.msg->size();
+        src.control_sent += e.msg->size();
+        p.control_received += e.msg->size();
+        std::map<std::string, uint64_t> f, pf;
+        for (auto &kv : files) f.emplace(kv.first, kv.second.size);
+        for (auto &kv : part) pf.emplace(kv.first, kv.second.size);
+        if (!f.count(WANTED) && !pf.count(WANTED)) bloom_false_positives_++;
+        p.table->catalog_fetched({src.addr, PORT}, std::move(f), digest, std::move(pf));
+    } else {
+        catalog_failures_++;
+    }
+    if (--p.dl.pending_catalogs == 0) begin_download(e.peer);
+}
+
+
+// ---------------------------------------------------------------
+// Download
+// ---------------------------------------------------------------
+void Simulation::begin_download(int i) {
+    Peer &p = peers_[(size_t)i];
+    Download &d = p.dl;
+    d.resolved = now_;
+    std::vector<std::pair<int, bool>> found;   // peer, partial
+    for (auto &info : p.table->holders(WANTED)) {
+        auto it = by_addr_.find(info->addr);
+        if (it != by_addr_.end()) found.push_back({it->second, info->files.count(WANTED) == 0});
+    }
+    std::stable_sort(found.begin(), found.end(), [](const std::pair<int, bool> &a, const std::pair<int, bool> &b) {
+        return !a.second && b.second;
+    });
+    if (found.empty()) {
+        std::cerr << "[sim] " << now_ << " s: peer " << i << " found no source\n";
+        finish(i, false);
+        return;
+    }
+    d.sched = std::make_unique<PieceScheduler>(cfg_.file, cfg_.piece, cfg_.conns);
+    d.sched->set_rarest_first(rng_());
+    for (auto &s : found) {
+        d.sources.push_back(s.first);
+        d.source_ids.push_back(peers_[(size_t)s.first].peer_id);
+        d.partial.push_back(s.second);
+        // partial sources count once their HAVE maps come in
+        if (!s.second) d.sched->add_holder(nullptr);
+    }
+    // seed finished pieces meanwhile
+    p.partial = true;
+    p.announce_dirty = true;
+    d.conns.resize((size_t)cfg_.conns);
+    for (int c = 0; c < cfg_.conns; ++c) {
+        d.conns[(size_t)c].source = c % (int)d.sources.size();
+        connect(i, c);
+    }
+}
+
+// Connects `c` to its source, or to the next one still there.
+void Simulation::connect(int i, int c) {
+    Peer &p = peers_[(size_t)i];
+    Download &d = p.dl;
+    Conn &k = d.conns[(size_t)c];
+    int n = (int)d.sources.size();
+    for (int tries = 0; tries < n && !alive(d, k.source); ++tries) k.source = (k.source + 1) % n;
+    if (!alive(d, k.source)) {
+        for (int s = 0; s < n; ++s) {
+            if (alive(d, s)) return;    // other connections still have a source
+        }
+        std::cerr << "[sim] " << now_ << " s: peer " << i << " has no usable peers left\n";
+        finish(i, false);
+        return;
+    }
+    // a partial source's old map goes with the old connection
+    if (!k.have.empty()) {
+        d.sched->update_holder(k.have, {});
+        k.have.clear();
+    }
+    k.source_id = d.source_ids[(size_t)k.source];
+    k.warm = false;
+    k.idle_polls = 0;
+    at(now_ + rtt(p, peers_[(size_t)d.sources[(size_t)k.source]]), event(Ev::ConnReady, i, -1, c));
+}
+
+void Simulation::on_conn_ready(int i, int c) {
+    Download &d = peers_[(size_t)i].dl;
+    if (d.partial[(size_t)d.conns[(size_t)c].source]) {
+        // ask for its HAVE map first
+        Event e = event(Ev::HaveDone, i, -1, c);
+        Peer &src = peers_[(size_t)d.sources[(size_t)d.conns[(size_t)c].source]];
+        double bytes = (double)(src.have.size() + 7) / 8 + MESSAGE_HEADER;
+        at(now_ + rtt(peers_[(size_t)i], src) + bytes / flow_rate(src, peers_[(size_t)i]), std::move(e));
+        return;
+    }
+    on_conn_next(i, c);
+}
+
+void Simulation::on_have_done(int i, int c) {
+    Download &d = peers_[(size_t)i].dl;
+    Conn &k = d.conns[(size_t)c];
+    if (!alive(d, k.source)) {
+        on_conn_next(i, c);
+        return;
+    }
+    Peer &src = peers_[(size_t)d.sources[(size_t)k.source]];
+    uint64_t bytes = (src.have.size() + 7) / 8 + MESSAGE_HEADER;
+    have_requests_++;
+    have_bytes_ += bytes;
+    src.control_sent += bytes;
+    peers_[(size_t)i].control_received += bytes;
+    d.sched->update_holder(k.have, src.have);
+    k.have = src.have;
+    on_conn_next(i, c);
+}
+
+void Simulation::on_conn_next(int i, int c) {
+    Peer &p = peers_[(size_t)i];
+    Download &d = p.dl;
+    if (d.done >= 0) return;
+    Conn &k = d.conns[(size_t)c];
+    if (!alive(d, k.source)) {
+        k.source = (k.source + 1) % (int)d.sources.size();
+        connect(i, c);
+        return;
+    }
+    Peer &src = peers_[(size_t)d.sources[(size_t)k.source]];
+    bool partial = d.partial[(size_t)k.source];
+    Piece piece;
+    if (d.sched->next(c, piece, false, partial ? &k.have : nullptr)) {
+        uint64_t len = piece.end - piece.start;
+        double secs = (double)(len + MESSAGE_HEADER) / flow_rate(src, p) + (k.warm ? 0 : rtt(p, src));
+        k.warm = true;
+        k.idle_polls = 0;
+        src.active_up++;
+        p.active_down++;
+        Event e = event(Ev::PieceDone, i, d.sources[(size_t)k.source], c);
+        e.piece = piece;
+        at(now_ + secs, std::move(e));
+        return;
+    }
+    k.warm = false;
+    if (!partial) {
+        // everything it could ask for is in flight elsewhere
+        at(now_ + BUSY_WAIT, event(Ev::ConnNext, i, -1, c));
+        return;
+    }
+    // nothing we need from this source yet; see whether it has more soon,
+    // or give up on it for another
+    if (++k.idle_polls > STARVE_POLLS) {
+        k.source = (k.source + 1) % (int)d.sources.size();
+        connect(i, c);
+        return;
+    }
+    double bytes = (double)(src.have.size() + 7) / 8 + MESSAGE_HEADER;
+    at(now_ + HAVE_POLL + rtt(p, src) + bytes / flow_rate(src, p), event(Ev::HaveDone, i, -1, c));
+}
+
+void Simulation::on_piece_done(const Event& e) {
+    Peer &p = peers_[(size_t)e.peer];
+    Peer &src = peers_[(size_t)e.other];
+    Download &d = p.dl;
+    src.active_up--;
+    p.active_down--;
+    if (d.done >= 0) return;
+    Conn &k = d.conns[(size_t)e.conn];
+    if (!alive(d, k.source)) {
+        // the source left mid-transfer
+        pieces_failed_++;
+        d.sched->fail(e.piece, false);
+        on_conn_next(e.peer, e.conn);
+        return;
+    }
+    uint64_t len = e.piece.end - e.piece.start;
+    src.sent += len;
+    p.received += len;
+    if (d.sched->complete(e.piece)) p.have[(size_t)e.piece.index] = true;
+    else d.dup_bytes += len;
+    if (d.sched->finished()) {
+        finish(e.peer, true);
+        return;
+    }
+    on_conn_next(e.peer, e.conn);
+}
+
+// get exits when it's done; a finished downloader leaves after --linger.
+void Simulation::finish(int i, bool ok) {
+    Peer &p = peers_[(size_t)i];
+    Download &d = p.dl;
+    if (d.done >= 0 || d.failed) return;
+    if (ok) {
+        d.done = now_;
+        p.full = true;
+        std::cerr << "[sim] " << now_ << " s: peer " << i << " done in " << now_ - d.start << " s\n";
+    } else {
+        d.failed = true;
+    }
+    p.partial = false;
+    p.announce_dirty = true;
+    active_downloads_--;
+    if (cfg_.linger > 0) at(now_ + cfg_.linger, event(Ev::Leave, i));
+    else leave(i);
+}
+
+
+// ---------------------------------------------------------------
+// Churn
+// ---------------------------------------------------------------
+void Simulation::leave(int i) {
+    Peer &p = peers_[(size_t)i];
+    if (!p.online) return;
+    p.online = false;
+    departures_++;
+    if (p.churns) at(now_ + exponential(cfg_.session), event(Ev::Join, i));
+}
+
+void Simulation::join(int i) {
+    start_peer(i);
+    at(now_ + exponential(cfg_.session), event(Ev::Leave, i));
+}
+
+
+// ---------------------------------------------------------------
+// Main loop
+// ---------------------------------------------------------------
+void Simulation::run() {
+    setup();
+    while (!queue_.empty() && active_downloads_ > 0) {
+        Event e = queue_.top();
+        queue_.pop();
+        if (e.t > cfg_.time) break;
+        now_ = e.t;
+        events_++;
+        Peer &p = peers_[(size_t)e.peer];
+        // events of a process that has since exited or restarted
+        bool current = p.online && e.id == p.peer_id;
+        switch (e.kind) {
+            case Ev::Tick:        if (current) on_tick(e); break;
+            case Ev::Datagram:    if (current) on_datagram(e); break;
+            case Ev::GetStart:    on_get_start(e.peer); break;
+            case Ev::QueryResend: on_query_resend(e.peer); break;
+            case Ev::QueryDone:   on_query_done(e.peer); break;
+            case Ev::CatalogDone: on_catalog_done(e); break;
+            case Ev::ConnReady:   if (p.dl.done < 0 && !p.dl.failed) on_conn_ready(e.peer, e.conn); break;
+            case Ev::ConnNext:    if (!p.dl.failed) on_conn_next(e.peer, e.conn); break;
+            case Ev::HaveDone:    if (p.dl.done < 0 && !p.dl.failed) on_have_done(e.peer, e.conn); break;
+            case Ev::PieceDone:   on_piece_done(e); break;
+            case Ev::Leave:       if (current) leave(e.peer); break;
+            case Ev::Join:        if (!p.online) join(e.peer); break;
+        }
+    }
+}
+
+void Simulation::report() const {
+    std::vector<double> completion, discovery, down_sent, table_end;
+    uint64_t payload = 0, seed_sent = 0, dup = 0, control = 0, announce_rx = 0;
+    size_t table_peak = 0;
+    int completed = 0, failed = 0, unfinished = 0;
+    for (auto &p : peers_) {
+        payload += p.received;
+        control += p.control_received;
+        table_peak = std::max(table_peak, p.table_peak);
+        if (p.online) table_end.push_back((double)p.table->memory_bytes());
+        if (p.role == Role::Seed) seed_sent += p.sent;
+        if (p.role != Role::Downloader) continue;
+        const Download &d = p.dl;
+        dup += d.dup_bytes;
+        down_sent.push_back((double)p.sent);
+        if (d.resolved >= 0) discovery.push_back((d.resolved - d.start) * 1e3);
+        if (d.done >= 0) {
+            completed++;
+            completion.push_back(d.done - d.start);
+        } else if (d.failed) {
+            failed++;
+        } else {
+            unfinished++;
+        }
+    }
+    announce_rx = control;
+    double avg_table = 0;
+    for (double b : table_end) avg_table += b;
+    if (!table_end.empty()) avg_table /= (double)table_end.size();
+
+    std::printf("{\"peers\":%d,\"seeds\":%d,\"downloaders\":%d,\"file\":%llu,\"piece\":%llu,\"conns\":%d,"
+                "\"loss\":%.4f,\"churn\":%.3f,\"seed\":%llu,\"sim_seconds\":%.3f,\"events\":%llu,"
+                "\"completed\":%d,\"failed\":%d,\"unfinished\":%d,"
+                "\"completion_s\":{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"max\":%.3f},"
+                "\"discovery_ms_p50\":%.1f,\"payload_bytes\":%llu,\"seed_upload_share\":%.4f,"
+                "\"downloader_upload_bytes\":{\"p50\":%.0f,\"max\":%.0f},\"endgame_dup_bytes\":%llu,"
+                "\"pieces_failed\":%llu,\"departures\":%llu,"
+                "\"announces\":%llu,\"announce_bytes\":%llu,\"queries\":%llu,\"query_bytes\":%llu,"
+                "\"query_replies\":%llu,\"datagrams_lost\":%llu,\"catalog_fetches\":%llu,"
+                "\"catalog_failures\":%llu,\"catalog_bytes\":%llu,\"bloom_false_positives\":%llu,"
+                "\"have_requests\":%llu,\"have_bytes\":%llu,\"control_bytes_received\":%llu,"
+                "\"control_overhead\":%.5f,\"peer_table_bytes\":{\"avg\":%.0f,\"max\":%.0f,\"peak\":%zu}}\n",
+                cfg_.peers, cfg_.seeds, cfg_.downloaders, (unsigned long long)cfg_.file,
+                (unsigned long long)cfg_.piece, cfg_.conns, cfg_.loss, cfg_.churn, (unsigned long long)cfg_.seed,
+                now_, (unsigned long long)events_, completed, failed, unfinished,
+                completion.empty() ? 0 : *std::min_element(completion.begin(), completion.end()),
+                percentile(completion, 0.5), percentile(completion, 0.9),
+                completion.empty() ? 0 : *std::max_element(completion.begin(), completion.end()),
+                percentile(discovery, 0.5), (unsigned long long)payload,
+                payload ? (double)seed_sent / (double)payload : 0, percentile(down_sent, 0.5),
+                down_sent.empty() ? 0 : *std::max_element(down_sent.begin(), down_sent.end()),
+                (unsigned long long)dup, (unsigned long long)pieces_failed_, (unsigned long long)departures_,
+                (unsigned long long)announces_, (unsigned long long)announce_bytes_, (unsigned long long)queries_,
+                (unsigned long long)query_bytes_, (unsigned long long)query_replies_,
+                (unsigned long long)datagrams_lost_, (unsigned long long)catalog_fetches_,
+                (unsigned long long)catalog_failures_, (unsigned long long)catalog_bytes_,
+                (unsigned long long)bloom_false_positives_, (unsigned long long)have_requests_,
+                (unsigned long long)have_bytes_, (unsigned long long)announce_rx,
+                payload ? (double)control / (double)payload : 0, avg_table,
+                table_end.empty() ? 0 : *std::max_element(table_end.begin(), table_end.end()), table_peak);
+
+    if (!cfg_.per_peer) return;
+    for (size_t i = 0; i < peers_.size(); ++i) {
+        const Peer &p = peers_[i];
+        const Download &d = p.dl;
+        std::printf("{\"peer\":%zu,\"role\":\"%s\",\"latency_ms\":%.1f,\"up\":%.0f,\"down\":%.0f,\"online\":%s,"
+                    "\"sent\":%llu,\"received\":%llu,\"control_sent\":%llu,\"control_received\":%llu,"
+                    "\"table_bytes_peak\":%zu,\"completion_s\":%.3f}\n",
+                    i, role_name(p.role), p.latency * 1e3, p.up, p.down, p.online ? "true" : "false",
+                    (unsigned long long)p.sent, (unsigned long long)p.received,
+                    (unsigned long long)p.control_sent, (unsigned long long)p.control_received, p.table_peak,
+                    d.done >= 0 ? d.done - d.start : -1.0);
+    }
+}
+
+
+// ---------------------------------------------------------------
+// Command line
+// ---------------------------------------------------------------
+// "lo-hi" or a single value; `ms` for milliseconds, else byte sizes (10M).
+bool parse_range(const std::string& s, Range& out, bool ms) {
+    auto parts = split(s, '-');
+    if (parts.empty() || parts.size() > 2) return false;
+    double v[2];
+    for (size_t i = 0; i < parts.size(); ++i) {
+        uint64_t b = 0;
+        if (ms) v[i] = atof(parts[i].c_str()) / 1000.0;
+        else if (parse_bytes(trim(parts[i]), b)) v[i] = (double)b;
+        else return false;
+    }
+    out.lo = v[0];
+    out.hi = parts.size() == 2 ? v[1] : v[0];
+    return out.lo > 0 && out.hi >= out.lo;
+}
+
+void usage() {
+    std::cerr << "Usage: p2p_sim [--peers 200] [--seeds 2] [--downloaders 40] [--file 128M] [--piece 1M]\n"
+                 "               [--conns 4] [--files 20] [--latency 2-40] [--up 2M-20M] [--down 10M-100M]\n"
+                 "               [--loss 0] [--churn 0] [--session 120] [--warmup 5] [--stagger 10]\n"
+                 "               [--linger 0] [--time 3600] [--seed 1] [--per-peer]\n"
+                 "  latency: one-way ms per peer; up/down: bytes/s per peer, drawn from the range.\n"
+                 "  One JSON object on stdout (and one per peer with --per-peer).\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--help" || opt == "-h") { usage(); return 0; }
+        if (opt == "--per-peer") { cfg.per_peer = true; continue; }
+        if (i + 1 >= argc) { usage(); return 1; }
+        std::string val = argv[++i];
+        bool ok = true;
+        if (opt == "--peers") cfg.peers = atoi(val.c_str());
+        else if (opt == "--seeds") cfg.seeds = atoi(val.c_str());
+        else if (opt == "--downloaders") cfg.downloaders = atoi(val.c_str());
+        else if (opt == "--file") ok = parse_bytes(val, cfg.file);
+        else if (opt == "--piece") ok = parse_bytes(val, cfg.piece);
+        else if (opt == "--conns") cfg.conns = atoi(val.c_str());
+        else if (opt == "--files") cfg.files = atoi(val.c_str());
+        else if (opt == "--latency") ok = parse_range(val, cfg.latency, true);
+        else if (opt == "--up") ok = parse_range(val, cfg.up, false);
+        else if (opt == "--down") ok = parse_range(val, cfg.down, false);
+        else if (opt == "--loss") cfg.loss = atof(val.c_str());
+        else if (opt == "--churn") cfg.churn = atof(val.c_str());
+        else if (opt == "--session") cfg.session = atof(val.c_str());
+        else if (opt == "--warmup") cfg.warmup = atof(val.c_str());
+        else if (opt == "--stagger") cfg.stagger = atof(val.c_str());
+        else if (opt == "--linger") cfg.linger = atof(val.c_str());
+        else if (opt == "--time") cfg.time = atof(val.c_str());
+        else if (opt == "--seed") cfg.seed = strtoull(val.c_str(), nullptr, 10);
+        else ok = false;
+        if (!ok) { usage(); return 1; }
+    }
+    if (cfg.peers < 1 || cfg.seeds < 1 || cfg.downloaders < 1 || cfg.seeds + cfg.downloaders > cfg.peers ||
+        cfg.piece == 0 || cfg.file == 0 || cfg.conns < 1 || cfg.loss < 0 || cfg.loss >= 1 || cfg.session <= 0) {
+        usage();
+        return 1;
+    }
+
+    auto wall = SteadyClock::now();
+    Simulation sim(cfg);
+    sim.run();
+    sim.report();
+    std::cerr << "[sim] " << std::chrono::duration<double>(SteadyClock::now() - wall).count() << " s wall\n";
+    return 0;
+}
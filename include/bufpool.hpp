@@ -0,0 +1,93 @@
+#ifndef BUFPOOL_HPP
+#define BUFPOOL_HPP
+
+#include <vector>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+class BufferPool;
+
+// A transfer buffer on loan from a BufferPool; goes back to the pool when
+// destroyed or reset. size() is the buffer's size class, at least what was
+// asked for.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    ~PooledBuffer() { reset(); }
+    PooledBuffer(PooledBuffer&& o) noexcept { *this = std::move(o); }
+    PooledBuffer& operator=(PooledBuffer&& o) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return data_ == nullptr; }
+    void reset();
+
+private:
+    friend class BufferPool;
+    BufferPool *pool_ = nullptr;
+    char *data_ = nullptr;
+    size_t size_ = 0;
+    int cls_ = 0;
+};
+
+// Piece and body buffers for servers and downloads, shared by the whole
+// process. Sizes are rounded up to a power of two from 64 KiB; classes below
+// 2 MiB are carved out of 2 MiB slabs, bigger ones are mapped one by one.
+// Buffers handed back are kept for reuse, never freed to the heap.
+//
+// With a budget, the bytes on loan and the bytes mapped stay under it: a
+// request that doesn't fit first unmaps idle large buffers of other sizes,
+// then fails (try_acquire) or waits for a buffer to come back (acquire). A request is always granted
+// when nothing else is on loan, so a budget below one buffer can't wedge it;
+// idle buffers are still unmapped for it, so only that grant can exceed it.
+class BufferPool {
+public:
+    // budget 0: unlimited. With `hugepages`, mappings of 2 MiB and up ask for
+    // explicit huge pages and fall back to transparent ones.
+    void configure(size_t budget, bool hugepages);
+
+    PooledBuffer try_acquire(size_t len);
+    // Waits while over budget; empty if `abort` says so first.
+    PooledBuffer acquire(size_t len, const std::function<bool()> &abort = nullptr);
+
+    struct Stats {
+        uint64_t budget = 0;
+        uint64_t mapped = 0;        // bytes taken from the system
+        uint64_t in_use = 0;        // on loan now
+        uint64_t peak_in_use = 0;
+        uint64_t huge = 0;          // mapped bytes backed by explicit huge pages
+        uint64_t waits = 0;         // requests that had to wait (or failed) for the budget
+    };
+    Stats stats() const;
+
+private:
+    friend class PooledBuffer;
+    static constexpr size_t MIN_CLASS = 64 * 1024;
+    static constexpr size_t SLAB_BYTES = 2 * 1024 * 1024;
+    static constexpr int CLASSES = 15;      // 64 KiB .. 1 GiB
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    size_t budget_ = 0;
+    bool hugepages_ = false;
+    uint64_t mapped_ = 0, in_use_ = 0, peak_ = 0, huge_ = 0;
+    std::atomic<uint64_t> waits_{0};
+    std::vector<char*> free_[CLASSES];
+    std::set<char*> huge_maps_;             // mappings that got MAP_HUGETLB
+
+    PooledBuffer get(size_t len, bool wait, const std::function<bool()> &abort);
+    bool make_room(size_t need, int keep);
+    void release(char *data, int cls);
+};
+
+BufferPool& buffer_pool();
+
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef CATALOG_HPP
+#define CATALOG_HPP
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+struct CatalogEntry {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const CatalogEntry& o) const { return size == o.size && mtime_ns == o.mtime_ns; }
+    bool operator!=(const CatalogEntry& o) const { return !(*this == o); }
+};
+
+// Shared file name (relative to the folder) -> entry. Transparent comparator,
+// so request handling can look names up straight from the request buffer.
+using CatalogFiles = std::map<std::string, CatalogEntry, std::less<>>;
+
+// Whether a name can be used as a path under the download directory: relative,
+// with no empty, "." or ".." components. Names in a peer's catalog must pass,
+// since globs and directory names expand to them.
+bool safe_file_name(std::string_view name);
+
+// XXH64 over the sorted names and sizes; what peers compare to decide whether
+// their copy of a catalog is current (mtimes don't take part). Files still
+// being downloaded (`partial`), if any, are hashed in after the shared ones.
+uint64_t catalog_digest(const CatalogFiles& files, const CatalogFiles& partial = {});
+
+// Text form sent in reply to CATALOG:
+//   P2PCATALOG 1 <digest hex> <count>\n
+//   <size> <name>\n   (one line per file)
+// followed, on a node that is downloading files and seeding their finished
+// pieces, by
+//   P2PPARTIAL <count>\n
+//   <size> <name>\n
+// Older parsers stop after the counted files and reject the digest, which
+// only costs them the catalog of a node that shares nothing in full.
+std::string serialize_catalog(const CatalogFiles& files, uint64_t digest, const CatalogFiles& partial = {});
+// Fails unless the entries hash to the digest in the header and every name
+// passes safe_file_name(). `partial`, if
+// given, receives the partial section.
+bool parse_catalog(const std::string& text, CatalogFiles& files, uint64_t& digest,
+                   CatalogFiles *partial = nullptr);
+
+// In-memory index of the regular files in a shared folder. It is built by one
+// scan and then kept current from inotify events, so announcing the file list
+// and answering requests don't touch the disk. Readers get immutable
+// snapshots; a burst of events publishes a single new one.
+//
+// In recursive mode files in subdirectories are listed as "dir/name". The
+// manifest cache directory (.p2p) is never listed. Without inotify (or once
+// its watch limit is hit) the folder is rescanned every couple of seconds.
+class Catalog {
+public:
+    Catalog(const std::string& folder, bool recursive = false);
+    ~Catalog();
+
+    Catalog(const Catalog&) = delete;
+    Catalog& operator=(const Catalog&) = delete;
+
+    // Initial scan, then start watching. False if the folder can't be read.
+    bool start();
+    void stop();
+
+    // `digest`, if given, receives catalog_digest() of the returned snapshot.
+    std::shared_ptr<const CatalogFiles> snapshot(uint64_t *digest = nullptr) const;
+    bool lookup(std::string_view name, CatalogEntry& out) const;
+
+    // Bumped every time the published file list changes.
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+    const std::string& folder() const { return folder_; }
+    bool recursive() const { return recursive_; }
+    std::string path_of(std::string_view name) const { return folder_ + "/" + std::string(name); }
+
+private:
+    std::string folder_;
+    bool recursive_;
+
+    mutable std::mutex mu_;
+    std::shared_ptr<const CatalogFiles> published_;
+    uint64_t digest_ = 0;
+    std::atomic<uint64_t> version_{0};
+
+    // watcher-thread state
+    CatalogFiles files_;
+    std::map<int, std::string> watches_;    // inotify wd -> relative dir ("" = root)
+    int inotify_fd_ = -1;
+    bool polling_ = false;                  // fall back to periodic rescans
+    bool dirty_ = false;
+
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void rescan();
+    void scan_dir(const std::string& rel);
+    void add_watch(const std::string& rel);
+    void refresh(const std::string& name);
+    void forget_dir(const std::string& rel);
+    void handle_events();
+    void publish();
+    void worker();
+};
+
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "filecache.hpp"
+
+// LZ4 block format (no frame header), compatible with LZ4_compress_default /
+// LZ4_decompress_safe. Greedy single-probe matcher: fast rather than tight.
+size_t lz4_bound(size_t n);
+// Returns the compressed size, or 0 if it doesn't fit in `cap`.
+size_t lz4_compress(const char *src, size_t n, char *dst, size_t cap);
+// True only if `src` decodes to exactly `out_len` bytes.
+bool lz4_decompress(const char *src, size_t n, char *dst, size_t out_len);
+
+// Compresses a sample from the start of `data`; false if it doesn't shrink
+// by at least 10%, so already-compressed data isn't worth the full pass.
+bool worth_compressing(const char *data, size_t n);
+
+// Largest range a server compresses; bigger ones go out raw.
+static constexpr uint64_t MAX_COMPRESSED_RANGE = 16 << 20;
+
+// LZ4-compressed file ranges for the file server, kept in an LRU bounded by
+// `capacity` bytes so hot pieces are compressed once. Ranges found not to
+// compress are remembered too and sent raw from then on. Entries are keyed by
+// file, mtime and range, so a changed file never serves stale data.
+//
+// Misses are read and compressed by `workers` threads of its own, never on a
+// reactor: a 16 MiB range would otherwise stall every connection the reactor
+// serves for the whole pass.
+class CompressedPieces {
+public:
+    using Done = std::function<void(std::shared_ptr<const std::string>)>;
+
+    explicit CompressedPieces(size_t capacity, int workers = 2);
+    ~CompressedPieces();
+
+    // True if the answer is known without compressing: `out` is the cached
+    // body, or null if the range should be sent raw (incompressible or too
+    // large). False on a miss.
+    bool cached(std::string_view name, int64_t mtime_ns, uint64_t start, uint64_t end,
+                std::shared_ptr<const std::string> &out);
+    // Reads and compresses [start, end) of `file` on a worker, caches the
+    // result and hands it to `done` on that worker (null: send raw). False,
+    // without calling `done`, if too many ranges are already waiting.
+    bool compress(std::string_view name, int64_t mtime_ns, std::shared_ptr<const OpenFile> file,
+                  uint64_t start, uint64_t end, Done done);
+
+    struct Stats {
+        uint64_t hits = 0;          // served from the cache
+        uint64_t compressed = 0;    // compressed on demand
+        uint64_t skipped = 0;       // found incompressible
+        uint64_t overflow = 0;      // sent raw because the workers were backed up
+        uint64_t raw_bytes = 0;     // file bytes behind compressed replies
+        uint64_t wire_bytes = 0;    // what those replies actually carried
+    };
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const std::string> data;    // null: incompressible
+    };
+
+    struct Job {
+        std::string key;
+        std::shared_ptr<const OpenFile> file;
+        uint64_t start = 0, end = 0;
+        Done done;
+    };
+
+    size_t capacity_;
+    size_t used_ = 0;
+    std::list<Entry> lru_;                          // most recent first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    mutable std::mutex mu_;
+
+    std::deque<Job> jobs_;
+    std::condition_variable jobs_cv_;
+    bool running_ = true;
+    std::vector<std::thread> workers_;
+
+    std::atomic<uint64_t> hits_{0}, compressed_{0}, skipped_{0}, overflow_{0}, raw_bytes_{0}, wire_bytes_{0};
+
+    void insert(std::string key, std::shared_ptr<const std::string> data);
+    void worker();
+    std::shared_ptr<const std::string> compress_range(const Job &job);
+};
+
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef CONNECTION_HPP
+#define CONNECTION_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+#include <sys/types.h>
+
+struct Response {
+    bool ok = false;
+    uint32_t id = 0;
+    uint64_t length = 0;        // body bytes that follow an OK
+    bool compressed = false;    // body is an LZ4 block of the requested range
+    std::string error;          // reason after ERR
+};
+
+// Buffered reader over a socket from connect_to(). Header lines are cut out
+// of the buffer instead of being read a byte per recv(); whatever arrives
+// behind a line (the start of a body, the next pipelined reply) stays
+// buffered and is handed out by the next read.
+class SocketReader {
+public:
+    explicit SocketReader(size_t capacity = 64 * 1024);
+
+    void reset(int fd);
+
+    // `line` (including its '\n') points into the buffer and stays valid
+    // until the next call. Fails on EOF, abort, or a line over `max_len`.
+    bool read_line(std::string_view &line, const std::function<bool()> &abort, size_t max_len = 4096);
+    // Whether the last failed read was the peer closing cleanly.
+    bool eof() const { return eof_; }
+
+    // Buffered bytes first, then straight from the socket into `dst`.
+    bool read_exact(char *dst, uint64_t len, std::atomic<uint64_t> *progress,
+                    const std::function<bool()> &abort);
+
+private:
+    int fd_ = -1;
+    std::vector<char> buf_;
+    size_t pos_ = 0;        // first unread byte
+    size_t end_ = 0;        // one past the last buffered byte
+    bool eof_ = false;
+};
+
+// Persistent client connection to a peer's file server (protocol v2).
+// Requests are pipelined: send_get() can be called several times before the
+// matching read_response()/read_body() pairs, which come back in order.
+// Requests are buffered and go out together on the next read (or flush()).
+class PeerConnection {
+public:
+    PeerConnection(const std::string& host, int port);
+    ~PeerConnection();
+
+    PeerConnection(const PeerConnection&) = delete;
+    PeerConnection& operator=(const PeerConnection&) = delete;
+
+    // Connect and handshake. Returns false if the peer can't be reached or
+    // doesn't speak v2; legacy() tells the two apart. Only a clean close or an
+    // ERR in reply to HELLO means v1: a reset or a timeout says nothing about
+    // the version.
+    bool open();
+    void close();
+    bool is_open() const { return fd_ >= 0; }
+    bool legacy() const { return legacy_; }
+    // Round trip of the handshake, a baseline for how long a request takes
+    // when nothing is queued ahead of it.
+    double rtt_ms() const { return rtt_ms_; }
+
+    // With `compress` the server may answer with an LZ4 body instead.
+    bool send_get(uint32_t id, const std::string& filename, uint64_t start, uint64_t end,
+                  bool compress = false);
+    // With `weak` the manifest also carries rolling checksums (delta transfers).
+    bool send_manifest(uint32_t id, const std::string& filename, uint64_t piece_size, bool weak = false);
+    bool send_catalog(uint32_t id);
+    // Which pieces (of `piece_size` bytes) the peer can serve.
+    bool send_have(uint32_t id, const std::string& filename, uint64_t piece_size);
+    bool send_stats(uint32_t id);
+    bool flush();
+    bool read_response(Response &r, const std::function<bool()> &abort = nullptr);
+    bool read_body(char *dst, uint64_t len, std::atomic<uint64_t> *progress = nullptr,
+                   const std::function<bool()> &abort = nullptr);
+
+private:
+    std::string host_;
+    int port_;
+    int fd_ = -1;
+    bool legacy_ = false;
+    double rtt_ms_ = 0;
+    std::string out_;               // requests not yet sent
+    SocketReader in_;
+
+    bool send_all(const char *data, size_t len);
+};
+
+// Parses "OK <id> <len> [lz4]" / "ERR <id> <reason>".
+bool parse_response(std::string_view line, Response &r);
+
+// Connected TCP socket to host:port with a 1 s receive timeout, or -1.
+int connect_to(const std::string& host, int port);
+
+// recv() on a socket from connect_to(), retrying timeouts until data arrives.
+// Returns 0 on EOF (the peer closed cleanly), -1 on an error, `abort` or a
+// peer that stays silent too long.
+ssize_t recv_some(int fd, void *dst, size_t len, const std::function<bool()> &abort);
+
+
+#endif
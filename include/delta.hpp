@@ -0,0 +1,50 @@
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "manifest.hpp"
+
+// Delta transfer: rebuilding a new version of a file mostly out of an old
+// local copy. The seeder's manifest carries, for every piece, a weak rolling
+// checksum next to the strong XXH64; the client slides a piece-sized window
+// over its old copy, and wherever the weak sum matches a piece and the
+// strong hash confirms it, that piece comes from disk instead of the network.
+// Pieces are found at any offset, so inserts and deletes only cost the
+// pieces that actually changed.
+
+// rsync's rolling checksum: two 16-bit sums over a window, updated in O(1)
+// as the window slides by one byte.
+class RollingSum {
+public:
+    void init(const unsigned char *data, size_t len);
+    void roll(unsigned char out, unsigned char in) {
+        a_ += (uint32_t)in - out;
+        b_ += a_ - len_ * out;
+    }
+    // both sums are kept mod 2^32 and only reduced to 16 bits here
+    uint32_t digest() const { return (a_ & 0xffff) | (b_ << 16); }
+
+private:
+    uint32_t a_ = 0, b_ = 0;
+    uint32_t len_ = 0;
+};
+
+uint32_t weak_sum(const void *data, size_t len);
+
+// Where piece `index` of the new version sits in the old copy.
+struct DeltaMatch {
+    size_t index;
+    uint64_t base_offset;
+};
+
+// Scans `base` (an old copy, `base_size` bytes in memory) for pieces of `m`,
+// which must carry weak sums. Pieces with `skip[i]` set are not looked for.
+std::vector<DeltaMatch> find_reusable(const unsigned char *base, uint64_t base_size,
+                                      const Manifest& m, const std::vector<bool>& skip);
+
+
+#endif
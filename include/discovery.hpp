@@ -0,0 +1,83 @@
+#ifndef DISCOVERY_HPP
+#define DISCOVERY_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// UDP announce, one fixed-size datagram per peer no matter how many files it
+// shares (all integers little-endian):
+//   0   4  magic "P2PA"
+//   4   1  format version (1)
+//   5   1  Bloom hash count k (0 = no filter)
+//   6   2  TCP service port
+//   8   8  peer ID (random per process)
+//   16  8  catalog digest (catalog_digest() of the shared and partial files)
+//   24  4  file count (partial files included)
+//   28  2  Bloom filter length in bytes
+//   30  .. Bloom filter over the file names, partial ones included
+// Listeners fetch the file list itself with CATALOG over TCP, and only when
+// the digest differs from the one they last fetched.
+struct Announce {
+    uint64_t peer_id = 0;
+    int port = 0;
+    uint64_t digest = 0;
+    uint32_t file_count = 0;
+    uint8_t bloom_k = 0;
+    std::vector<uint8_t> bloom;
+};
+
+static constexpr size_t ANNOUNCE_HEADER = 30;
+static constexpr size_t MAX_BLOOM_BYTES = 1024;    // keeps the datagram under one Ethernet MTU
+
+std::string encode_announce(const Announce& a);
+bool decode_announce(const char *data, size_t len, Announce& out);
+
+// Size the filter for `names` (about 10 bits per name, capped at
+// MAX_BLOOM_BYTES) and set their bits.
+void bloom_build(const std::vector<std::string>& names, Announce& a);
+
+// False only if `name` is certainly not in the announcing peer's catalog.
+// Always true when the announce carries no filter.
+bool bloom_may_contain(const Announce& a, const std::string& name);
+
+// Active query, broadcast to the discovery port by a peer that wants an
+// answer now rather than at the next periodic announce:
+//   0   4  magic "P2PQ"
+//   4   1  format version (1)
+//   5   1  reserved (0)
+//   6   2  file name length (0 = any peer)
+//   8   8  peer ID of the asker
+//   16  .. file name
+// Peers that share (or are seeding part of) the file, or any peer for an
+// empty name, reply straight away by unicast to the sender's address and
+// port with their announce minus the Bloom filter (encode_query_reply): the
+// source address isn't verified, so a forged query must not be worth much
+// more than it costs. The filter comes with the periodic broadcasts. Each
+// source address gets at most QUERY_REPLIES_PER_SEC replies a second.
+struct Query {
+    uint64_t peer_id = 0;
+    std::string name;
+};
+
+static constexpr size_t QUERY_HEADER = 16;
+static constexpr size_t MAX_QUERY_NAME = 1024;
+
+// Timing of the discovery protocol; the simulator (bench/sim.cpp) plays by
+// the same numbers.
+static constexpr int ANNOUNCE_INTERVAL_MS = 2000;
+static constexpr int PEER_TTL_SECS = 10;            // five missed announces
+static constexpr int CATALOG_RETRY_SECS = 2;        // after a failed fetch
+static constexpr int QUERY_SENDS = 3;               // a lost datagram shouldn't cost the whole timeout
+static constexpr int QUERY_RESEND_MS = 250;
+static constexpr int QUERY_REPLIES_PER_SEC = 8;     // a few askers behind one address (NAT) still fit
+static constexpr size_t MAX_QUERY_SOURCES = 4096;   // addresses answered per second, all told
+
+std::string encode_query(const Query& q);
+// `a` without its Bloom filter: ANNOUNCE_HEADER bytes.
+std::string encode_query_reply(const Announce& a);
+bool decode_query(const char *data, size_t len, Query& out);
+
+
+#endif
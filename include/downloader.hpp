@@ -0,0 +1,116 @@
+#ifndef DOWNLOADER_HPP
+#define DOWNLOADER_HPP
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include "network.hpp"
+#include "manifest.hpp"
+#include "protocol.hpp"
+#include "writer.hpp"
+#include "swarm.hpp"
+
+struct Source {
+    std::string host;
+    int port;
+    PeerStats stats;            // from earlier transfers; zero if never measured
+    bool partial = false;       // still downloading the file itself; serves what its HAVE map lists
+};
+
+struct DownloadOptions {
+    int threads = 0;            // parallel connections (0 = adaptive, up to max_connections)
+    int max_connections = 32;
+    int pipeline = 0;           // requests in flight per v2 connection (0 = from rate x RTT)
+    uint64_t piece_size = 0;    // 0 = chosen from the file size and known peer rates; so is a
+                                // size outside MIN_PIECE_SIZE .. MAX_PIECE_SIZE
+    int max_attempts = 8;       // per piece, before the download is abandoned
+    bool verify = true;         // fetch the piece manifest and check every piece
+    int manifest_wait = 10;     // seconds to wait for a seeder that is still hashing
+    double slow_ratio = 0.25;   // drop sources slower than this fraction of the fastest
+    int slow_grace = 3;         // seconds before slow-source detection kicks in
+    WriteMode write_mode = WriteMode::Pwrite;
+    bool compress = false;      // ask v2 sources for LZ4 bodies where they compress
+    bool delta = true;          // build on an existing local copy, fetching only changed pieces
+    // Partial seeding: the download is registered here while it runs, so the
+    // file server can hand its finished pieces to other peers. Also switches
+    // piece selection to rarest-first.
+    std::shared_ptr<PartialFiles> seed;
+    // When the whole operation began (e.g. before discovery), for the
+    // time-to-first-byte report; unset means when the download was called.
+    std::chrono::steady_clock::time_point started{};
+    // Called from the workers for every piece written, with the seconds from
+    // its request to its arrival; used by the benchmarks.
+    std::function<void(double)> on_piece;
+    // Called about every 250 ms while the transfer runs, and once at the end,
+    // with the file bytes on disk (resumed and reused pieces included) and
+    // the total.
+    std::function<void(uint64_t done, uint64_t total)> on_progress;
+    // Set to abandon the download: connections are closed mid-piece and what
+    // is on disk is kept for a resume.
+    const std::atomic<bool> *cancel = nullptr;
+};
+
+// Fetch [start, end) of `filename` from host:port into `dst` (end - start
+// bytes). `progress` is bumped as bytes arrive and `abort` is polled between
+// reads (and once a second while the peer is idle).
+bool download_range(const std::string& host, int port, const std::string& filename,
+                    uint64_t start, uint64_t end, char *dst,
+                    std::atomic<uint64_t> *progress = nullptr,
+                    const std::function<bool()> &abort = nullptr);
+
+// Every peer in `peers` advertising `filename`, complete copies first, then
+// peers that are still downloading it (marked partial). When peers disagree
+// on the size, the size advertised by most peers wins and is returned in `size`.
+std::vector<Source> find_sources(const PeerList& peers, const std::string& filename, uint64_t &size);
+
+// Ask the v2 sources for the piece hashes of `filename`. Returns false if no
+// source could provide a manifest matching `size` and `piece_size`. With
+// `weak`, rolling checksums are asked for too; sources that predate them
+// leave out.weak empty.
+bool fetch_manifest(const std::vector<Source>& sources, const std::string& filename,
+                    uint64_t size, uint64_t piece_size, int wait_secs, Manifest& out,
+                    bool weak = false);
+
+// Piece size for an adaptive download: roughly 100 ms of transfer on the
+// fastest known connection, halved until every connection can get a few
+// pieces. A power of two between 256 KiB and 8 MiB.
+uint64_t choose_piece_size(uint64_t size, const std::vector<Source>& sources, int connections);
+
+// Download `filename` (of `size` bytes) from all `sources` at once. If
+// `measured` is given it receives what was observed of each source, in the
+// same order, for feeding back into the peer table.
+bool download_file(const std::string& filename, uint64_t size,
+                   const std::vector<Source>& sources, const DownloadOptions& opts,
+                   std::vector<PeerStats> *measured = nullptr);
+
+// One file of a batch, with the peers that have it.
+struct FileRequest {
+    std::string filename;
+    uint64_t size = 0;
+    std::vector<Source> sources;
+};
+
+// What a batch download observed, for callers that don't read its output.
+struct DownloadReport {
+    std::vector<bool> completed;    // per file
+    std::vector<Source> sources;    // every distinct source, with the stats measured this time
+    uint64_t wire_bytes = 0;        // received, compressed or not
+    uint64_t file_bytes = 0;        // what they decoded to
+    double seconds = 0;             // transfer time, setup excluded
+    double first_byte_ms = -1;      // from DownloadOptions::started; -1 if nothing arrived
+    bool cancelled = false;
+};
+
+// Download every file in `files` over one pool of connections: a peer
+// holding several of them serves all of them on the same pipelined
+// connections, and one scheduler spreads the pieces of small and large files
+// across the pool. Returns true if every file completed.
+bool download_files(const std::vector<FileRequest>& files, const DownloadOptions& opts,
+                    DownloadReport *report = nullptr);
+
+
+#endif
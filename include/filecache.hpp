@@ -0,0 +1,119 @@
+#ifndef FILECACHE_HPP
+#define FILECACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include "catalog.hpp"
+
+// A descriptor opened for serving, with what fstat() said when it was
+// opened. Closed once the cache has dropped it and the last response
+// reading from it is done.
+struct OpenFile {
+    int fd = -1;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    explicit OpenFile(int fd_) : fd(fd_) {}
+    ~OpenFile();
+    OpenFile(const OpenFile&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+};
+
+// Open descriptors of shared files for the file server, in an LRU of at most
+// `capacity` files, so a file asked for again costs a hash lookup instead of
+// open() + close(). An entry is reused only while its size and mtime match
+// the catalog's, which inotify keeps current; a changed file is reopened.
+// Once the catalog changes, entries it no longer lists are dropped, so a
+// deleted file's space isn't held by a cached descriptor. Bodies are read
+// with explicit offsets, so one descriptor serves any number of connections
+// at once.
+class FileCache {
+public:
+    explicit FileCache(size_t capacity);
+
+    // Opens a file listed in the catalog; names that aren't listed (including
+    // anything with "..") never reach the file system. Null if it can't be
+    // served; otherwise `e` is its catalog entry.
+    std::shared_ptr<const OpenFile> open(const Catalog &catalog, std::string_view name, CatalogEntry &e);
+
+    struct Stats {
+        uint64_t hits = 0;          // served by a cached descriptor
+        uint64_t misses = 0;        // had to open() (absent or stale)
+        uint64_t evictions = 0;     // dropped to make room
+        uint64_t open = 0;          // descriptors held now
+    };
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::string name;
+        std::shared_ptr<const OpenFile> file;
+    };
+
+    size_t capacity_;
+    std::list<Entry> lru_;                          // most recent first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    mutable std::mutex mu_;
+    std::atomic<uint64_t> catalog_version_{0};      // last one pruned against
+
+    std::atomic<uint64_t> hits_{0}, misses_{0}, evictions_{0};
+
+    void forget(const std::string &name);
+    void prune(const Catalog &catalog, uint64_t version);
+};
+
+// Largest range the hot cache keeps; bigger ones always go to the file.
+static constexpr uint64_t MAX_HOT_RANGE = 1 << 20;
+
+// Raw bytes of popular ranges, in an LRU bounded by `capacity` bytes, so a
+// piece that keeps being asked for (a small file, the head of a popular one)
+// is sent from memory without touching the file system. A range is admitted
+// on its second request, which keeps one-off reads of big files from
+// flushing it, and only if the page cache already holds it: the copy is made
+// on a reactor, which must not wait for the disk. Keyed by file, mtime and
+// range, like CompressedPieces.
+class HotPieces {
+public:
+    explicit HotPieces(size_t capacity);
+
+    // The range [start, end) of `fd` from memory, read and kept if it is
+    // popular enough and cached by the kernel; null if it should be sent
+    // from the file. Never blocks on I/O.
+    std::shared_ptr<const std::string> get(std::string_view name, int64_t mtime_ns, int fd,
+                                           uint64_t start, uint64_t end);
+
+    struct Stats {
+        uint64_t hits = 0;          // served from memory
+        uint64_t misses = 0;        // sent from the file
+        uint64_t admitted = 0;      // ranges read into the cache
+        uint64_t bytes = 0;         // held now
+    };
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const std::string> data;
+    };
+
+    size_t capacity_;
+    size_t used_ = 0;
+    std::list<Entry> lru_;                          // most recent first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    std::unordered_set<std::string> seen_;          // asked for once, not yet admitted
+    mutable std::mutex mu_;
+
+    std::atomic<uint64_t> hits_{0}, misses_{0}, admitted_{0};
+};
+
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// XXH64: fast non-cryptographic 64-bit hash, used to verify pieces.
+// Four independent accumulator lanes keep the CPU's multiply units busy.
+uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0);
+
+std::string hash_hex(uint64_t h);
+bool parse_hash_hex(const std::string &s, uint64_t &out);
+
+
+#endif
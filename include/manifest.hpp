@@ -0,0 +1,89 @@
+#ifndef MANIFEST_HPP
+#define MANIFEST_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+#include "catalog.hpp"
+
+// Per-piece hashes of one file. Text form, also sent over the wire:
+//   P2PMANIFEST 1 <file_size> <piece_size> <count>\n
+//   <xxh64 hex>\n   (one line per piece)
+// Version 2 adds each piece's weak rolling checksum, for delta transfers:
+//   P2PMANIFEST 2 <file_size> <piece_size> <count>\n
+//   <xxh64 hex> <weak sum hex>\n
+struct Manifest {
+    uint64_t file_size = 0;
+    uint64_t piece_size = 0;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> weak;     // empty when the sender left them out
+};
+
+// Version 2 if `with_weak` and the manifest has weak sums, else version 1.
+std::string serialize_manifest(const Manifest& m, bool with_weak = false);
+bool parse_manifest(const std::string& text, Manifest& m);
+
+// Hash every piece of `path` (strong and weak), spreading pieces over
+// `threads` (0 = one per core).
+bool compute_manifest(const std::string& path, uint64_t piece_size, Manifest& out, int threads = 0);
+
+// Manifests for the files of a shared folder. They are built by a background
+// thread, never on a reactor, and cached on disk under <folder>/.p2p keyed by
+// the file's size and mtime, so a restart doesn't rehash unchanged files.
+// Size and mtime come from the catalog; a file that changes is rehashed on
+// the next request for it. Piece sizes are chosen by clients, so each file
+// keeps at most MAX_VARIANTS of them (the least recently used goes, never
+// the default), in memory and on disk, and has at most that many builds
+// queued.
+class ManifestStore {
+public:
+    explicit ManifestStore(std::shared_ptr<const Catalog> catalog);
+    ~ManifestStore();
+
+    static constexpr size_t MAX_VARIANTS = 4;
+
+    // The manifest if it is ready; otherwise queues a build and returns
+    // nullptr. Piece sizes failing piece_count_ok() are never built.
+    std::shared_ptr<const Manifest> get(const std::string& filename, uint64_t piece_size);
+
+    // Queue every file currently in the catalog.
+    void prewarm(uint64_t piece_size);
+    void stop();
+
+private:
+    using Key = std::pair<std::string, uint64_t>;   // filename, piece size
+
+    struct Entry {
+        std::shared_ptr<const Manifest> manifest;
+        int64_t mtime_ns = 0;
+        uint64_t used = 0;      // last use, in ticks of `uses_`
+    };
+
+    std::shared_ptr<const Catalog> catalog_;
+    std::string folder_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::map<Key, Entry> cache_;
+    std::deque<Key> queue_;
+    std::set<Key> queued_;
+    uint64_t uses_ = 0;
+    std::atomic<bool> running_{true};
+    std::thread worker_;
+
+    bool enqueue(const Key& key);
+    void trim(const std::string& filename);
+    void worker();
+    std::string cache_path(const Key& key) const;
+};
+
+
+#endif
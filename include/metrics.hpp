@@ -0,0 +1,124 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Process-wide instrumentation for seeders and downloads. Every update is a
+// relaxed atomic add, cheap enough for the per-request paths; the STATS
+// command renders the lot in the Prometheus text format.
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { v_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> v_{0};
+};
+
+class Gauge {
+public:
+    void add(int64_t n = 1) { v_.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { v_.fetch_sub(n, std::memory_order_relaxed); }
+    void set(int64_t n) { v_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return v_.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> v_{0};
+};
+
+// Latency histogram with fixed buckets from 0.5 ms to 10 s.
+class Histogram {
+public:
+    static constexpr int BUCKETS = 14;
+    static const double BOUNDS[BUCKETS];    // upper bounds in seconds
+
+    void observe(double secs);
+    void observe_since(std::chrono::steady_clock::time_point start);
+    // Appends the _bucket / _sum / _count series.
+    void render(std::string& out, const char *name) const;
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS + 1] = {};    // the last one is +Inf
+    std::atomic<uint64_t> sum_us_{0};
+};
+
+// Bytes exchanged with one peer: by client IP on the seeder side, by
+// host:port on the download side.
+struct PeerCounters {
+    Counter sent;
+    Counter received;
+};
+
+struct Metrics {
+    // file server
+    Counter bytes_served;           // body bytes sent (wire, after compression)
+    Counter connections_accepted;
+    Gauge connections_active;
+    Counter requests_get;
+    Counter requests_manifest;
+    Counter requests_catalog;
+    Counter requests_have;
+    Counter requests_stats;
+    Counter requests_malformed;     // lines the server dropped the connection over
+    Counter replies_err;            // ERR nofile / range / busy / missing
+    Histogram request_seconds;      // GET: request parsed -> body sent
+
+    // downloads
+    Counter bytes_received;         // body bytes read (wire)
+    Counter pieces_received;
+    Counter ranges_failed;          // requests that failed and went back to the scheduler
+    Counter pieces_bad;             // failed verification against the manifest
+    Counter bytes_reused;           // delta transfers: taken from the old local copy
+    Histogram piece_seconds;        // piece requested -> written
+
+    // discovery
+    Counter announces_sent;
+    Counter announces_received;
+    Counter announces_legacy;
+    Counter announces_rejected;     // datagrams that parsed as neither format
+    Counter queries_sent;
+    Counter queries_received;
+    Counter queries_answered;       // unicast announces sent back to askers
+    Counter queries_limited;        // not answered: over the per-source reply rate
+    Counter catalog_fetches;
+    Counter catalog_fetch_failures;
+    Gauge peers;                    // live peers in the table
+
+    // Counters for `name`, created on first use; past MAX_PEERS distinct
+    // names everything is booked under "other". Hold on to the pointer
+    // rather than looking it up per update.
+    std::shared_ptr<PeerCounters> peer(const std::string& name);
+
+    std::string render();
+
+private:
+    static constexpr size_t MAX_PEERS = 256;
+
+    std::mutex mu_;
+    std::map<std::string, std::shared_ptr<PeerCounters>> peers_;
+};
+
+Metrics& metrics();
+
+// High-water mark of the process's resident memory.
+uint64_t peak_rss_bytes();
+
+// Client side of STATS: the metrics text of the server at host:port.
+bool fetch_stats(const std::string& host, int port, std::string& out);
+
+// Sample lines of a metrics text, "name{labels}" -> value; comments skipped.
+std::map<std::string, double> parse_metrics(const std::string& text);
+
+// Human-readable summary of what changed between two samples taken `secs`
+// apart: rates of the counters that moved, current gauges, and latency
+// quantiles of the histograms over the interval.
+std::string describe_interval(const std::map<std::string, double>& before,
+                              const std::map<std::string, double>& after, double secs);
+
+
+#endif
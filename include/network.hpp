@@ -4,46 +4,93 @@
 
 #include <string>
 #include <vector>
-#include <map>
 #include <thread>
-#include <mutex>
 #include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
-struct PeerInfo {
-    std::string addr;
-    int port;
-    std::map<std::string, uint64_t> files;
-};
+#include "server.hpp"
+#include "catalog.hpp"
+#include "discovery.hpp"
+#include "peer_table.hpp"
+#include "swarm.hpp"
 
 class Network {
 public:
     explicit Network(int service_port);
     ~Network();
 
+    // Index `shared_folder` for broadcast and the file server. The start_*
+    // calls do this themselves (non-recursively) if it hasn't been done.
+    bool share(const std::string& shared_folder, bool recursive = false);
+
     void start_broadcast(const std::string& shared_folder);
     void start_listen_peers();
-    void start_tcp_server(const std::string& shared_folder);
+    bool start_tcp_server(const std::string& shared_folder, const ServerConfig& cfg = ServerConfig{});
+
+    // Serve and announce the finished pieces of the downloads registered in
+    // `partials` (partial seeding). Without a shared folder the catalog stays
+    // empty, so only those files are offered. False if the port is taken.
+    bool seed_partials(std::shared_ptr<PartialFiles> partials, const ServerConfig& cfg = ServerConfig{});
 
-    // Thread-safe snapshot of all known peers
-    std::vector<PeerInfo> get_peers_snapshot();
+    // Immutable snapshot of all live peers; shared, not copied. Catalogs that
+    // changed since they were last fetched are fetched first.
+    std::shared_ptr<const PeerSnapshot> get_peers_snapshot();
+
+    // Peers whose catalog lists `filename`. Only peers whose Bloom filter may
+    // contain the name have their catalog fetched.
+    PeerList find_peers(const std::string& filename);
+
+    // Broadcasts a "who has `filename`" query (any peer, if empty) and
+    // collects the unicast replies, returning once `min_sources` peers have
+    // answered plus `grace` for stragglers on the same link, or at `timeout`.
+    // Peers that predate queries are still picked up from their periodic
+    // announces if they arrive in time. Returns find_peers(filename), or every
+    // known peer for an empty name. Needs start_listen_peers() for the latter.
+    PeerList query_peers(const std::string& filename, int min_sources, std::chrono::milliseconds timeout,
+                         std::chrono::milliseconds grace = std::chrono::milliseconds(50));
+
+    // Per-peer throughput and RTT remembered from earlier transfers (and
+    // catalog fetches), for choosing peers and sizing requests.
+    PeerStats peer_stats(const std::string& addr, int port);
+    void record_peer_stats(const std::string& addr, int port, const PeerStats& measured);
 
 private:
     int service_port_;
+    uint64_t peer_id_;
     std::atomic<bool> running_{true};
+    std::mutex stop_mu_;
+    std::condition_variable stop_cv_;       // cuts the broadcast interval short on shutdown
 
-    std::vector<PeerInfo> peers_;
-    std::mutex peers_mutex_;
+    PeerTable peers_;
 
     // Threads
     std::thread broadcast_thread_;
     std::thread listener_thread_;
-    std::thread tcp_server_thread_;
+
+    // catalog_ and partials_ may be set while the listener is answering
+    // queries; announce_mu_ covers them and the cached datagram
+    std::mutex announce_mu_;
+    std::shared_ptr<Catalog> catalog_;
+    std::shared_ptr<PartialFiles> partials_;    // null unless seeding downloads
+    std::string announce_;
+    std::string query_reply_;               // announce_ without the Bloom filter
+    uint64_t announce_version_ = 0, announce_partial_version_ = 0;
+    std::unique_ptr<FileServer> server_;
+
+    // The announce datagram for what is shared now, rebuilt only after the
+    // catalog or the set of seeded downloads changed; with `filename`, the
+    // reply to a query for it, which has no Bloom filter. Empty if nothing
+    // is shared, or (with a non-empty `filename`) if that file isn't.
+    std::string announce_message(const std::string *filename = nullptr);
 
     // Internal workers
-    void broadcast_worker(const std::string& shared_folder);
+    void broadcast_worker();
     void listener_worker();
-    void tcp_server_worker(const std::string& shared_folder);
+    void sync_catalogs(const std::string *filename);
 };
 
 
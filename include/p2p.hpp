@@ -0,0 +1,160 @@
+#ifndef P2P_HPP
+#define P2P_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include "network.hpp"
+#include "downloader.hpp"
+#include "server.hpp"
+#include "swarm.hpp"
+
+// libp2p: the download and seeding engine behind the p2p command, for
+// programs that embed transfers instead of running the CLI. Downloads run
+// on their own threads and report through callbacks and a future; any
+// number of them can run at once on one P2PClient, sharing its discovery
+// and its partial-seeding server.
+
+// ---------------------------------------------------------------
+// Name resolution
+// ---------------------------------------------------------------
+bool is_glob(const std::string& pattern);
+
+// One file name or glob per line; blank lines and lines starting with '#'
+// are skipped. False if `path` can't be read.
+bool read_name_list(const std::string& path, std::vector<std::string>& out);
+
+// The files that `patterns` name among those the peers offer, in pattern
+// order without repeats. A pattern is a file name, a glob (fnmatch, so '*'
+// also crosses '/'), or a directory of a recursive share ("dir" or "dir/").
+// Patterns that match nothing are added to `unmatched` if given.
+std::vector<std::string> resolve_names(const PeerList& peers, const std::vector<std::string>& patterns,
+                                       std::vector<std::string> *unmatched = nullptr);
+
+
+// ---------------------------------------------------------------
+// Downloads
+// ---------------------------------------------------------------
+struct TransferProgress {
+    uint64_t bytes_done = 0;        // file bytes on disk, resumed and reused pieces included
+    uint64_t bytes_total = 0;
+    double bytes_per_sec = 0;       // since the previous report
+    double seconds = 0;             // since the download was started, discovery included
+};
+
+struct DownloadResult {
+    bool ok = false;                // every file completed
+    bool cancelled = false;
+    std::string error;              // set when nothing could be downloaded
+    std::vector<std::string> unmatched;     // names no peer offers
+    std::vector<FileRequest> files; // what the names resolved to, with their sources
+    DownloadReport report;
+    size_t peers = 0;               // that answered discovery
+    double discovery_ms = 0;
+};
+
+struct DownloadRequest {
+    std::vector<std::string> names;     // file names, globs ("logs/*.gz") or shared directories ("dir/")
+    DownloadOptions options;            // seed and started are filled in by the client
+    int discover_ms = 3000;             // how long to wait for peers to answer
+    int min_sources = 1;                // start once this many peers have answered
+
+    // All called on the download's own thread.
+    // Once the names are resolved, before any transfer; `result` has
+    // files, unmatched, peers and discovery_ms set.
+    std::function<void(const DownloadResult&)> on_resolved;
+    std::function<void(const TransferProgress&)> on_progress;  // about every progress_ms
+    int progress_ms = 500;
+    std::function<void(const DownloadResult&)> on_complete;
+};
+
+// A download in progress. Dropping the last reference cancels it and waits
+// for its thread; callbacks may hold a reference too, since they are
+// released before the thread ends.
+class DownloadHandle {
+public:
+    ~DownloadHandle();
+    DownloadHandle(const DownloadHandle&) = delete;
+    DownloadHandle& operator=(const DownloadHandle&) = delete;
+
+    // Ready when the download has ended, however it ended.
+    std::shared_future<DownloadResult> result() const { return result_; }
+    const DownloadResult& wait() const { return result_.get(); }
+    bool done() const;
+
+    // Stops the transfer; finished pieces stay on disk, so downloading the
+    // same names again resumes. Returns at once; wait() for the end.
+    void cancel() { cancel_ = true; }
+
+    TransferProgress progress() const;
+
+private:
+    friend class P2PClient;
+    DownloadHandle() = default;
+
+    std::atomic<bool> cancel_{false};
+    std::shared_future<DownloadResult> result_;
+    std::thread thread_;
+
+    mutable std::mutex mu_;
+    TransferProgress progress_;
+};
+
+// Finds peers and downloads from them. With `seed`, downloads serve their
+// finished pieces to other peers from `port` while they run. The client must
+// outlive the handles it gives out.
+class P2PClient {
+public:
+    explicit P2PClient(int port = 12000, bool seed = true);
+    ~P2PClient();
+
+    std::shared_ptr<DownloadHandle> download(DownloadRequest req);
+
+    // Peers answering a query for `filename`, or every peer if it is empty.
+    PeerList discover(const std::string& filename, std::chrono::milliseconds timeout, int min_sources = 1,
+                      std::chrono::milliseconds grace = std::chrono::milliseconds(50));
+
+    Network& network() { return *net_; }
+
+private:
+    int port_;
+    bool seed_;
+    std::unique_ptr<Network> net_;
+    std::once_flag listening_, seeding_;
+    std::shared_ptr<PartialFiles> partials_;    // null until the first download, or if the port was busy
+
+    void start_listening();
+    std::shared_ptr<PartialFiles> start_seeding();
+    DownloadResult run(DownloadRequest &req, DownloadHandle &handle);
+};
+
+
+// ---------------------------------------------------------------
+// Seeding
+// ---------------------------------------------------------------
+// Shares a folder: indexes it, announces it, answers queries and serves it
+// over TCP until stopped or destroyed.
+class P2PSeeder {
+public:
+    explicit P2PSeeder(int port = 12000);
+    ~P2PSeeder();
+
+    bool start(const std::string& folder, const ServerConfig& cfg = ServerConfig{}, bool recursive = false);
+    void stop();
+    bool running() const { return net_ != nullptr; }
+
+private:
+    int port_;
+    std::unique_ptr<Network> net_;
+};
+
+
+#endif
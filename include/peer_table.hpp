@@ -0,0 +1,113 @@
+#ifndef PEER_TABLE_HPP
+#define PEER_TABLE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#include "discovery.hpp"
+
+struct PeerInfo {
+    std::string addr;
+    int port;
+    std::map<std::string, uint64_t> files;
+    std::map<std::string, uint64_t> partial;    // being downloaded; only some pieces can be served
+};
+
+using PeerList = std::vector<std::shared_ptr<const PeerInfo>>;
+
+// What past transfers from a peer looked like; zero means not measured yet.
+// Both are smoothed (EWMA) across downloads.
+struct PeerStats {
+    double bytes_per_sec = 0;   // throughput of one connection
+    double rtt_ms = 0;          // request round trip on an idle connection
+};
+
+// Immutable view of the table: every peer with a known file list, plus the
+// inverted file name -> peers index (partial copies included). Shared by all
+// readers until it changes.
+struct PeerSnapshot {
+    PeerList peers;
+    std::unordered_map<std::string, PeerList> by_file;
+
+    const PeerList& holders(const std::string& filename) const;
+};
+
+// Peers heard from on the discovery port, keyed by "addr:port". A peer that
+// hasn't announced for `ttl` is dropped. The announce path only touches one
+// hash bucket; the snapshot (and its index) is rebuilt lazily, on the first
+// read after a peer or catalog actually changed.
+class PeerTable {
+public:
+    // `clock` replaces steady_clock::now() for TTLs and retries (the
+    // simulator runs on virtual time).
+    using Clock = std::function<std::chrono::steady_clock::time_point()>;
+    explicit PeerTable(std::chrono::seconds ttl, Clock clock = nullptr);
+
+    void announce(const std::string& addr, const Announce& a);
+    // Older peers put the whole file list in the datagram.
+    void announce_legacy(const std::string& addr, PeerInfo info);
+
+    // Drop peers not heard from within the TTL; returns how many went.
+    size_t expire();
+    size_t size();
+
+    struct Endpoint {
+        std::string addr;
+        int port;
+    };
+    // Peers whose file list is out of date with their last announce (only
+    // those whose Bloom filter may contain `filename`, if given). Each is
+    // handed out at most once per `retry` so failing peers aren't hammered.
+    std::vector<Endpoint> stale_catalogs(const std::string *filename, std::chrono::seconds retry);
+    void catalog_fetched(const Endpoint& ep, std::map<std::string, uint64_t> files, uint64_t digest,
+                         std::map<std::string, uint64_t> partial = {});
+
+    std::shared_ptr<const PeerSnapshot> snapshot();
+
+    // Estimated heap bytes held by the table and its published snapshot,
+    // from container sizes (allocator overhead not counted).
+    size_t memory_bytes();
+
+    // Peers listing `filename`, minus those whose newer announce rules it out.
+    PeerList holders(const std::string& filename);
+
+    // Telemetry cache; samples for peers not in the table are ignored.
+    void record_rate(const std::string& addr, int port, double bytes_per_sec);
+    void record_rtt(const std::string& addr, int port, double rtt_ms);
+    PeerStats stats(const std::string& addr, int port);
+
+private:
+    struct Record {
+        Endpoint ep;
+        std::shared_ptr<const PeerInfo> info;   // null until the file list is known
+        Announce announce;
+        uint64_t digest = 0;                    // catalog digest `info` was built from
+        std::chrono::steady_clock::time_point last_seen;
+        std::chrono::steady_clock::time_point last_fetch{};
+        PeerStats stats;
+    };
+
+    std::chrono::seconds ttl_;
+    Clock clock_;
+    std::unordered_map<std::string, Record> peers_;
+    std::shared_ptr<const PeerSnapshot> published_;
+    bool dirty_ = true;
+    std::mutex mu_;
+
+    std::chrono::steady_clock::time_point now() const {
+        return clock_ ? clock_() : std::chrono::steady_clock::now();
+    }
+    static std::string key(const std::string& addr, int port);
+    Record& touch(const std::string& addr, int port);
+    size_t expire_locked(std::chrono::steady_clock::time_point now);
+};
+
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Wire protocol between downloaders and file servers.
+//
+// v1 (one request per connection, server closes after the reply):
+//   GET <file> <start> <end>\n   ->  OK <len>\n<len bytes>  |  ERR nofile\n
+//   STATS\n                      ->  OK <len>\n<metrics>, as below
+//
+// v2 (persistent, pipelined). The client opens with a handshake; a v1 server
+// doesn't know HELLO and just closes, which tells the client to fall back.
+//   HELLO 2\n                         ->  HELLO 2\n
+//   GET <id> <file> <start> <end>\n   ->  OK <id> <len>\n<len bytes>  |  ERR <id> <reason>\n
+//   GET <id> <file> <start> <end> lz4\n ->  OK <id> <len> lz4\n<LZ4 block of the range>, or a
+//                                        plain OK reply when the range doesn't compress
+//   MANIFEST <id> <file> <piece_size>\n ->  OK <id> <len>\n<manifest text>  |  ERR <id> busy|nofile|range\n
+//   MANIFEST <id> <file> <piece_size> weak\n ->  the same, version 2 text with weak rolling sums
+//   CATALOG <id>\n                    ->  OK <id> <len>\n<catalog text>
+//   HAVE <id> <file> <piece_size>\n   ->  OK <id> <len>\n<piece bitmap, see swarm.hpp>  |  ERR <id> nofile|range\n
+//   STATS <id>\n                      ->  OK <id> <len>\n<metrics, Prometheus text format>
+// Replies come back in request order; the ID lets the client check pairing.
+// Servers that predate compression ignore the trailing "lz4" and reply raw,
+// and those that predate delta transfers ignore "weak" and send version 1.
+// "busy" means the seeder is still hashing the file; ask again later.
+// A peer that is itself still downloading the file serves only ranges made
+// of pieces it has finished, and answers others with "ERR <id> missing";
+// HAVE tells which those are.
+
+static constexpr int PROTOCOL_VERSION = 2;
+static constexpr const char* HELLO_LINE = "HELLO 2\n";
+static constexpr uint64_t DEFAULT_PIECE_SIZE = 1 << 20;
+// Piece sizes a seeder builds manifests and HAVE maps for ("ERR range"
+// otherwise), and that get accepts. The top is the largest pooled buffer.
+static constexpr uint64_t MIN_PIECE_SIZE = 16 << 10;
+static constexpr uint64_t MAX_PIECE_SIZE = 1u << 30;
+// Files with more pieces than this (4 TiB at the default size) get neither:
+// a manifest would be ~100 MB of text.
+static constexpr uint64_t MAX_PIECE_COUNT = 1u << 22;
+
+inline bool valid_piece_size(uint64_t piece_size) {
+    return piece_size >= MIN_PIECE_SIZE && piece_size <= MAX_PIECE_SIZE;
+}
+inline bool piece_count_ok(uint64_t file_size, uint64_t piece_size) {
+    return valid_piece_size(piece_size) && file_size / piece_size < MAX_PIECE_COUNT;
+}
+
+// Space-separated fields of one protocol line, as views into the caller's
+// buffer; nothing is copied. The trailing "\n" (or "\r\n") is dropped.
+struct LineFields {
+    static constexpr size_t MAX = 8;
+    std::string_view f[MAX];
+    size_t n = 0;
+};
+
+// False if the line has more than LineFields::MAX fields.
+bool split_fields(std::string_view line, LineFields& out);
+
+// Whole-field decimal parse (std::from_chars); no sign, no trailing junk.
+bool parse_u64(std::string_view s, uint64_t& out);
+bool parse_u32(std::string_view s, uint32_t& out);
+
+// Decimal append (std::to_chars), for building request/response lines
+// without streams.
+void append_u64(std::string& out, uint64_t v);
+
+
+#endif
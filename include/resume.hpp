@@ -0,0 +1,55 @@
+#ifndef RESUME_HPP
+#define RESUME_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+// Sidecar "<file>.p2pstate" recording which pieces of an interrupted download
+// are already on disk:
+//   P2PSTATE 1 <size> <piece_size> <count>\n<bitmap: count bits, LSB first>
+// It is rewritten (temp file + rename) at most every `flush_interval`, so an
+// interrupted run loses only the last few seconds of progress.
+class ResumeState {
+public:
+    ResumeState(const std::string& target, uint64_t size, uint64_t piece_size,
+                std::chrono::milliseconds flush_interval = std::chrono::seconds(2));
+
+    // Piece size recorded by the sidecar of an interrupted download of
+    // `target` (of `size` bytes), or 0 if there is none.
+    static uint64_t stored_piece_size(const std::string& target, uint64_t size);
+
+    // Reads the sidecar; false if it is missing or describes a different
+    // size or piece size (the bitmap is then left empty).
+    bool load();
+
+    bool has(size_t index) const;
+    size_t done_count() const;
+    size_t piece_count() const { return count_; }
+
+    // Thread-safe. Call only once the piece's bytes are written to the file.
+    void mark(size_t index);
+    void unmark(size_t index);
+
+    bool flush();
+    void remove();
+
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    uint64_t size_;
+    uint64_t piece_size_;
+    size_t count_;
+    std::vector<uint8_t> bits_;
+    std::chrono::milliseconds flush_interval_;
+    std::chrono::steady_clock::time_point last_flush_;
+    mutable std::mutex mu_;
+
+    bool flush_locked();
+};
+
+
+#endif
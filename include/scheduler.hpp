@@ -0,0 +1,195 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+struct Piece {
+    int index = -1;
+    uint64_t start = 0;
+    uint64_t end = 0;
+};
+
+// Hands out fixed-size pieces of a file to download workers.
+//
+// Each worker starts with a contiguous run of pieces in its own deque and
+// takes from the front; a worker whose deque runs dry steals from the back of
+// the fullest one. Failed pieces go to a shared retry queue that is drained
+// first. Once nothing is left to hand out (endgame), idle workers are given
+// duplicates of pieces that are still in flight, so the tail of the download
+// tracks the fastest connection rather than the slowest.
+//
+// In rarest-first mode (swarms, where some sources hold only part of the
+// file) the deques are bypassed: a worker gets the free piece held by the
+// fewest known sources among those its own source has, ties broken in an
+// order that is random per download, so downloaders that start together
+// fetch different pieces and can then trade them.
+//
+// Free pieces are kept in buckets by holder count, and pieces in flight by
+// copies, so a pick looks at the rarest bucket first instead of at every
+// piece of the file.
+class PieceScheduler {
+public:
+    PieceScheduler(uint64_t size, uint64_t piece_size, int workers,
+                   int max_attempts = 8, int endgame_copies = 2);
+
+    // Blocks until there is a piece for `worker`; returns false once every
+    // piece is done or the download has been aborted. With `wait` false it
+    // returns false instead of blocking when nothing is available right now.
+    // `have` (rarest-first mode only) limits the choice to the pieces the
+    // worker's source holds; null means it holds them all. With `endgame`
+    // false no duplicates of pieces in flight are handed out.
+    bool next(int worker, Piece &out, bool wait = true, const std::vector<bool> *have = nullptr,
+              bool endgame = true);
+
+    // Returns true if this call finished the piece, false if another copy
+    // got there first.
+    bool complete(const Piece &p);
+
+    // Gives the piece back. `count_attempt` is false when the failure wasn't
+    // the piece's fault (source dropped, duplicate cancelled).
+    void fail(const Piece &p, bool count_attempt = true);
+
+    void abort();
+
+    // Switch to rarest-first selection; call before handing out pieces.
+    // `seed` fixes the tie-break order (the simulator's runs repeat).
+    void set_rarest_first();
+    void set_rarest_first(uint64_t seed);
+    bool rarest_first() const { return rarest_; }
+    // Availability counts: a source holding `have` (null: every piece)
+    // joined, or a source's map grew from `before` to `after`.
+    void add_holder(const std::vector<bool> *have);
+    void update_holder(const std::vector<bool> &before, const std::vector<bool> &after);
+
+    // Record a piece as already present (e.g. from a resumed download).
+    void mark_done(int index);
+
+    // Lock-free; used to cancel endgame duplicates mid-transfer.
+    bool is_done(int index) const { return done_[index].load(std::memory_order_acquire); }
+
+    bool finished();
+    bool aborted();
+    size_t piece_count() const { return pieces_.size(); }
+    uint64_t size() const { return size_; }
+    uint64_t piece_size() const { return piece_size_; }
+    uint64_t steals();
+    uint64_t endgame_requests();
+
+private:
+    struct PieceState {
+        int inflight = 0;
+        int attempts = 0;
+        bool done = false;
+    };
+
+    // Pieces grouped by a small count, with O(1) insert and remove; the
+    // order within a group is arbitrary (but fixed by the calls made).
+    class Buckets {
+    public:
+        void reset(size_t pieces);
+        void insert(int index, uint32_t count);
+        void erase(int index);
+        bool empty() const { return size_ == 0; }
+        // From the lowest count up, a piece in `have` (null: any); -1 if none.
+        int first(const std::vector<bool> *have) const;
+
+    private:
+        std::vector<std::vector<uint32_t>> lists_;
+        std::vector<int32_t> bucket_;       // per piece, -1 when in none
+        std::vector<uint32_t> pos_;         // per piece, its slot in lists_[bucket_]
+        size_t size_ = 0;
+    };
+
+    uint64_t size_;
+    uint64_t piece_size_;
+    int max_attempts_;
+    int endgame_copies_;
+
+    std::vector<PieceState> pieces_;
+    std::unique_ptr<std::atomic<bool>[]> done_;
+    std::vector<std::deque<int>> queues_;   // per-worker
+    std::deque<int> retry_;
+    size_t remaining_;
+    bool aborted_ = false;
+
+    bool rarest_ = false;
+    // partial sources known to have each piece; full ones add the same to
+    // every piece, which doesn't change the order
+    std::vector<uint32_t> holders_;
+    Buckets free_;                          // rarest-first: not done, none in flight, by holders
+    Buckets dup_;                           // in flight, room for an endgame copy, by copies
+
+    uint64_t steals_ = 0;
+    uint64_t endgame_ = 0;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+
+    bool take(int index, Piece &out);
+    // Around every change to a piece's state or holders: unlist() before,
+    // list() after, so it sits in the right bucket.
+    void unlist(int index);
+    void list(int index);
+    int pick_rarest(const std::vector<bool> *have, bool &any_free) const;
+    int pick_endgame(const std::vector<bool> *have) const;
+};
+
+
+// A piece of one of the files in a batch.
+struct BatchPiece {
+    size_t file = 0;
+    Piece piece;
+};
+
+// Hands out the pieces of several files to one pool of workers, so a batch
+// download keeps every connection busy across file boundaries. Each file
+// keeps its own PieceScheduler (runs, stealing, rarest-first, endgame); the
+// batch only decides which file the next piece comes from. Picks alternate
+// between the smallest and the largest unfinished file, so the round trips
+// of many small files overlap with the bulk of the large ones instead of
+// queueing behind them. Endgame duplicates are handed out only once no file
+// has a fresh piece for the worker.
+class BatchScheduler {
+public:
+    // Got: `out` is set. Busy: nothing right now, but files the worker's
+    // source serves are unfinished. Empty: nothing left for that source.
+    enum class Pick { Got, Busy, Empty };
+    // Whether the worker's source serves file `file`, and which of its
+    // pieces (`have` as for PieceScheduler::next).
+    using Usable = std::function<bool(size_t file, const std::vector<bool> *&have)>;
+
+    // Add every file before the first next(); returns the file's index.
+    size_t add(std::unique_ptr<PieceScheduler> file);
+    PieceScheduler &file(size_t i) { return *files_[i]; }
+    size_t file_count() const { return files_.size(); }
+
+    Pick next(int worker, BatchPiece &out, const Usable &usable);
+    bool complete(const BatchPiece &p);
+    void fail(const BatchPiece &p, bool count_attempt = true);
+    // Sleeps until a piece completes or fails anywhere, or `ms` have passed.
+    void wait(int ms);
+
+    // Abandons every file that isn't finished.
+    void abort();
+    // True once each file is finished or abandoned.
+    bool settled(size_t i);
+    bool finished();
+
+private:
+    std::vector<std::unique_ptr<PieceScheduler>> files_;
+    std::vector<size_t> order_;             // by size, smallest first
+    std::atomic<uint64_t> turn_{0};
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+};
+
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "manifest.hpp"
+#include "catalog.hpp"
+#include "shaper.hpp"
+#include "compress.hpp"
+#include "filecache.hpp"
+#include "swarm.hpp"
+
+// How range bodies are copied from the file to the socket.
+//   Sendfile: sendfile(2), falls back to Splice when the file system refuses
+//   Splice:   file -> pipe -> socket via splice(2), falls back to Buffered
+//   Buffered: pread() into a user-space buffer + send()
+enum class SendMode { Sendfile, Splice, Buffered };
+
+const char* send_mode_name(SendMode m);
+bool parse_send_mode(const std::string& s, SendMode& out);
+
+struct ServerConfig {
+    int reactors = 0;              // event loops (0 = one per core)
+    int backlog = 1024;            // listen() backlog per reactor
+    int max_connections = 4096;    // cap across all reactors
+    SendMode send_mode = SendMode::Sendfile;
+    int report_interval = 10;      // seconds between throughput reports (0 = off)
+    ShaperConfig shaping;          // upload rate limits, off by default
+    bool compression = true;       // answer "GET ... lz4" with compressed bodies
+    size_t compress_cache = 64 << 20;   // bytes of compressed pieces kept for reuse
+    size_t fd_cache = 256;         // shared files kept open between requests (0 = open per request)
+    size_t hot_cache = 0;          // bytes of popular ranges served from memory (0 = off)
+    bool exclusive_port = false;   // one listener without SO_REUSEPORT: fails if the port is in use
+                                   // instead of splitting its connections with another server
+};
+
+// Event-driven file server. Each reactor owns its own SO_REUSEPORT listening
+// socket and epoll instance, so the kernel spreads incoming connections over
+// a fixed number of threads instead of one thread per client.
+//
+// Besides the catalog's files it serves the finished pieces of the downloads
+// registered in `partials`, if given.
+class FileServer {
+public:
+    FileServer(int port, std::shared_ptr<Catalog> catalog, const ServerConfig& cfg,
+               std::shared_ptr<const PartialFiles> partials = nullptr);
+    ~FileServer();
+
+    bool start();
+    void stop();
+
+private:
+    int port_;
+    std::shared_ptr<Catalog> catalog_;
+    std::shared_ptr<const PartialFiles> partials_;
+    ServerConfig cfg_;
+    std::atomic<bool> running_{false};
+
+    std::unique_ptr<ManifestStore> manifests_;
+    std::unique_ptr<Shaper> shaper_;   // null when no limit is configured
+    std::unique_ptr<CompressedPieces> compressed_;
+    std::unique_ptr<FileCache> files_;
+    std::unique_ptr<HotPieces> hot_;    // null when --hot-cache is off
+    std::vector<int> listen_fds_;
+    std::vector<std::thread> reactor_threads_;
+
+    int open_listener();
+    void reactor_worker(int index, int listen_fd, size_t max_conns);
+};
+
+
+#endif
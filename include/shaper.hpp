@@ -0,0 +1,110 @@
+#ifndef SHAPER_HPP
+#define SHAPER_HPP
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+
+// Upload limits for the file server, in bytes per second (0 = unlimited).
+// With `fair` on, clients (by IP) that are all sending split the server rate
+// evenly, however many connections each one opens; capacity a client leaves
+// unused goes to the others.
+struct ShaperConfig {
+    uint64_t server_rate = 0;
+    uint64_t client_rate = 0;
+    uint64_t conn_rate = 0;
+    bool fair = true;
+
+    bool enabled() const { return server_rate || client_rate || conn_rate; }
+};
+
+// "250000", "512K", "10M", "1G" (binary multiples) -> bytes, for rates and sizes.
+// Fails on anything that doesn't fit in 64 bits.
+bool parse_bytes(const std::string& s, uint64_t& out);
+
+// Classic token bucket. Not thread-safe; tokens may go negative when more
+// was sent than granted, which the next refills pay back.
+class TokenBucket {
+public:
+    TokenBucket() = default;
+    explicit TokenBucket(double rate);
+
+    bool limited() const { return rate_ > 0; }
+    // Refills at `rate` (the bucket's own rate if 0) and returns the tokens.
+    double available(std::chrono::steady_clock::time_point now, double rate = 0);
+    void consume(double n) { tokens_ -= n; }
+    // Seconds until `n` tokens will be there at `rate`.
+    double seconds_until(double n, double rate = 0) const;
+    double burst() const { return burst_; }
+
+private:
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_;
+};
+
+class Flow;
+
+class Shaper {
+public:
+    explicit Shaper(const ShaperConfig& cfg);
+
+    const ShaperConfig& config() const { return cfg_; }
+
+    // One line per client with its rate since the previous call, plus the
+    // total and Jain's fairness index (1.0 = perfectly even).
+    std::string report();
+
+private:
+    friend class Flow;
+
+    struct Client {
+        uint32_t addr = 0;              // IPv4, network byte order
+        TokenBucket limit;              // --client-rate
+        TokenBucket fair;               // its share of --rate while busy
+        int flows = 0;                  // open connections
+        int busy = 0;                   // connections with a body to send
+        uint64_t bytes = 0;
+        uint64_t reported = 0;
+    };
+
+    ShaperConfig cfg_;
+    std::mutex mu_;
+    TokenBucket server_;
+    std::unordered_map<uint32_t, std::shared_ptr<Client>> clients_;
+    int active_ = 0;                    // clients with at least one busy flow
+    std::chrono::steady_clock::time_point last_report_;
+};
+
+// Shaping state of one connection, owned by its reactor.
+class Flow {
+public:
+    Flow(Shaper& shaper, uint32_t addr);
+    ~Flow();
+
+    Flow(const Flow&) = delete;
+    Flow& operator=(const Flow&) = delete;
+
+    // How many of `want` bytes may go out now. 0 means wait: `retry` is set
+    // to when enough tokens should be back.
+    uint64_t allowance(uint64_t want, std::chrono::steady_clock::time_point now,
+                       std::chrono::steady_clock::time_point& retry);
+    void consumed(uint64_t n);
+
+    // Whether this connection currently has a body to send; a client takes
+    // part in the fair split only while one of its connections does.
+    void set_busy(bool busy);
+
+private:
+    Shaper &shaper_;
+    std::shared_ptr<Shaper::Client> client_;
+    TokenBucket conn_;
+    bool busy_ = false;
+};
+
+
+#endif
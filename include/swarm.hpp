@@ -0,0 +1,91 @@
+#ifndef SWARM_HPP
+#define SWARM_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "catalog.hpp"
+#include "manifest.hpp"
+
+// Partial seeding: a downloader serves the pieces it already has to other
+// downloaders while its own download is still running, so a crowd pulling
+// the same file spreads the load instead of queueing on the one seeder.
+
+// Which pieces of a file a peer has, as sent in reply to HAVE:
+//   P2PHAVE 1 <file_size> <piece_size> <count>\n<bitmap: count bits, LSB first>
+struct HaveMap {
+    uint64_t file_size = 0;
+    uint64_t piece_size = 0;
+    std::vector<bool> pieces;
+};
+
+std::string serialize_have(const HaveMap& h);
+bool parse_have(const std::string& text, HaveMap& h);
+
+// Every piece; what a seeder with the whole file reports.
+HaveMap have_all(uint64_t file_size, uint64_t piece_size);
+
+// Piece bitmap of a download in progress. The downloader sets a bit once the
+// piece is on disk; reactors read the bits without taking a lock.
+class PieceMap {
+public:
+    PieceMap(uint64_t file_size, uint64_t piece_size);
+
+    void set(size_t index);
+    bool has(size_t index) const;
+    // True if every byte of [start, end) lies in pieces that are set.
+    bool covers(uint64_t start, uint64_t end) const;
+    // The map in pieces of `piece_size`, which may differ from the one the
+    // download uses; a piece counts only if all of it is covered.
+    HaveMap view(uint64_t piece_size) const;
+
+    uint64_t file_size() const { return file_size_; }
+    uint64_t piece_size() const { return piece_size_; }
+
+private:
+    uint64_t file_size_;
+    uint64_t piece_size_;
+    size_t count_;
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+};
+
+struct PartialFile {
+    std::string path;                           // the output file being written
+    std::shared_ptr<const Manifest> manifest;   // null for an unverified download
+    PieceMap pieces;
+
+    PartialFile(std::string p, std::shared_ptr<const Manifest> m, uint64_t file_size, uint64_t piece_size)
+        : path(std::move(p)), manifest(std::move(m)), pieces(file_size, piece_size) {}
+};
+
+// The downloads in progress a node offers to its peers, by file name. The
+// file server answers GET, MANIFEST and HAVE for them; CATALOG lists them
+// apart from the fully shared files.
+class PartialFiles {
+public:
+    PartialFiles();
+
+    void add(const std::string& name, std::shared_ptr<const PartialFile> file);
+    void remove(const std::string& name);
+    std::shared_ptr<const PartialFile> find(std::string_view name) const;
+
+    // Name -> size of every registered file (mtimes are zero).
+    std::shared_ptr<const CatalogFiles> snapshot() const;
+    // Bumped whenever a file is added or removed.
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+private:
+    mutable std::mutex mu_;
+    std::map<std::string, std::shared_ptr<const PartialFile>, std::less<>> files_;
+    std::shared_ptr<const CatalogFiles> listing_;
+    std::atomic<uint64_t> version_{0};
+};
+
+
+#endif
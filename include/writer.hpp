@@ -0,0 +1,81 @@
+#ifndef WRITER_HPP
+#define WRITER_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <cstdint>
+
+// How downloaded pieces reach the output file.
+//   Pwrite: one pwrite(2) per piece from the calling worker
+//   Mmap:   memcpy into a shared mapping of the whole file
+//   Uring:  writes from all workers are gathered by one thread and submitted
+//           to io_uring in batches; falls back to Pwrite if io_uring is unavailable
+enum class WriteMode { Pwrite, Mmap, Uring };
+
+const char* write_mode_name(WriteMode m);
+bool parse_write_mode(const std::string& s, WriteMode& out);
+
+// The download's output file, shared by every worker. There is no stream
+// state: each write carries its own offset, so workers never serialise on a
+// seek position. The file is preallocated with fallocate() so it isn't left
+// sparse and fragmented by out-of-order pieces.
+class OutputFile {
+public:
+    OutputFile(const std::string& path, uint64_t size, WriteMode mode = WriteMode::Pwrite);
+    ~OutputFile();
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // Open (creating if needed) and reserve `size` bytes. `truncate` discards
+    // existing contents; without it the data already on disk is kept (resume).
+    bool open(bool truncate);
+    void close();
+
+    // Thread-safe; writes to disjoint ranges may run concurrently.
+    bool write(uint64_t off, const char *data, size_t len);
+    bool read(uint64_t off, char *dst, size_t len);
+
+    WriteMode mode() const { return mode_; }
+    uint64_t batches() const { return batches_; }   // io_uring submissions
+
+private:
+    struct Ring;
+    struct Request {
+        uint64_t off;
+        const char *data;
+        size_t len;
+        int err = 0;
+        bool done = false;
+    };
+
+    std::string path_;
+    uint64_t size_;
+    WriteMode mode_;
+    int fd_ = -1;
+    char *map_ = nullptr;
+
+    std::unique_ptr<Ring> ring_;
+    std::thread ring_thread_;
+    std::deque<Request*> queue_;
+    bool stopping_ = false;
+    bool ring_failed_ = false;          // writes went back to pwrite; ring_ unused
+    uint64_t batches_ = 0;
+    std::mutex mu_;
+    std::condition_variable cv_;        // new requests for the ring thread
+    std::condition_variable done_cv_;   // completions for waiting writers
+
+    bool preallocate();
+    int write_at(uint64_t off, const char *data, size_t len);
+    bool start_ring();
+    void ring_worker();
+    void abandon_ring(std::vector<Request*> pending, size_t inflight, int err);
+};
+
+
+#endif
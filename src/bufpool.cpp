@@ -0,0 +1,165 @@
+#include "bufpool.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/mman.h>
+
+// ---------------------------------------------------------------
+// PooledBuffer
+// ---------------------------------------------------------------
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& o) noexcept {
+    if (this == &o) return *this;
+    reset();
+    pool_ = o.pool_;
+    data_ = o.data_;
+    size_ = o.size_;
+    cls_ = o.cls_;
+    o.pool_ = nullptr;
+    o.data_ = nullptr;
+    o.size_ = 0;
+    return *this;
+}
+
+void PooledBuffer::reset() {
+    if (pool_ && data_) pool_->release(data_, cls_);
+    pool_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+
+// ---------------------------------------------------------------
+// Pool
+// ---------------------------------------------------------------
+// Anonymous memory for a slab or a large buffer; `huge` says whether it got
+// explicit huge pages.
+static char* map_bytes(size_t len, bool hugepages, bool &huge) {
+    huge = false;
+    if (hugepages) {
+        void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            huge = true;
+            return (char*)p;
+        }
+    }
+    void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    // none reserved: let the kernel back it with transparent huge pages
+    if (hugepages) madvise(p, len, MADV_HUGEPAGE);
+    return (char*)p;
+}
+
+void BufferPool::configure(size_t budget, bool hugepages) {
+    std::lock_guard<std::mutex> lock(mu_);
+    budget_ = budget;
+    hugepages_ = hugepages;
+    cv_.notify_all();
+}
+
+PooledBuffer BufferPool::try_acquire(size_t len) {
+    return get(len, false, nullptr);
+}
+
+PooledBuffer BufferPool::acquire(size_t len, const std::function<bool()> &abort) {
+    return get(len, true, abort);
+}
+
+PooledBuffer BufferPool::get(size_t len, bool wait, const std::function<bool()> &abort) {
+    int cls = 0;
+    while (cls < CLASSES - 1 && (MIN_CLASS << cls) < len) cls++;
+    size_t size = MIN_CLASS << cls;
+    if (size < len) return {};
+    size_t need = std::max(size, SLAB_BYTES);
+
+    std::unique_lock<std::mutex> lock(mu_);
+    bool waited = false;
+    while (true) {
+        // both what is on loan and what is mapped stay under the budget
+        if (budget_ == 0) break;
+        if (in_use_ == 0) {
+            // granted regardless, but idle buffers of other sizes still go
+            // first, so only this one mapping can overshoot
+            if (free_[cls].empty()) make_room(need, cls);
+            break;
+        }
+        if (in_use_ + size <= budget_ &&
+            (!free_[cls].empty() || mapped_ + need <= budget_ || make_room(need, cls))) break;
+        if (!waited) {
+            waited = true;
+            waits_++;
+        }
+        if (!wait) return {};
+        cv_.wait_for(lock, std::chrono::milliseconds(50));
+        if (abort && abort()) return {};
+    }
+    if (free_[cls].empty()) {
+        // reserve the bytes, then map outside the lock
+        mapped_ += need;
+        bool hugepages = hugepages_;
+        lock.unlock();
+        bool huge = false;
+        char *p = map_bytes(need, hugepages, huge);
+        lock.lock();
+        if (!p) {
+            mapped_ -= need;
+            return {};
+        }
+        if (huge) {
+            huge_ += need;
+            huge_maps_.insert(p);
+        }
+        for (size_t off = 0; off < need; off += size) free_[cls].push_back(p + off);
+    }
+
+    PooledBuffer b;
+    b.pool_ = this;
+    b.data_ = free_[cls].back();
+    b.size_ = size;
+    b.cls_ = cls;
+    free_[cls].pop_back();
+    in_use_ += size;
+    peak_ = std::max(peak_, in_use_);
+    return b;
+}
+
+// Unmaps idle buffers of other large classes, biggest first, until `need`
+// more bytes fit the budget. Slab-carved classes stay mapped. Caller holds mu_.
+bool BufferPool::make_room(size_t need, int keep) {
+    for (int c = CLASSES - 1; c >= 0 && mapped_ + need > budget_; --c) {
+        size_t size = MIN_CLASS << c;
+        if (c == keep || size < SLAB_BYTES) continue;
+        while (!free_[c].empty() && mapped_ + need > budget_) {
+            char *p = free_[c].back();
+            free_[c].pop_back();
+            munmap(p, size);
+            mapped_ -= size;
+            if (huge_maps_.erase(p)) huge_ -= size;
+        }
+    }
+    return mapped_ + need <= budget_;
+}
+
+void BufferPool::release(char *data, int cls) {
+    std::lock_guard<std::mutex> lock(mu_);
+    free_[cls].push_back(data);
+    in_use_ -= MIN_CLASS << cls;
+    cv_.notify_all();
+}
+
+BufferPool::Stats BufferPool::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    Stats s;
+    s.budget = budget_;
+    s.mapped = mapped_;
+    s.in_use = in_use_;
+    s.peak_in_use = peak_;
+    s.huge = huge_;
+    s.waits = waits_;
+    return s;
+}
+
+BufferPool& buffer_pool() {
+    static BufferPool pool;
+    return pool;
+}
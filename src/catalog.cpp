@@ -0,0 +1,315 @@
+#include "catalog.hpp"
+#include "hash.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static constexpr int RESCAN_SECS = 2;            // polling fallback
+static constexpr int PUBLISH_INTERVAL_MS = 250;  // coalesce bursts (e.g. a file being copied in)
+static constexpr const char* CACHE_DIR = ".p2p";
+
+static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR;
+
+static std::string join(const std::string &dir, const std::string &name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+static bool under(const std::string &name, const std::string &dir) {
+    return name.size() > dir.size() && name.compare(0, dir.size(), dir) == 0 && name[dir.size()] == '/';
+}
+
+// ---------------------------------------------------------------
+// Digest and text form
+// ---------------------------------------------------------------
+static void digest_entries(std::string& buf, const CatalogFiles& files) {
+    for (auto &kv : files) {
+        buf += kv.first;
+        buf.push_back('\0');
+        buf += std::to_string(kv.second.size);
+        buf.push_back('\n');
+    }
+}
+
+bool safe_file_name(std::string_view name) {
+    if (name.empty() || name.front() == '/') return false;
+    size_t start = 0;
+    while (true) {
+        size_t slash = name.find('/', start);
+        std::string_view part = name.substr(start, slash == std::string_view::npos ? slash : slash - start);
+        if (part.empty() || part == "." || part == "..") return false;
+        if (slash == std::string_view::npos) return true;
+        start = slash + 1;
+    }
+}
+
+uint64_t catalog_digest(const CatalogFiles& files, const CatalogFiles& partial) {
+    std::string buf;
+    digest_entries(buf, files);
+    if (!partial.empty()) {
+        // a separator no file name can produce, so moving a file between
+        // the sections changes the digest
+        buf.push_back('\0');
+        digest_entries(buf, partial);
+    }
+    return xxh64(buf.data(), buf.size());
+}
+
+std::string serialize_catalog(const CatalogFiles& files, uint64_t digest, const CatalogFiles& partial) {
+    std::string out = "P2PCATALOG 1 " + hash_hex(digest) + " " + std::to_string(files.size()) + "\n";
+    for (auto &kv : files) out += std::to_string(kv.second.size) + " " + kv.first + "\n";
+    if (!partial.empty()) {
+        out += "P2PPARTIAL " + std::to_string(partial.size()) + "\n";
+        for (auto &kv : partial) out += std::to_string(kv.second.size) + " " + kv.first + "\n";
+    }
+    return out;
+}
+
+// `count` lines of "<size> <name>" into `out`.
+static bool parse_entries(std::istream& in, size_t count, CatalogFiles& out) {
+    std::string line;
+    while (out.size() < count && std::getline(in, line)) {
+        size_t sp = line.find(' ');
+        if (sp == std::string::npos || sp + 1 >= line.size()) return false;
+        CatalogEntry e;
+        try {
+            e.size = std::stoull(line.substr(0, sp));
+        } catch (...) {
+            return false;
+        }
+        std::string name = line.substr(sp + 1);
+        if (!safe_file_name(name)) return false;
+        out[name] = e;
+    }
+    return out.size() == count;
+}
+
+bool parse_catalog(const std::string& text, CatalogFiles& files, uint64_t& digest, CatalogFiles *partial) {
+    std::istringstream in(text);
+    std::string tag, hex;
+    int version = 0;
+    size_t count = 0;
+    if (!(in >> tag >> version >> hex >> count) || tag != "P2PCATALOG" || version != 1) return false;
+    if (!parse_hash_hex(hex, digest)) return false;
+    in.ignore(1);
+
+    CatalogFiles out, part;
+    if (!parse_entries(in, count, out)) return false;
+    if (in >> tag >> count) {
+        if (tag != "P2PPARTIAL") return false;
+        in.ignore(1);
+        if (!parse_entries(in, count, part)) return false;
+    }
+    if (catalog_digest(out, part) != digest) return false;
+    files = std::move(out);
+    if (partial) *partial = std::move(part);
+    return true;
+}
+
+
+Catalog::Catalog(const std::string& folder, bool recursive)
+    : folder_(folder), recursive_(recursive), published_(std::make_shared<CatalogFiles>()),
+      digest_(catalog_digest(CatalogFiles{})) {}
+
+Catalog::~Catalog() {
+    stop();
+}
+
+bool Catalog::start() {
+    if (running_) return true;
+    std::error_code ec;
+    if (!fs::is_directory(folder_, ec)) {
+        std::cerr << "[catalog] " << folder_ << " is not a directory\n";
+        return false;
+    }
+
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        std::cerr << "[catalog] inotify unavailable, rescanning every " << RESCAN_SECS << "s\n";
+        polling_ = true;
+    }
+    rescan();
+    publish();
+    std::cout << "[catalog] " << files_.size() << " files in " << folder_
+              << (recursive_ ? " (recursive)" : "") << "\n";
+
+    running_ = true;
+    thread_ = std::thread(&Catalog::worker, this);
+    return true;
+}
+
+void Catalog::stop() {
+    running_ = false;
+    if (thread_.joinable()) thread_.join();
+    if (inotify_fd_ >= 0) close(inotify_fd_);
+    inotify_fd_ = -1;
+    watches_.clear();
+}
+
+std::shared_ptr<const CatalogFiles> Catalog::snapshot(uint64_t *digest) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (digest) *digest = digest_;
+    return published_;
+}
+
+bool Catalog::lookup(std::string_view name, CatalogEntry& out) const {
+    auto files = snapshot();
+    auto it = files->find(name);
+    if (it == files->end()) return false;
+    out = it->second;
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Scanning (watcher thread only)
+// ---------------------------------------------------------------
+void Catalog::rescan() {
+    CatalogFiles before;
+    before.swap(files_);
+    bool was_dirty = dirty_;
+    scan_dir("");
+    dirty_ = was_dirty || files_ != before;
+}
+
+void Catalog::scan_dir(const std::string& rel) {
+    // watch before listing so nothing created in between is missed
+    add_watch(rel);
+    std::error_code ec;
+    fs::directory_iterator it(rel.empty() ? folder_ : path_of(rel), ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+        std::string name = join(rel, it->path().filename().string());
+        std::error_code ec2;
+        if (it->is_symlink(ec2) ? false : it->is_directory(ec2)) {
+            if (recursive_ && it->path().filename() != CACHE_DIR) scan_dir(name);
+            continue;
+        }
+        refresh(name);
+    }
+}
+
+void Catalog::add_watch(const std::string& rel) {
+    if (polling_ || inotify_fd_ < 0) return;
+    int wd = inotify_add_watch(inotify_fd_, (rel.empty() ? folder_ : path_of(rel)).c_str(), WATCH_MASK);
+    if (wd < 0) {
+        // most likely fs.inotify.max_user_watches; rescans still see everything
+        std::cerr << "[catalog] can't watch " << path_of(rel) << ", rescanning every "
+                  << RESCAN_SECS << "s instead\n";
+        polling_ = true;
+        return;
+    }
+    watches_[wd] = rel;
+}
+
+// Re-stat one file and update the working map.
+void Catalog::refresh(const std::string& name) {
+    struct stat st{};
+    if (stat(path_of(name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        CatalogEntry e;
+        e.size = (uint64_t)st.st_size;
+        e.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        auto it = files_.find(name);
+        if (it != files_.end() && it->second.size == e.size && it->second.mtime_ns == e.mtime_ns) return;
+        files_[name] = e;
+        dirty_ = true;
+    } else if (files_.erase(name)) {
+        dirty_ = true;
+    }
+}
+
+// A subdirectory went away (or was moved out): drop its files and watches.
+void Catalog::forget_dir(const std::string& rel) {
+    for (auto it = files_.lower_bound(rel + "/"); it != files_.end() && under(it->first, rel);) {
+        it = files_.erase(it);
+        dirty_ = true;
+    }
+    for (auto it = watches_.begin(); it != watches_.end();) {
+        if (it->second == rel || under(it->second, rel)) {
+            inotify_rm_watch(inotify_fd_, it->first);
+            it = watches_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Catalog::handle_events() {
+    alignas(inotify_event) char buf[64 * 1024];
+    while (true) {
+        ssize_t n = read(inotify_fd_, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        for (char *p = buf; p < buf + n;) {
+            auto *ev = (inotify_event*)p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost; start over from the file system
+                rescan();
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watches_.erase(ev->wd);
+                continue;
+            }
+            auto w = watches_.find(ev->wd);
+            if (w == watches_.end() || ev->len == 0) continue;
+            std::string name = join(w->second, ev->name);
+
+            if (ev->mask & IN_ISDIR) {
+                if (!recursive_ || (w->second.empty() && std::string(ev->name) == CACHE_DIR)) continue;
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) forget_dir(name);
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) scan_dir(name);
+                continue;
+            }
+            refresh(name);
+        }
+    }
+}
+
+void Catalog::publish() {
+    if (!dirty_) return;
+    dirty_ = false;
+    auto next = std::make_shared<const CatalogFiles>(files_);
+    uint64_t digest = catalog_digest(*next);
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        published_ = std::move(next);
+        digest_ = digest;
+    }
+    version_.fetch_add(1, std::memory_order_release);
+}
+
+void Catalog::worker() {
+    auto last_publish = std::chrono::steady_clock::now();
+    auto last_scan = last_publish;
+    while (running_) {
+        if (!polling_) {
+            pollfd pfd{inotify_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, PUBLISH_INTERVAL_MS) > 0) handle_events();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(PUBLISH_INTERVAL_MS));
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (polling_ && now - last_scan >= std::chrono::seconds(RESCAN_SECS)) {
+            rescan();
+            last_scan = now;
+        }
+        if (dirty_ && now - last_publish >= std::chrono::milliseconds(PUBLISH_INTERVAL_MS)) {
+            publish();
+            last_publish = now;
+        }
+    }
+}
@@ -0,0 +1,309 @@
+#include "compress.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+// ---------------------------------------------------------------
+// LZ4 block format
+// ---------------------------------------------------------------
+static constexpr int HASH_LOG = 16;
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t LAST_LITERALS = 5;     // a block always ends in literals
+static constexpr size_t MF_LIMIT = 12;         // no match may start this close to the end
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr size_t SAMPLE_BYTES = 64 * 1024;
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// End of the run of equal bytes starting at `m` and `r`, stopping at `limit`.
+static const uint8_t* match_end(const uint8_t *m, const uint8_t *r, const uint8_t *limit) {
+    while (m + 8 <= limit) {
+        uint64_t diff = read64(m) ^ read64(r);
+        if (diff) return m + (__builtin_ctzll(diff) >> 3);   // little-endian
+        m += 8;
+        r += 8;
+    }
+    while (m < limit && *m == *r) { m++; r++; }
+    return m;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Length beyond the 4-bit token nibble: runs of 255 plus a final byte.
+static bool put_length(uint8_t *&op, const uint8_t *oend, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= oend) return false;
+        *op++ = 255;
+    }
+    if (op >= oend) return false;
+    *op++ = (uint8_t)len;
+    return true;
+}
+
+static bool get_length(const uint8_t *&ip, const uint8_t *iend, size_t &len) {
+    uint8_t b;
+    do {
+        if (ip >= iend) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+static bool put_sequence(uint8_t *&op, const uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                         size_t offset, size_t match_len) {
+    if (op >= oend) return false;
+    uint8_t *token = op++;
+    *token = (uint8_t)(std::min<size_t>(lit_len, 15) << 4);
+    if (lit_len >= 15 && !put_length(op, oend, lit_len)) return false;
+    if ((size_t)(oend - op) < lit_len) return false;
+    if (lit_len) std::memcpy(op, lit, lit_len);     // empty input: lit may be null
+    op += lit_len;
+    if (offset == 0) return true;   // final literals-only sequence
+
+    if (oend - op < 2) return false;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - MIN_MATCH;
+    *token |= (uint8_t)std::min<size_t>(ml, 15);
+    return ml < 15 || put_length(op, oend, ml);
+}
+
+size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+size_t lz4_compress(const char *src_, size_t n, char *dst, size_t cap) {
+    const uint8_t *src = (const uint8_t*)src_;
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = (uint8_t*)dst;
+    const uint8_t *oend = op + cap;
+
+    if (n > MF_LIMIT) {
+        // Reused by every call on this thread and never cleared: an entry left
+        // by an earlier input is just a candidate that fails the checks below.
+        thread_local std::vector<uint32_t> table((size_t)1 << HASH_LOG, 0);
+        const uint8_t *mf_limit = end - MF_LIMIT;
+        const uint8_t *match_limit = end - LAST_LITERALS;
+        unsigned misses = 0;
+        ip++;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            uint32_t pos = (uint32_t)(ip - src), cand = table[h];
+            table[h] = pos;
+            if (cand >= pos || pos - cand > MAX_OFFSET || read32(src + cand) != seq) {
+                // skip faster through data that isn't matching
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            const uint8_t *ref = src + cand;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) { ip--; ref--; }
+            const uint8_t *m = match_end(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            if (!put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip))) return 0;
+            ip = anchor = m;
+            if (ip < mf_limit) table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+    if (!put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0)) return 0;
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+bool lz4_decompress(const char *src, size_t n, char *dst_, size_t out_len) {
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + n;
+    uint8_t *dst = (uint8_t*)dst_, *op = dst, *oend = dst + out_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_length(ip, iend, lit)) return false;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return false;
+        if (lit) std::memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;      // the last sequence has no match
+
+        if (iend - ip < 2) return false;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return false;
+        size_t ml = token & 15;
+        if (ml == 15 && !get_length(ip, iend, ml)) return false;
+        ml += MIN_MATCH;
+        if (ml > (size_t)(oend - op)) return false;
+
+        const uint8_t *m = op - offset;
+        if (offset >= ml) {
+            std::memcpy(op, m, ml);
+            op += ml;
+        } else {
+            // overlapping copy repeats the last `offset` bytes; 8-byte steps
+            // are safe as long as each one reads only bytes already written
+            size_t k = 0;
+            if (offset >= 8) {
+                for (; k + 8 <= ml; k += 8) std::memcpy(op + k, m + k, 8);
+            }
+            for (; k < ml; ++k) op[k] = m[k];
+            op += ml;
+        }
+    }
+    return op == oend;
+}
+
+bool worth_compressing(const char *data, size_t n) {
+    size_t sample = std::min(n, SAMPLE_BYTES);
+    std::vector<char> out(lz4_bound(sample));
+    size_t z = lz4_compress(data, sample, out.data(), out.size());
+    return z > 0 && z * 10 < sample * 9;
+}
+
+
+// ---------------------------------------------------------------
+// Compressed piece cache
+// ---------------------------------------------------------------
+// Ranges waiting for a worker; past this, misses are sent raw.
+static constexpr size_t MAX_PENDING_JOBS = 64;
+
+static std::string range_key(std::string_view name, int64_t mtime_ns, uint64_t start, uint64_t end) {
+    std::string key(name);
+    key += '\0';
+    key += std::to_string(mtime_ns) + ":" + std::to_string(start) + ":" + std::to_string(end);
+    return key;
+}
+
+CompressedPieces::CompressedPieces(size_t capacity, int workers) : capacity_(capacity) {
+    for (int i = 0; i < std::max(1, workers); ++i) workers_.emplace_back(&CompressedPieces::worker, this);
+}
+
+CompressedPieces::~CompressedPieces() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        running_ = false;
+    }
+    jobs_cv_.notify_all();
+    for (auto &t : workers_) t.join();
+}
+
+CompressedPieces::Stats CompressedPieces::stats() const {
+    Stats s;
+    s.hits = hits_;
+    s.compressed = compressed_;
+    s.skipped = skipped_;
+    s.overflow = overflow_;
+    s.raw_bytes = raw_bytes_;
+    s.wire_bytes = wire_bytes_;
+    return s;
+}
+
+void CompressedPieces::insert(std::string key, std::shared_ptr<const std::string> data) {
+    // caller holds mu_
+    if (index_.count(key)) return;     // another worker got there first
+    size_t cost = key.size() + (data ? data->size() : 0);
+    if (cost > capacity_) return;
+    while (used_ + cost > capacity_ && !lru_.empty()) {
+        Entry &old = lru_.back();
+        used_ -= old.key.size() + (old.data ? old.data->size() : 0);
+        index_.erase(old.key);
+        lru_.pop_back();
+    }
+    lru_.push_front({std::move(key), std::move(data)});
+    index_[lru_.front().key] = lru_.begin();
+    used_ += cost;
+}
+
+bool CompressedPieces::cached(std::string_view name, int64_t mtime_ns, uint64_t start, uint64_t end,
+                              std::shared_ptr<const std::string> &out) {
+    out.reset();
+    if (end <= start || end - start > MAX_COMPRESSED_RANGE) return true;
+    std::string key = range_key(name, mtime_ns, start, end);
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(key);
+    if (it == index_.end()) return false;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    out = it->second->data;
+    hits_++;
+    if (out) {
+        raw_bytes_ += end - start;
+        wire_bytes_ += out->size();
+    }
+    return true;
+}
+
+bool CompressedPieces::compress(std::string_view name, int64_t mtime_ns, std::shared_ptr<const OpenFile> file,
+                                uint64_t start, uint64_t end, Done done) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (jobs_.size() >= MAX_PENDING_JOBS) {
+            overflow_++;
+            return false;
+        }
+        jobs_.push_back({range_key(name, mtime_ns, start, end), std::move(file), start, end, std::move(done)});
+    }
+    jobs_cv_.notify_one();
+    return true;
+}
+
+void CompressedPieces::worker() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            jobs_cv_.wait(lock, [&] { return !running_ || !jobs_.empty(); });
+            if (!running_) return;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job.done(compress_range(job));
+    }
+}
+
+std::shared_ptr<const std::string> CompressedPieces::compress_range(const Job &job) {
+    size_t len = (size_t)(job.end - job.start);
+    thread_local std::vector<char> raw;
+    raw.resize(len);
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = pread(job.file->fd, raw.data() + got, len - got, (off_t)(job.start + got));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return nullptr;
+        got += (size_t)r;
+    }
+
+    std::shared_ptr<std::string> z;
+    if (worth_compressing(raw.data(), len)) {
+        z = std::make_shared<std::string>(lz4_bound(len), '\0');
+        size_t zlen = lz4_compress(raw.data(), len, &(*z)[0], z->size());
+        // a body that barely shrinks isn't worth the client's decode
+        if (zlen == 0 || zlen * 20 > len * 19) z.reset();
+        else z->resize(zlen);
+    }
+    if (z) {
+        compressed_++;
+        raw_bytes_ += len;
+        wire_bytes_ += z->size();
+    } else {
+        skipped_++;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    insert(job.key, z);
+    return z;
+}
@@ -0,0 +1,257 @@
+#include "connection.hpp"
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+// A connection that delivers nothing for this long is treated as dead.
+static constexpr int STALL_TIMEOUT_SECS = 15;
+
+int connect_to(const std::string& host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    sockaddr_in srv{};
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &srv.sin_addr) <= 0) { close(sock); return -1; }
+    if (connect(sock, (sockaddr*)&srv, sizeof(srv)) < 0) { close(sock); return -1; }
+
+    // wake up once a second so abort callbacks are noticed even if the peer stalls
+    timeval tv{};
+    tv.tv_sec = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return sock;
+}
+
+ssize_t recv_some(int fd, void *dst, size_t len, const std::function<bool()> &abort) {
+    int idle = 0;
+    while (true) {
+        if (abort && abort()) return -1;
+        ssize_t r = recv(fd, dst, len, 0);
+        if (r >= 0) return r;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            if (++idle >= STALL_TIMEOUT_SECS) return -1;
+            continue;
+        }
+        return -1;
+    }
+}
+
+
+// ---------------------------------------------------------------
+// Buffered reader
+// ---------------------------------------------------------------
+SocketReader::SocketReader(size_t capacity) : buf_(capacity) {}
+
+void SocketReader::reset(int fd) {
+    fd_ = fd;
+    pos_ = end_ = 0;
+    eof_ = false;
+}
+
+bool SocketReader::read_line(std::string_view &line, const std::function<bool()> &abort, size_t max_len) {
+    size_t scanned = pos_;
+    while (true) {
+        const char *nl = (const char*)std::memchr(buf_.data() + scanned, '\n', end_ - scanned);
+        if (nl) {
+            size_t len = (size_t)(nl - (buf_.data() + pos_)) + 1;
+            line = std::string_view(buf_.data() + pos_, len);
+            pos_ += len;
+            return true;
+        }
+        if (end_ - pos_ >= max_len) return false;
+        if (end_ == buf_.size()) {
+            // slide the partial line to the front to make room
+            std::memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+        }
+        scanned = end_;
+        ssize_t r = recv_some(fd_, buf_.data() + end_, buf_.size() - end_, abort);
+        eof_ = r == 0;
+        if (r <= 0) return false;
+        end_ += (size_t)r;
+    }
+}
+
+bool SocketReader::read_exact(char *dst, uint64_t len, std::atomic<uint64_t> *progress,
+                              const std::function<bool()> &abort) {
+    size_t have = (size_t)std::min<uint64_t>(end_ - pos_, len);
+    if (have) {
+        std::memcpy(dst, buf_.data() + pos_, have);
+        pos_ += have;
+        if (progress) *progress += have;
+    }
+    if (pos_ == end_) pos_ = end_ = 0;
+    uint64_t got = have;
+    while (got < len) {
+        // exactly what's left, so nothing behind the body is consumed
+        ssize_t r = recv_some(fd_, dst + got, (size_t)(len - got), abort);
+        if (r <= 0) return false;
+        got += (uint64_t)r;
+        if (progress) *progress += (uint64_t)r;
+    }
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Replies
+// ---------------------------------------------------------------
+bool parse_response(std::string_view line, Response &r) {
+    r = Response{};
+    // "OK <id> <len> [lz4]\n" or "ERR <id> <reason>\n"
+    LineFields f;
+    if (!split_fields(line, f) || f.n < 2) return false;
+    if (!parse_u32(f.f[1], r.id)) return false;
+    if (f.f[0] == "OK") {
+        r.ok = true;
+        r.compressed = f.n >= 4 && f.f[3] == "lz4";
+        return f.n >= 3 && parse_u64(f.f[2], r.length);
+    }
+    if (f.f[0] != "ERR") return false;
+    r.error = f.n >= 3 ? std::string(f.f[2]) : "error";
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Connection
+// ---------------------------------------------------------------
+PeerConnection::PeerConnection(const std::string& host, int port) : host_(host), port_(port) {}
+
+PeerConnection::~PeerConnection() {
+    close();
+}
+
+bool PeerConnection::open() {
+    close();
+    legacy_ = false;
+    fd_ = connect_to(host_, port_);
+    if (fd_ < 0) return false;
+    in_.reset(fd_);
+
+    // small pipelined requests shouldn't wait on Nagle
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto sent = std::chrono::steady_clock::now();
+    std::string_view line;
+    if (!send_all(HELLO_LINE, std::strlen(HELLO_LINE))) {
+        close();
+        return false;
+    }
+    if (!in_.read_line(line, nullptr) || line != HELLO_LINE) {
+        // v1 servers close the connection on an unknown command, or answer
+        // it with an error
+        legacy_ = line.empty() ? in_.eof() : line.compare(0, 4, "ERR ") == 0;
+        close();
+        return false;
+    }
+    rtt_ms_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+    return true;
+}
+
+void PeerConnection::close() {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+    out_.clear();
+}
+
+bool PeerConnection::send_all(const char *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t s = send(fd_, data + off, len - off, MSG_NOSIGNAL);
+        if (s < 0 && errno == EINTR) continue;
+        if (s <= 0) return false;
+        off += (size_t)s;
+    }
+    return true;
+}
+
+bool PeerConnection::flush() {
+    if (fd_ < 0) return false;
+    if (out_.empty()) return true;
+    bool ok = send_all(out_.data(), out_.size());
+    out_.clear();
+    return ok;
+}
+
+bool PeerConnection::send_get(uint32_t id, const std::string& filename, uint64_t start, uint64_t end,
+                              bool compress) {
+    if (fd_ < 0) return false;
+    out_ += "GET ";
+    append_u64(out_, id);
+    out_ += ' ';
+    out_ += filename;
+    out_ += ' ';
+    append_u64(out_, start);
+    out_ += ' ';
+    append_u64(out_, end);
+    if (compress) out_ += " lz4";
+    out_ += '\n';
+    return true;
+}
+
+bool PeerConnection::send_manifest(uint32_t id, const std::string& filename, uint64_t piece_size, bool weak) {
+    if (fd_ < 0) return false;
+    out_ += "MANIFEST ";
+    append_u64(out_, id);
+    out_ += ' ';
+    out_ += filename;
+    out_ += ' ';
+    append_u64(out_, piece_size);
+    if (weak) out_ += " weak";
+    out_ += '\n';
+    return true;
+}
+
+bool PeerConnection::send_catalog(uint32_t id) {
+    if (fd_ < 0) return false;
+    out_ += "CATALOG ";
+    append_u64(out_, id);
+    out_ += '\n';
+    return true;
+}
+
+bool PeerConnection::send_have(uint32_t id, const std::string& filename, uint64_t piece_size) {
+    if (fd_ < 0) return false;
+    out_ += "HAVE ";
+    append_u64(out_, id);
+    out_ += ' ';
+    out_ += filename;
+    out_ += ' ';
+    append_u64(out_, piece_size);
+    out_ += '\n';
+    return true;
+}
+
+bool PeerConnection::send_stats(uint32_t id) {
+    if (fd_ < 0) return false;
+    out_ += "STATS ";
+    append_u64(out_, id);
+    out_ += '\n';
+    return true;
+}
+
+bool PeerConnection::read_response(Response &r, const std::function<bool()> &abort) {
+    std::string_view line;
+    if (!flush() || !in_.read_line(line, abort, 1024)) return false;
+    return parse_response(line, r);
+}
+
+bool PeerConnection::read_body(char *dst, uint64_t len, std::atomic<uint64_t> *progress,
+                               const std::function<bool()> &abort) {
+    if (!flush()) return false;
+    return in_.read_exact(dst, len, progress, abort);
+}
@@ -0,0 +1,112 @@
+#include "delta.hpp"
+#include "hash.hpp"
+
+#include <unordered_map>
+#include <algorithm>
+
+// Weak sums are probed once per byte of changed data, so a bitmap in front of
+// the hash map turns away almost every miss without a map lookup.
+static constexpr size_t FILTER_BITS = 1u << 20;
+
+static size_t filter_slot(uint32_t weak) {
+    return (size_t)((weak * 2654435761u) >> 12) & (FILTER_BITS - 1);
+}
+
+void RollingSum::init(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    a_ = a;
+    b_ = b;
+    len_ = (uint32_t)len;
+}
+
+uint32_t weak_sum(const void *data, size_t len) {
+    RollingSum s;
+    s.init((const unsigned char*)data, len);
+    return s.digest();
+}
+
+std::vector<DeltaMatch> find_reusable(const unsigned char *base, uint64_t base_size,
+                                      const Manifest& m, const std::vector<bool>& skip) {
+    std::vector<DeltaMatch> out;
+    size_t count = m.hashes.size();
+    if (m.weak.size() != count || count == 0 || base_size == 0) return out;
+
+    uint64_t block = m.piece_size;
+    std::unordered_map<uint32_t, std::vector<size_t>> by_weak;
+    std::vector<uint64_t> filter(FILTER_BITS / 64, 0);
+    size_t wanted = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t len = std::min<uint64_t>(block, m.file_size - (uint64_t)i * block);
+        if (i < skip.size() && skip[i]) continue;
+        if (len < block) continue;          // the short last piece is checked below
+        by_weak[m.weak[i]].push_back(i);
+        size_t slot = filter_slot(m.weak[i]);
+        filter[slot >> 6] |= 1ull << (slot & 63);
+        wanted++;
+    }
+
+    // Takes every still-missing piece that the window at `pos` matches;
+    // identical pieces (runs of zeros, repeated records) all come from one place.
+    auto try_match = [&](uint64_t pos, uint32_t weak) {
+        size_t slot = filter_slot(weak);
+        if (!(filter[slot >> 6] & (1ull << (slot & 63)))) return false;
+        auto it = by_weak.find(weak);
+        if (it == by_weak.end()) return false;
+        uint64_t strong = xxh64(base + pos, (size_t)block);
+        bool hit = false;
+        auto &cands = it->second;
+        for (size_t k = 0; k < cands.size();) {
+            size_t i = cands[k];
+            if (m.hashes[i] == strong) {
+                out.push_back({i, pos});
+                cands[k] = cands.back();
+                cands.pop_back();
+                wanted--;
+                hit = true;
+            } else {
+                ++k;
+            }
+        }
+        if (cands.empty()) by_weak.erase(it);
+        return hit;
+    };
+
+    if (base_size >= block && wanted > 0) {
+        RollingSum sum;
+        uint64_t pos = 0;
+        sum.init(base, (size_t)block);
+        while (wanted > 0) {
+            if (try_match(pos, sum.digest())) {
+                // the next piece most likely follows right after this one
+                pos += block;
+                if (pos + block > base_size) break;
+                sum.init(base + pos, (size_t)block);
+                continue;
+            }
+            if (pos + block >= base_size) break;
+            sum.roll(base[pos], base[pos + block]);
+            pos++;
+        }
+    }
+
+    // The short last piece: at the end of the old copy (unchanged tail) or at
+    // its own offset (file grew past it).
+    size_t last = count - 1;
+    uint64_t last_start = (uint64_t)last * block;
+    uint64_t last_len = m.file_size - last_start;
+    if (last_len < block && !(last < skip.size() && skip[last])) {
+        for (uint64_t pos : {base_size >= last_len ? base_size - last_len : UINT64_MAX, last_start}) {
+            if (pos == UINT64_MAX || pos + last_len > base_size) continue;
+            if (weak_sum(base + pos, (size_t)last_len) == m.weak[last] &&
+                xxh64(base + pos, (size_t)last_len) == m.hashes[last]) {
+                out.push_back({last, pos});
+                break;
+            }
+        }
+    }
+    return out;
+}
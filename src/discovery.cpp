@@ -0,0 +1,115 @@
+#include "discovery.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+static constexpr char ANNOUNCE_MAGIC[4] = {'P', '2', 'P', 'A'};
+static constexpr uint8_t ANNOUNCE_VERSION = 1;
+static constexpr char QUERY_MAGIC[4] = {'P', '2', 'P', 'Q'};
+static constexpr uint8_t QUERY_VERSION = 1;
+
+static void put_le(std::string &out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back((char)((v >> (8 * i)) & 0xff));
+}
+
+static uint64_t get_le(const char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) v |= (uint64_t)(uint8_t)p[i] << (8 * i);
+    return v;
+}
+
+std::string encode_announce(const Announce& a) {
+    std::string out(ANNOUNCE_MAGIC, sizeof(ANNOUNCE_MAGIC));
+    out.reserve(ANNOUNCE_HEADER + a.bloom.size());
+    put_le(out, ANNOUNCE_VERSION, 1);
+    put_le(out, a.bloom.empty() ? 0 : a.bloom_k, 1);
+    put_le(out, (uint64_t)a.port, 2);
+    put_le(out, a.peer_id, 8);
+    put_le(out, a.digest, 8);
+    put_le(out, a.file_count, 4);
+    put_le(out, a.bloom.size(), 2);
+    out.append((const char*)a.bloom.data(), a.bloom.size());
+    return out;
+}
+
+std::string encode_query_reply(const Announce& a) {
+    Announce header = a;
+    header.bloom_k = 0;
+    header.bloom.clear();
+    return encode_announce(header);
+}
+
+bool decode_announce(const char *data, size_t len, Announce& out) {
+    if (len < ANNOUNCE_HEADER || std::memcmp(data, ANNOUNCE_MAGIC, sizeof(ANNOUNCE_MAGIC)) != 0) return false;
+    if ((uint8_t)data[4] != ANNOUNCE_VERSION) return false;
+    out.bloom_k = (uint8_t)data[5];
+    out.port = (int)get_le(data + 6, 2);
+    out.peer_id = get_le(data + 8, 8);
+    out.digest = get_le(data + 16, 8);
+    out.file_count = (uint32_t)get_le(data + 24, 4);
+    size_t bloom_len = (size_t)get_le(data + 28, 2);
+    if (bloom_len > MAX_BLOOM_BYTES || ANNOUNCE_HEADER + bloom_len > len) return false;
+    out.bloom.assign((const uint8_t*)data + ANNOUNCE_HEADER, (const uint8_t*)data + ANNOUNCE_HEADER + bloom_len);
+    if (out.bloom.empty()) out.bloom_k = 0;
+    return out.port > 0;
+}
+
+std::string encode_query(const Query& q) {
+    std::string out(QUERY_MAGIC, sizeof(QUERY_MAGIC));
+    out.reserve(QUERY_HEADER + q.name.size());
+    put_le(out, QUERY_VERSION, 1);
+    put_le(out, 0, 1);
+    put_le(out, q.name.size(), 2);
+    put_le(out, q.peer_id, 8);
+    out += q.name;
+    return out;
+}
+
+bool decode_query(const char *data, size_t len, Query& out) {
+    if (len < QUERY_HEADER || std::memcmp(data, QUERY_MAGIC, sizeof(QUERY_MAGIC)) != 0) return false;
+    if ((uint8_t)data[4] != QUERY_VERSION) return false;
+    size_t name_len = (size_t)get_le(data + 6, 2);
+    if (name_len > MAX_QUERY_NAME || QUERY_HEADER + name_len != len) return false;
+    out.peer_id = get_le(data + 8, 8);
+    out.name.assign(data + QUERY_HEADER, name_len);
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Bloom filter: k bit positions from one XXH64 by double hashing
+// ---------------------------------------------------------------
+template <typename F>
+static void bloom_bits(const std::string &name, uint8_t k, uint64_t nbits, F &&f) {
+    uint64_t h = xxh64(name.data(), name.size());
+    uint64_t h1 = h & 0xffffffffu, h2 = (h >> 32) | 1;
+    for (uint8_t i = 0; i < k; ++i) f((h1 + i * h2) % nbits);
+}
+
+void bloom_build(const std::vector<std::string>& names, Announce& a) {
+    a.bloom.clear();
+    a.bloom_k = 0;
+    if (names.empty()) return;
+
+    size_t bytes = 64;
+    while (bytes < MAX_BLOOM_BYTES && bytes * 8 < names.size() * 10) bytes *= 2;
+    uint64_t nbits = bytes * 8;
+    // optimal k = m/n ln 2
+    int k = (int)std::lround((double)nbits / (double)names.size() * 0.693);
+    a.bloom_k = (uint8_t)std::clamp(k, 1, 8);
+    a.bloom.assign(bytes, 0);
+    for (auto &n : names) {
+        bloom_bits(n, a.bloom_k, nbits, [&](uint64_t b) { a.bloom[b / 8] |= (uint8_t)(1u << (b % 8)); });
+    }
+}
+
+bool bloom_may_contain(const Announce& a, const std::string& name) {
+    if (a.bloom.empty() || a.bloom_k == 0) return true;
+    bool hit = true;
+    bloom_bits(name, a.bloom_k, a.bloom.size() * 8, [&](uint64_t b) {
+        if (!(a.bloom[b / 8] & (1u << (b % 8)))) hit = false;
+    });
+    return hit;
+}
@@ -0,0 +1,1096 @@
+#include "downloader.hpp"
+#include "connection.hpp"
+#include "scheduler.hpp"
+#include "hash.hpp"
+#include "resume.hpp"
+#include "writer.hpp"
+#include "compress.hpp"
+#include "metrics.hpp"
+#include "delta.hpp"
+#include "bufpool.hpp"
+#include "catalog.hpp"
+
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <deque>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <filesystem>
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+
+// ---------------------------------------------------------------
+// Single range fetch
+// ---------------------------------------------------------------
+bool download_range(const std::string& host, int port, const std::string& filename,
+                    uint64_t start, uint64_t end, char *dst,
+                    std::atomic<uint64_t> *progress,
+                    const std::function<bool()> &abort) {
+    int sock = connect_to(host, port);
+    if (sock < 0) return false;
+
+    // send request: GET filename start end\n
+    {
+        std::string req = "GET " + filename + " ";
+        append_u64(req, start);
+        req += ' ';
+        append_u64(req, end);
+        req += '\n';
+        ssize_t s = send(sock, req.c_str(), (size_t)req.size(), MSG_NOSIGNAL);
+        if (s != (ssize_t)req.size()) { close(sock); return false; }
+    }
+
+    // header "OK <len>\n"; any body bytes that came with it stay in the
+    // reader, which each thread keeps rather than allocating per range
+    thread_local SocketReader in;
+    in.reset(sock);
+    std::string_view header;
+    LineFields f;
+    uint64_t expected = 0;
+    if (!in.read_line(header, abort, 1024) || !split_fields(header, f) || f.n < 2 || f.f[0] != "OK" ||
+        !parse_u64(f.f[1], expected)) {
+        close(sock);
+        return false;
+    }
+    // a peer with a different version of the file
+    if (expected != end - start) { close(sock); return false; }
+
+    bool ok = in.read_exact(dst, expected, progress, abort);
+    close(sock);
+    return ok;
+}
+
+
+// ---------------------------------------------------------------
+// Source discovery
+// ---------------------------------------------------------------
+std::vector<Source> find_sources(const PeerList& peers, const std::string& filename, uint64_t &size) {
+    std::map<uint64_t, int> votes;
+    for (auto &p : peers) {
+        auto it = p->files.find(filename);
+        if (it != p->files.end()) votes[it->second]++;
+        else if ((it = p->partial.find(filename)) != p->partial.end()) votes[it->second]++;
+    }
+    std::vector<Source> out;
+    if (votes.empty()) return out;
+
+    size = std::max_element(votes.begin(), votes.end(),
+                            [](auto &a, auto &b) { return a.second < b.second; })->first;
+    for (auto &p : peers) {
+        auto it = p->files.find(filename);
+        if (it != p->files.end() && it->second == size) out.push_back({p->addr, p->port});
+    }
+    for (auto &p : peers) {
+        if (p->files.count(filename)) continue;
+        auto it = p->partial.find(filename);
+        if (it != p->partial.end() && it->second == size) out.push_back({p->addr, p->port, {}, true});
+    }
+    return out;
+}
+
+
+// ---------------------------------------------------------------
+// Piece manifest
+// ---------------------------------------------------------------
+bool fetch_manifest(const std::vector<Source>& sources, const std::string& filename,
+                    uint64_t size, uint64_t piece_size, int wait_secs, Manifest& out, bool weak) {
+    // Ask a handful of sources and go with the majority, so one seeder with a
+    // damaged copy can't get every good piece rejected.
+    const size_t max_votes = 5;
+    std::map<uint64_t, std::pair<int, Manifest>> votes;   // digest of hashes -> count
+    std::vector<bool> asked(sources.size(), false);
+    size_t answers = 0;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(wait_secs);
+    uint32_t id = 1;
+    std::chrono::milliseconds pause(20);
+    while (true) {
+        bool busy = false;
+        for (size_t k = 0; k < sources.size() && answers < max_votes; ++k) {
+            if (asked[k]) continue;
+            PeerConnection conn(sources[k].host, sources[k].port);
+            if (!conn.open()) { asked[k] = true; continue; }   // unreachable or v1
+            Response r;
+            if (!conn.send_manifest(id, filename, piece_size, weak) || !conn.read_response(r) || r.id != id++) continue;
+            if (!r.ok) {
+                if (r.error == "busy") busy = true;
+                else asked[k] = true;
+                continue;
+            }
+            asked[k] = true;
+            if (r.length > (64u << 20)) continue;
+            std::string text(r.length, '\0');
+            if (!conn.read_body(&text[0], r.length)) continue;
+            Manifest m;
+            if (!parse_manifest(text, m) || m.file_size != size || m.piece_size != piece_size) continue;
+            uint64_t digest = xxh64(m.hashes.data(), m.hashes.size() * sizeof(uint64_t));
+            auto &v = votes[digest];
+            // among agreeing sources, keep a copy that has the weak sums
+            if (v.first++ == 0 || v.second.weak.size() < m.weak.size()) v.second = std::move(m);
+            answers++;
+        }
+        // wait for seeders that are still hashing, unless we already have an
+        // answer; small files are hashed in a few ms, so start with short naps
+        if (!busy || answers > 0 || std::chrono::steady_clock::now() >= deadline) break;
+        std::this_thread::sleep_for(pause);
+        pause = std::min(pause * 2, std::chrono::milliseconds(500));
+    }
+    if (votes.empty()) return false;
+
+    auto best = std::max_element(votes.begin(), votes.end(),
+                                 [](auto &a, auto &b) { return a.second.first < b.second.first; });
+    if (votes.size() > 1) std::cout << "Seeders disagree on piece hashes; using the majority\n";
+    out = std::move(best->second.second);
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Adaptive sizing
+// ---------------------------------------------------------------
+static constexpr uint64_t MIN_AUTO_PIECE = 256 << 10;
+static constexpr uint64_t MAX_AUTO_PIECE = 8 << 20;
+static constexpr int PIECES_PER_CONNECTION = 4;
+
+uint64_t choose_piece_size(uint64_t size, const std::vector<Source>& sources, int connections) {
+    double best = 0;
+    for (auto &s : sources) best = std::max(best, s.stats.bytes_per_sec);
+    double target = best > 0 ? best * 0.1 : (double)DEFAULT_PIECE_SIZE;
+
+    uint64_t piece = MIN_AUTO_PIECE;
+    while (piece < MAX_AUTO_PIECE && (double)(piece * 2) <= target) piece *= 2;
+    uint64_t min_pieces = (uint64_t)std::max(1, connections) * PIECES_PER_CONNECTION;
+    while (piece > MIN_AUTO_PIECE && size / piece < min_pieces) piece /= 2;
+    // so huge files still get a manifest
+    while (piece < MAX_PIECE_SIZE && !piece_count_ok(size, piece)) piece *= 2;
+    return piece;
+}
+
+
+// ---------------------------------------------------------------
+// Multi-source download
+// ---------------------------------------------------------------
+namespace {
+
+constexpr int DEFAULT_PIPELINE = 4;     // until a source's rate and RTT are known
+constexpr int MAX_PIPELINE = 64;
+constexpr double RAMP_GAIN = 1.1;       // keep adding connections while throughput grows this much
+// A partial source with nothing we still need is asked again (HAVE) this
+// often, and given up on for another source after STARVE_POLLS empty answers.
+constexpr int HAVE_POLL_MS = 250;
+constexpr int STARVE_POLLS = 8;
+// With every piece a source could serve already in flight, a worker waits
+// this long for one to complete or fail before asking again.
+constexpr int BUSY_WAIT_MS = 100;
+constexpr int SETUP_THREADS = 16;       // files of a batch whose manifests are fetched at once
+
+struct SourceState {
+    Source src;                         // partial: holds only part of at least one file
+    std::atomic<uint64_t> bytes{0};     // total bytes received from this source (wire)
+    std::atomic<uint64_t> file_bytes{0};    // what they decoded to
+    std::atomic<int> active{0};         // connections currently open to it
+    std::atomic<int> assigned{0};       // workers currently using it
+    std::atomic<int> failures{0};
+    std::atomic<bool> dropped{false};
+    std::atomic<bool> legacy{false};    // v1-only server: one request per connection
+    std::atomic<double> rate{0};        // bytes/s per connection, smoothed
+    std::atomic<double> rtt_ms{0};      // fastest handshake seen
+    std::shared_ptr<PeerCounters> counters;
+
+    uint64_t last_bytes = 0;            // monitor-thread bookkeeping
+};
+
+std::string source_name(const Source &s) {
+    return s.host + ":" + std::to_string(s.port);
+}
+
+// Enough requests in flight to cover one connection's bandwidth-delay
+// product, plus one being served and one queued behind it.
+int pipeline_depth(const SourceState &st, uint64_t piece_size) {
+    double rate = st.rate, rtt = st.rtt_ms;
+    if (rate <= 0 || rtt <= 0) return DEFAULT_PIPELINE;
+    double bdp = rate * rtt / 1000.0;
+    return std::clamp(2 + (int)std::ceil(bdp / (double)piece_size), 2, MAX_PIPELINE);
+}
+
+struct Sources {
+    std::vector<std::unique_ptr<SourceState>> list;
+    std::mutex mu;
+
+    // The source where one more connection is likely to add the most: the
+    // per-connection rate shared among the workers already on it. Sources not
+    // measured yet win so every one gets tried. `avoid` (the source that just
+    // failed) is only used if nothing else is left; sources `wants` turns
+    // down have nothing left to fetch. -1 if none is usable.
+    int pick(int avoid, const std::function<bool(int)> &wants) {
+        std::lock_guard<std::mutex> lock(mu);
+        int best = -1;
+        double best_score = 0;
+        for (int i = 0; i < (int)list.size(); ++i) {
+            SourceState &st = *list[i];
+            if (st.dropped || !wants(i)) continue;
+            double rate = st.rate;
+            double score = (rate > 0 ? rate : 1e18) / (st.assigned + 1);
+            if (i == avoid) score = 0;
+            if (best < 0 || score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best >= 0) list[best]->assigned++;
+        return best;
+    }
+};
+
+// How much of a file a source of the pool has.
+enum class Holding : uint8_t { None, Whole, Part };
+
+// One file of a download: where its pieces go and which sources have it.
+struct FileTask {
+    std::string filename;
+    uint64_t size = 0;
+    std::string tag;                    // "<filename>: " before per-file messages of a batch
+    std::vector<Source> sources;
+    std::vector<Holding> holds;         // per pool source
+
+    std::unique_ptr<PieceScheduler> owned;  // until handed to the batch
+    PieceScheduler *sched = nullptr;
+    Manifest manifest;
+    bool verify = false;
+    std::string base_path;              // old copy for a delta transfer
+    std::unique_ptr<ResumeState> resume;
+    std::unique_ptr<OutputFile> out;
+    std::shared_ptr<PartialFile> seeding;   // null: finished pieces aren't offered to peers
+    bool ready = false;                 // set up; false if it failed before any transfer
+
+    std::mutex have_mu;                 // partial sources: the pieces each one has
+    std::map<int, std::vector<bool>> have;
+};
+
+using FileTasks = std::vector<std::unique_ptr<FileTask>>;
+
+// Whether source `si` still has anything to offer.
+bool wanted(const FileTasks &files, BatchScheduler &batch, int si) {
+    for (size_t f = 0; f < files.size(); ++f) {
+        if (files[f]->ready && files[f]->holds[si] != Holding::None && !batch.settled(f)) return true;
+    }
+    return false;
+}
+
+// When the first reply header came back, in microseconds since `since`.
+struct FirstByte {
+    std::chrono::steady_clock::time_point since;
+    std::atomic<int64_t> us{-1};
+
+    void mark() {
+        if (us.load(std::memory_order_relaxed) >= 0) return;
+        int64_t v = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+        int64_t unset = -1;
+        us.compare_exchange_strong(unset, v);
+    }
+};
+
+// Starved: a partial source had nothing left that we need; not its fault.
+enum class RunResult { Finished, SourceFailed, Starved };
+
+// One download worker: pulls pieces of any file its current source has from
+// the batch scheduler and fetches them, pipelined over a persistent v2
+// connection when the source supports it, or one v1 connection per piece
+// otherwise.
+class Worker {
+public:
+    Worker(int index, FileTasks &files, BatchScheduler &batch, const DownloadOptions &opts,
+           std::atomic<uint64_t> &bad_pieces, std::atomic<uint64_t> &written, FirstByte &first_byte)
+        : index_(index), files_(files), batch_(batch), pipeline_(std::max(0, opts.pipeline)),
+          compress_(opts.compress), on_piece_(opts.on_piece), cancel_(opts.cancel), bad_pieces_(bad_pieces),
+          written_(written), first_byte_(first_byte) {}
+
+    void run(Sources &srcs);
+    uint64_t pieces() const { return pieces_; }
+
+private:
+    int index_;
+    FileTasks &files_;
+    BatchScheduler &batch_;
+    int pipeline_;                      // 0: sized per source by pipeline_depth()
+    bool compress_;
+    const std::function<void(double)> &on_piece_;
+    const std::atomic<bool> *cancel_;
+    std::atomic<uint64_t> &bad_pieces_;
+    std::atomic<uint64_t> &written_;    // file bytes on disk, for progress
+    FirstByte &first_byte_;
+    uint64_t pieces_ = 0;
+    std::vector<char> zbuf_;            // compressed bodies before decoding
+    int source_ = -1;                   // pool index of the current source
+    std::map<size_t, std::vector<bool>> have_;  // this worker's copy of its source's partial maps
+    uint64_t last_len_ = DEFAULT_PIECE_SIZE;    // size of the last piece asked for
+
+    bool usable(size_t f, const std::vector<bool> *&have);
+    bool has_partial();
+    // Stop reading from `st`: it was dropped or the download was cancelled.
+    bool stopping(const SourceState &st) const {
+        return st.dropped.load() || (cancel_ && cancel_->load(std::memory_order_relaxed));
+    }
+    bool verified(const BatchPiece &p, const PooledBuffer &buf, const SourceState &st);
+    void commit(const BatchPiece &p, const PooledBuffer &buf,
+                std::chrono::steady_clock::time_point requested);
+    bool receive(PeerConnection &conn, const Response &r, PooledBuffer &buf, uint64_t want,
+                 SourceState &st, const std::function<bool()> &abort);
+    bool refresh_have(PeerConnection &conn, SourceState &st, size_t f, uint32_t id);
+    bool refresh_partials(PeerConnection &conn, SourceState &st, uint32_t &next_id);
+    RunResult run_legacy(SourceState &st);
+    RunResult run_pipelined(SourceState &st, PeerConnection &conn);
+};
+
+bool Worker::usable(size_t f, const std::vector<bool> *&have) {
+    static const std::vector<bool> none;
+    const FileTask &t = *files_[f];
+    if (!t.ready) return false;
+    switch (t.holds[source_]) {
+    case Holding::None:
+        return false;
+    case Holding::Whole:
+        have = nullptr;
+        return true;
+    case Holding::Part: {
+        // a partial source only gets asked for pieces it has
+        auto it = have_.find(f);
+        have = it != have_.end() ? &it->second : &none;
+        return true;
+    }
+    }
+    return false;
+}
+
+// Whether the current source is still downloading a file we want.
+bool Worker::has_partial() {
+    for (size_t f = 0; f < files_.size(); ++f) {
+        if (files_[f]->ready && files_[f]->holds[source_] == Holding::Part && !batch_.settled(f)) return true;
+    }
+    return false;
+}
+
+bool Worker::verified(const BatchPiece &p, const PooledBuffer &buf, const SourceState &st) {
+    const FileTask &t = *files_[p.file];
+    if (!t.verify) return true;
+    if (xxh64(buf.data(), (size_t)(p.piece.end - p.piece.start)) == t.manifest.hashes[p.piece.index]) return true;
+    bad_pieces_++;
+    metrics().pieces_bad.add();
+    std::cout << t.tag << "Piece " << p.piece.index << " from " << source_name(st.src) << " failed verification\n";
+    return false;
+}
+
+// Pieces are buffered and only the copy that wins complete() touches the
+// file, so endgame duplicates never overlap writes. A failed write gives up
+// on that file alone.
+void Worker::commit(const BatchPiece &p, const PooledBuffer &buf,
+                    std::chrono::steady_clock::time_point requested) {
+    if (!batch_.complete(p)) return;
+    FileTask &t = *files_[p.file];
+    double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - requested).count();
+    metrics().pieces_received.add();
+    metrics().piece_seconds.observe(latency);
+    if (on_piece_) on_piece_(latency);
+    if (!t.out->write(p.piece.start, buf.data(), (size_t)(p.piece.end - p.piece.start))) {
+        std::cout << "Write to " << t.filename << " failed\n";
+        t.sched->abort();
+        return;
+    }
+    t.resume->mark((size_t)p.piece.index);
+    if (t.seeding) t.seeding->pieces.set((size_t)p.piece.index);
+    written_ += p.piece.end - p.piece.start;
+    pieces_++;
+}
+
+// Reads the body of `r` into `buf`; `want` is the piece length once decoded.
+bool Worker::receive(PeerConnection &conn, const Response &r, PooledBuffer &buf, uint64_t want,
+                     SourceState &st, const std::function<bool()> &abort) {
+    if (!r.compressed) {
+        if (r.length != want || !conn.read_body(buf.data(), want, &st.bytes, abort)) return false;
+    } else {
+        if (r.length > lz4_bound((size_t)want)) return false;
+        zbuf_.resize((size_t)r.length);
+        if (!conn.read_body(zbuf_.data(), r.length, &st.bytes, abort) ||
+            !lz4_decompress(zbuf_.data(), (size_t)r.length, buf.data(), (size_t)want)) return false;
+    }
+    metrics().bytes_received.add(r.length);
+    st.counters->received.add(r.length);
+    st.file_bytes += want;
+    return true;
+}
+
+// Asks a partial source which pieces of file `f` it has now; the
+// scheduler's availability counts follow the source's map as it grows.
+bool Worker::refresh_have(PeerConnection &conn, SourceState &st, size_t f, uint32_t id) {
+    FileTask &t = *files_[f];
+    PieceScheduler &sched = *t.sched;
+    Response r;
+    auto abort = [&]{ return stopping(st); };
+    if (!conn.send_have(id, t.filename, sched.piece_size()) || !conn.read_response(r, abort) ||
+        r.id != id || !r.ok || r.length > sched.piece_count() / 8 + 256) return false;
+    std::string text(r.length, '\0');
+    HaveMap h;
+    if (!conn.read_body(&text[0], r.length, nullptr, abort) || !parse_have(text, h) ||
+        h.piece_size != sched.piece_size() || h.pieces.size() != sched.piece_count()) return false;
+
+    std::lock_guard<std::mutex> lock(t.have_mu);
+    std::vector<bool> &known = t.have[source_];
+    // maps only grow; a concurrent refresh by another worker may be newer
+    for (size_t i = 0; i < known.size(); ++i) {
+        if (known[i]) h.pieces[i] = true;
+    }
+    if (h.pieces != known) {
+        sched.update_holder(known, h.pieces);
+        known = std::move(h.pieces);
+    }
+    have_[f] = known;
+    return true;
+}
+
+// refresh_have() for every unfinished file the source holds only part of.
+bool Worker::refresh_partials(PeerConnection &conn, SourceState &st, uint32_t &next_id) {
+    for (size_t f = 0; f < files_.size(); ++f) {
+        if (!files_[f]->ready || files_[f]->holds[source_] != Holding::Part || batch_.settled(f)) continue;
+        if (!refresh_have(conn, st, f, next_id++)) return false;
+    }
+    return true;
+}
+
+RunResult Worker::run_legacy(SourceState &st) {
+    PooledBuffer buf;
+    BatchPiece p;
+    auto usable = [this](size_t f, const std::vector<bool> *&have) { return this->usable(f, have); };
+    while (true) {
+        BatchScheduler::Pick pick = batch_.next(index_, p, usable);
+        if (pick == BatchScheduler::Pick::Empty) break;
+        if (pick == BatchScheduler::Pick::Busy) {
+            if (st.dropped) return RunResult::SourceFailed;
+            batch_.wait(BUSY_WAIT_MS);
+            continue;
+        }
+        FileTask &t = *files_[p.file];
+        uint64_t len = p.piece.end - p.piece.start;
+        if (buf.size() < len) {
+            buf.reset();
+            buf = buffer_pool().acquire(len, [&]{ return stopping(st); });
+            if (buf.empty()) {
+                batch_.fail(p, false);
+                return RunResult::SourceFailed;
+            }
+        }
+        auto requested = std::chrono::steady_clock::now();
+        st.active++;
+        bool ok = download_range(st.src.host, st.src.port, t.filename, p.piece.start, p.piece.end, buf.data(),
+                                 &st.bytes,
+                                 [&]{ return stopping(st) || t.sched->is_done(p.piece.index); });
+        st.active--;
+        if (ok) {
+            first_byte_.mark();     // v1 gives no earlier hook than the whole range
+            metrics().bytes_received.add(len);
+            st.counters->received.add(len);
+        }
+        if (ok && !verified(p, buf, st)) {
+            metrics().ranges_failed.add();
+            batch_.fail(p, true);
+            return RunResult::SourceFailed;
+        }
+        if (ok) {
+            st.failures = 0;
+            st.file_bytes += len;
+            commit(p, buf, requested);
+            continue;
+        }
+        // lost an endgame race or the source was dropped: not the piece's fault
+        bool lost_race = t.sched->is_done(p.piece.index);
+        if (!lost_race && !st.dropped) metrics().ranges_failed.add();
+        batch_.fail(p, !lost_race && !st.dropped);
+        if (!lost_race) return RunResult::SourceFailed;
+    }
+    return RunResult::Finished;
+}
+
+RunResult Worker::run_pipelined(SourceState &st, PeerConnection &conn) {
+    struct Slot {
+        BatchPiece piece;
+        uint32_t id;
+        PooledBuffer buf;
+        std::chrono::steady_clock::time_point requested;
+    };
+    std::deque<Slot> inflight;
+    uint32_t next_id = 1;
+    auto abort = [&]{ return stopping(st); };
+    auto usable = [this](size_t f, const std::vector<bool> *&have) { return this->usable(f, have); };
+
+    // hand everything outstanding back; only the head can be the piece's fault
+    auto release_all = [&](bool blame_head) {
+        bool head = true;
+        for (auto &s : inflight) {
+            bool blame = head && blame_head && !st.dropped && !files_[s.piece.file]->sched->is_done(s.piece.piece.index);
+            if (blame) metrics().ranges_failed.add();
+            batch_.fail(s.piece, blame);
+            head = false;
+        }
+        inflight.clear();
+        return RunResult::SourceFailed;
+    };
+
+    if (!refresh_partials(conn, st, next_id)) return RunResult::SourceFailed;
+    int idle_polls = 0;
+
+    st.active++;
+    RunResult result = RunResult::Finished;
+    while (true) {
+        // keep `depth` requests outstanding, from whichever files the
+        // batch hands out
+        int depth = pipeline_ > 0 ? pipeline_ : pipeline_depth(st, last_len_);
+        BatchScheduler::Pick pick = BatchScheduler::Pick::Got;
+        while ((int)inflight.size() < depth) {
+            BatchPiece p;
+            pick = batch_.next(index_, p, usable);
+            if (pick != BatchScheduler::Pick::Got) break;
+            // Over the memory budget, a worker with replies on the way reads
+            // those (freeing their buffers) rather than waiting; one with
+            // none waits for another worker to free one.
+            uint64_t len = p.piece.end - p.piece.start;
+            PooledBuffer buf = inflight.empty() ? buffer_pool().acquire(len, abort)
+                                                : buffer_pool().try_acquire(len);
+            if (buf.empty()) {
+                batch_.fail(p, false);
+                if (inflight.empty()) result = RunResult::SourceFailed;   // stopping
+                break;
+            }
+            if (!conn.send_get(next_id, files_[p.file]->filename, p.piece.start, p.piece.end, compress_)) {
+                batch_.fail(p, false);
+                result = release_all(false);
+                break;
+            }
+            last_len_ = len;
+            inflight.push_back({p, next_id++, std::move(buf), std::chrono::steady_clock::now()});
+        }
+        if (result != RunResult::Finished) break;
+        if (inflight.empty()) {
+            if (pick == BatchScheduler::Pick::Empty) break;
+            if (st.dropped) { result = RunResult::SourceFailed; break; }
+            if (!has_partial()) {
+                // all we could ask for is in flight elsewhere; wait for a
+                // piece to complete (endgame) or fail (retry)
+                batch_.wait(BUSY_WAIT_MS);
+                continue;
+            }
+            // nothing we need yet; see whether the source has finished more
+            if (++idle_polls > STARVE_POLLS) { result = RunResult::Starved; break; }
+            std::this_thread::sleep_for(std::chrono::milliseconds(HAVE_POLL_MS));
+            if (st.dropped || !refresh_partials(conn, st, next_id)) { result = RunResult::SourceFailed; break; }
+            continue;
+        }
+        idle_polls = 0;
+
+        Slot &s = inflight.front();
+        uint64_t want = s.piece.piece.end - s.piece.piece.start;
+        Response r;
+        bool header = conn.read_response(r, abort) && r.id == s.id && r.ok;
+        if (header) first_byte_.mark();
+        if (!header || !receive(conn, r, s.buf, want, st, abort) || !verified(s.piece, s.buf, st)) {
+            result = release_all(true);
+            break;
+        }
+        st.failures = 0;
+        commit(s.piece, s.buf, s.requested);
+        inflight.pop_front();
+    }
+    st.active--;
+    return result;
+}
+
+void Worker::run(Sources &srcs) {
+    // A worker sticks with the source it was given until it fails, is
+    // dropped or has nothing left to offer, then asks for the best of the
+    // others that still do.
+    int avoid = -1;
+    auto wants = [this](int si) { return wanted(files_, batch_, si); };
+    while (!batch_.finished()) {
+        int si = srcs.pick(avoid, wants);
+        if (si < 0) {
+            if (batch_.finished()) return;
+            std::cout << "No usable peers left\n";
+            batch_.abort();
+            return;
+        }
+        SourceState &st = *srcs.list[si];
+        source_ = si;
+        have_.clear();
+
+        RunResult r = RunResult::SourceFailed;
+        bool retry_v1 = false;
+        if (st.legacy) {
+            r = run_legacy(st);
+        } else {
+            PeerConnection conn(st.src.host, st.src.port);
+            if (conn.open()) {
+                double rtt = st.rtt_ms;
+                if (rtt <= 0 || conn.rtt_ms() < rtt) st.rtt_ms = conn.rtt_ms();
+                r = run_pipelined(st, conn);
+            } else if (conn.legacy()) {
+                st.legacy = true;
+                retry_v1 = true;
+            }
+        }
+        st.assigned--;
+        if (cancel_ && cancel_->load()) batch_.abort();    // reads were cut short; not the source's fault
+        if (batch_.finished()) return;
+        if (retry_v1 || r == RunResult::Finished) { avoid = -1; continue; }
+        if (r == RunResult::Starved) { avoid = si; continue; }
+
+        if (!st.dropped && ++st.failures >= 3 && !st.dropped.exchange(true)) {
+            std::cout << "Dropping peer " << source_name(st.src) << ": repeated failures\n";
+        }
+        avoid = si;
+    }
+}
+
+// Copies the pieces that the old copy at `base_path` already has into `out`
+// and marks them done. Returns how many there were.
+size_t reuse_base(const std::string &base_path, const Manifest &m, PieceScheduler &sched,
+                  OutputFile &out, ResumeState &resume) {
+    int fd = open(base_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || st.st_size == 0) { close(fd); return 0; }
+    size_t len = (size_t)st.st_size;
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    const char *base = (const char*)map;
+
+    std::vector<bool> skip(sched.piece_count());
+    for (size_t i = 0; i < skip.size(); ++i) skip[i] = sched.is_done((int)i);
+    size_t reused = 0;
+    for (auto &match : find_reusable((const unsigned char*)base, len, m, skip)) {
+        uint64_t start = (uint64_t)match.index * m.piece_size;
+        size_t n = (size_t)std::min<uint64_t>(m.piece_size, m.file_size - start);
+        if (!out.write(start, base + match.base_offset, n)) break;
+        sched.mark_done((int)match.index);
+        resume.mark(match.index);
+        metrics().bytes_reused.add(n);
+        reused++;
+    }
+    munmap(map, len);
+    return reused;
+}
+
+// Everything before the first transfer of one file: piece size, manifest,
+// resume state, delta base, the output file and its seeding entry. Messages
+// go to `log`. The file's scheduler exists even if this fails (aborted), so
+// the batch keeps one scheduler per file.
+void prepare(FileTask &t, const DownloadOptions &opts, int threads, int max_threads, std::ostream &log) {
+    // a resumed download keeps the piece size its sidecar was written with;
+    // one outside what seeders accept is chosen anew
+    uint64_t piece_size = opts.piece_size;
+    if (!valid_piece_size(piece_size)) piece_size = ResumeState::stored_piece_size(t.filename, t.size);
+    if (!valid_piece_size(piece_size)) piece_size = choose_piece_size(t.size, t.sources, max_threads);
+
+    t.owned = std::make_unique<PieceScheduler>(t.size, piece_size, threads, opts.max_attempts);
+    PieceScheduler &sched = *t.owned;
+    // the name becomes a path here; never one outside the current directory
+    if (!safe_file_name(t.filename)) {
+        log << "Refusing to write " << t.filename << ": not a relative path\n";
+        sched.abort();
+        return;
+    }
+    if (t.sources.empty()) {
+        log << "No peer has " << t.filename << "\n";
+        sched.abort();
+        return;
+    }
+
+    // In a swarm pieces are picked rarest-first; partial sources join the
+    // availability counts with their first HAVE answer.
+    bool swarm = opts.seed != nullptr;
+    for (auto &s : t.sources) swarm = swarm || s.partial;
+    if (swarm) {
+        sched.set_rarest_first();
+        for (auto &s : t.sources) {
+            if (!s.partial) sched.add_holder(nullptr);
+        }
+    }
+
+    // An older local copy, or the base an interrupted delta run left behind,
+    // can supply every piece that hasn't changed; that takes the weak sums.
+    std::error_code ec;
+    t.base_path = t.filename + ".p2pbase";
+    bool have_local = opts.delta && (fs::is_regular_file(t.filename, ec) || fs::is_regular_file(t.base_path, ec));
+
+    t.verify = opts.verify && t.size > 0 &&
+               fetch_manifest(t.sources, t.filename, t.size, sched.piece_size(), opts.manifest_wait, t.manifest,
+                              have_local);
+    if (opts.verify && t.size > 0) {
+        log << t.tag << (t.verify ? "Verifying pieces against the seeder's manifest\n"
+                                  : "No piece manifest available, downloading unverified\n");
+    }
+
+    // Pick up where an interrupted run left off if the sidecar matches;
+    // otherwise start over with a fresh, pre-allocated file.
+    t.resume = std::make_unique<ResumeState>(t.filename, t.size, sched.piece_size());
+    ResumeState &resume = *t.resume;
+    bool resumed = resume.load() && fs::exists(t.filename, ec) && fs::file_size(t.filename, ec) == t.size;
+    bool delta = have_local && t.verify && t.manifest.weak.size() == t.manifest.hashes.size();
+    if (delta && !resumed && !fs::exists(t.base_path, ec)) {
+        // the old version moves aside and the new one is built next to it
+        fs::rename(t.filename, t.base_path, ec);
+        if (ec) delta = false;
+    }
+    // files shared recursively are named dir/name
+    fs::path parent = fs::path(t.filename).parent_path();
+    if (!parent.empty()) fs::create_directories(parent, ec);
+    t.out = std::make_unique<OutputFile>(t.filename, t.size, opts.write_mode);
+    OutputFile &out = *t.out;
+    if (!out.open(!resumed)) {
+        sched.abort();
+        return;
+    }
+    if (resumed) {
+        PooledBuffer buf;
+        if (t.verify) {
+            buf = buffer_pool().acquire(sched.piece_size());
+            // nothing to check them with: fetch them again rather than trust them
+            if (buf.empty()) log << t.tag << "No buffer to re-verify resumed pieces; downloading them again\n";
+        }
+        size_t dropped = 0;
+        for (size_t i = 0; i < resume.piece_count(); ++i) {
+            if (!resume.has(i)) continue;
+            if (t.verify) {
+                // re-check what's on disk; the seeder's file may have changed
+                uint64_t start = (uint64_t)i * sched.piece_size();
+                size_t len = (size_t)std::min<uint64_t>(sched.piece_size(), t.size - start);
+                if (buf.empty() || !out.read(start, buf.data(), len) ||
+                    xxh64(buf.data(), len) != t.manifest.hashes[i]) {
+                    resume.unmark(i);
+                    dropped++;
+                    continue;
+                }
+            }
+            sched.mark_done((int)i);
+        }
+        log << t.tag << "Resuming: " << resume.done_count() << "/" << resume.piece_count()
+            << " pieces already on disk";
+        if (dropped) log << " (" << dropped << " failed re-verification)";
+        log << "\n";
+    }
+    if (delta && fs::exists(t.base_path, ec)) {
+        size_t reused = reuse_base(t.base_path, t.manifest, sched, out, resume);
+        uint64_t have = 0;
+        for (size_t i = 0; i < sched.piece_count(); ++i) {
+            uint64_t start = (uint64_t)i * sched.piece_size();
+            if (sched.is_done((int)i)) have += std::min<uint64_t>(sched.piece_size(), t.size - start);
+        }
+        log << t.tag << "Delta: " << reused << "/" << sched.piece_count() << " pieces taken from the local copy, "
+            << (t.size - have) / 1024 << " KiB left to fetch\n";
+    }
+    resume.flush();
+
+    // offer what is already on disk, and every piece as it lands
+    if (opts.seed) {
+        t.seeding = std::make_shared<PartialFile>(t.filename,
+                                                  t.verify ? std::make_shared<const Manifest>(t.manifest) : nullptr,
+                                                  t.size, sched.piece_size());
+        for (size_t i = 0; i < sched.piece_count(); ++i) {
+            if (sched.is_done((int)i)) t.seeding->pieces.set(i);
+        }
+        opts.seed->add(t.filename, t.seeding);
+    }
+    t.ready = true;
+}
+
+} // namespace
+
+bool download_file(const std::string& filename, uint64_t size,
+                   const std::vector<Source>& sources, const DownloadOptions& opts,
+                   std::vector<PeerStats> *measured) {
+    if (sources.empty()) return false;
+    DownloadReport report;
+    bool ok = download_files({FileRequest{filename, size, sources}}, opts, &report);
+    if (measured) {
+        measured->clear();
+        for (auto &s : report.sources) measured->push_back(s.stats);
+    }
+    return ok;
+}
+
+bool download_files(const std::vector<FileRequest>& files, const DownloadOptions& opts,
+                    DownloadReport *report) {
+    DownloadReport local;
+    if (!report) report = &local;
+    *report = DownloadReport{};
+    report->completed.assign(files.size(), false);
+    if (files.empty()) return true;
+    FirstByte first_byte;
+    first_byte.since = opts.started != std::chrono::steady_clock::time_point{} ? opts.started
+                                                                              : std::chrono::steady_clock::now();
+
+    // One pool entry per distinct peer, however many of the files it has.
+    Sources srcs;
+    std::map<std::string, int> pool;
+    FileTasks tasks;
+    for (auto &req : files) {
+        tasks.push_back(std::make_unique<FileTask>());
+        FileTask &t = *tasks.back();
+        t.filename = req.filename;
+        t.size = req.size;
+        t.sources = req.sources;
+        if (files.size() > 1) t.tag = req.filename + ": ";
+        for (auto &s : req.sources) {
+            auto ins = pool.emplace(source_name(s), (int)srcs.list.size());
+            if (ins.second) {
+                srcs.list.push_back(std::make_unique<SourceState>());
+                SourceState &st = *srcs.list.back();
+                st.src = s;
+                st.src.partial = false;
+                st.rate = s.stats.bytes_per_sec;
+                st.rtt_ms = s.stats.rtt_ms;
+                st.counters = metrics().peer(source_name(s));
+            }
+            if (s.partial) srcs.list[ins.first->second]->src.partial = true;
+        }
+    }
+    for (auto &t : tasks) {
+        t->holds.assign(srcs.list.size(), Holding::None);
+        for (auto &s : t->sources) t->holds[pool[source_name(s)]] = s.partial ? Holding::Part : Holding::Whole;
+    }
+
+    // Adaptive: one connection per source to start with; the monitor below
+    // adds more while they still raise the aggregate rate.
+    bool adaptive = opts.threads <= 0;
+    int max_threads = adaptive ? std::max(1, opts.max_connections) : opts.threads;
+    int threads = adaptive ? std::min((int)srcs.list.size(), max_threads) : opts.threads;
+    threads = std::max(1, threads);
+
+    // Set the files up; a batch fetches several manifests at once, and each
+    // file's messages come out in one piece.
+    if (tasks.size() == 1) {
+        prepare(*tasks[0], opts, threads, max_threads, std::cout);
+    } else {
+        std::atomic<size_t> next_task{0};
+        std::mutex log_mu;
+        std::vector<std::thread> setup;
+        for (int k = 0; k < std::min<int>(SETUP_THREADS, (int)tasks.size()); ++k) {
+            setup.emplace_back([&]() {
+                for (size_t i; (i = next_task++) < tasks.size();) {
+                    std::ostringstream log;
+                    prepare(*tasks[i], opts, threads, max_threads, log);
+                    std::lock_guard<std::mutex> lock(log_mu);
+                    std::cout << log.str();
+                }
+            });
+        }
+        for (auto &th : setup) th.join();
+    }
+
+    BatchScheduler batch;
+    size_t total_pieces = 0;
+    for (auto &t : tasks) {
+        total_pieces += t->owned->piece_count();
+        t->sched = &batch.file(batch.add(std::move(t->owned)));
+    }
+    max_threads = (int)std::min<size_t>((size_t)max_threads, std::max<size_t>(1, total_pieces));
+    std::atomic<uint64_t> bad_pieces{0};
+
+    // progress counts what resume and delta already put on disk
+    uint64_t total_bytes = 0, on_disk = 0;
+    for (auto &t : tasks) {
+        total_bytes += t->size;
+        for (size_t i = 0; i < t->sched->piece_count(); ++i) {
+            uint64_t start = (uint64_t)i * t->sched->piece_size();
+            if (t->sched->is_done((int)i)) on_disk += std::min<uint64_t>(t->sched->piece_size(), t->size - start);
+        }
+    }
+    std::atomic<uint64_t> written{on_disk};
+    auto cancelled = [&]{ return opts.cancel && opts.cancel->load(); };
+
+    std::atomic<int> running{0};
+    std::mutex exit_mu;                 // wakes the monitor when the last worker exits
+    std::condition_variable exited;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> ths;
+    workers.reserve(max_threads);
+    ths.reserve(max_threads);
+    auto spawn = [&]() {
+        int i = (int)workers.size();
+        workers.push_back(std::make_unique<Worker>(i, tasks, batch, opts, bad_pieces, written, first_byte));
+        Worker *w = workers.back().get();
+        running++;
+        ths.emplace_back([&,i,w](){
+            w->run(srcs);
+            std::cout << "Thread " << i << " finished (" << w->pieces() << " pieces)\n";
+            std::lock_guard<std::mutex> lock(exit_mu);
+            running--;
+            exited.notify_one();
+        });
+    };
+    if (!batch.finished() && !cancelled()) {
+        for (int i = 0; i < std::min(threads, max_threads); ++i) spawn();
+    }
+
+    // Watch per-source throughput: smooth it into each source's rate, add
+    // connections while that still helps, and drop sources that lag far
+    // behind the fastest one; their workers move over to the remaining sources.
+    auto begin = std::chrono::steady_clock::now();
+    auto last = begin;
+    bool ramping = adaptive;
+    double ramp_rate = 0;               // aggregate rate when connections were last added
+    int ramp_ticks = 0;
+    while (running > 0) {
+        {
+            std::unique_lock<std::mutex> lock(exit_mu);
+            if (exited.wait_for(lock, std::chrono::milliseconds(250), [&] { return running == 0; })) break;
+        }
+        if (opts.on_progress) opts.on_progress(written, total_bytes);
+        if (cancelled() && !report->cancelled) {
+            // the workers notice at their next read and find nothing left to fetch
+            report->cancelled = true;
+            batch.abort();
+        }
+        auto now = std::chrono::steady_clock::now();
+        double dt = std::chrono::duration<double>(now - last).count();
+        if (dt < 1.0) continue;
+        last = now;
+
+        std::vector<double> rate(srcs.list.size(), -1.0);   // bytes/s per connection
+        double best = 0, total = 0;
+        int alive = 0;
+        for (size_t k = 0; k < srcs.list.size(); ++k) {
+            SourceState &st = *srcs.list[k];
+            uint64_t b = st.bytes;
+            int act = st.active;
+            if (!st.dropped) alive++;
+            total += (double)(b - st.last_bytes) / dt;
+            if (act > 0 && !st.dropped) {
+                rate[k] = (double)(b - st.last_bytes) / dt / act;
+                best = std::max(best, rate[k]);
+                double avg = st.rate;
+                st.rate = avg > 0 ? 0.7 * avg + 0.3 * rate[k] : rate[k];
+            }
+            st.last_bytes = b;
+        }
+
+        // give each step two ticks to show up in the rate; stop at the plateau
+        if (ramping && ++ramp_ticks >= 2 && !batch.finished()) {
+            ramp_ticks = 0;
+            if (total > ramp_rate * RAMP_GAIN && (int)workers.size() < max_threads) {
+                ramp_rate = total;
+                int add = std::max(1, (int)workers.size() / 2);
+                for (int k = 0; k < add && (int)workers.size() < max_threads; ++k) spawn();
+            } else {
+                ramping = false;
+            }
+        }
+
+        if (std::chrono::duration<double>(now - begin).count() < opts.slow_grace) continue;
+        for (size_t k = 0; k < srcs.list.size() && alive > 1; ++k) {
+            if (rate[k] < 0 || rate[k] >= opts.slow_ratio * best) continue;
+            // a partial source is held back by what it has, not by its link
+            if (srcs.list[k]->src.partial) continue;
+            srcs.list[k]->dropped = true;
+            alive--;
+            std::cout << "Dropping peer " << source_name(srcs.list[k]->src) << ": too slow ("
+                      << (uint64_t)rate[k] / 1024 << " KiB/s vs " << (uint64_t)best / 1024 << " KiB/s)\n";
+        }
+    }
+    for (auto &t: ths) if (t.joinable()) t.join();
+    if (opts.on_progress) opts.on_progress(written, total_bytes);
+    report->cancelled = report->cancelled || cancelled();
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t fetched = 0, decoded = 0;
+    for (auto &st : srcs.list) {
+        fetched += st->bytes;
+        decoded += st->file_bytes;
+        std::cout << "  " << source_name(st->src) << (st->src.partial ? " (partial)" : "") << ": "
+                  << st->bytes << " bytes";
+        if (st->rate > 0) std::cout << ", " << (uint64_t)st->rate / 1024 << " KiB/s per connection";
+        if (st->rtt_ms > 0) std::cout << ", rtt " << st->rtt_ms << " ms";
+        std::cout << (st->dropped ? " (dropped)" : "") << "\n";
+        report->sources.push_back(st->src);
+        report->sources.back().stats = {st->rate, st->rtt_ms};
+    }
+    report->wire_bytes = fetched;
+    report->file_bytes = decoded;
+    report->seconds = secs;
+    if (first_byte.us >= 0) report->first_byte_ms = (double)first_byte.us / 1000.0;
+    std::cout << "Throughput: " << (uint64_t)((double)fetched / std::max(secs, 1e-6) / 1024) << " KiB/s"
+              << " over " << workers.size() << " connection(s)" << (adaptive ? " (adaptive)" : "") << "\n";
+    if (first_byte.us >= 0) {
+        std::cout << "Time to first byte: " << (double)first_byte.us / 1000.0 << " ms\n";
+    }
+    if (opts.compress) {
+        std::cout << "Wire bytes: " << fetched << " for " << decoded << " file bytes";
+        if (fetched > 0) std::cout << " (" << (double)decoded / (double)fetched << "x)";
+        std::cout << "\n";
+    }
+
+    bool verify = false;
+    size_t done_files = 0;
+    uint64_t endgame = 0;
+    for (size_t f = 0; f < tasks.size(); ++f) {
+        verify = verify || tasks[f]->verify;
+        endgame += tasks[f]->sched->endgame_requests();
+        if (tasks[f]->sched->finished()) done_files++;
+    }
+    if (tasks.size() == 1) {
+        PieceScheduler &sched = *tasks[0]->sched;
+        std::cout << "Pieces: " << sched.piece_count() << " x " << sched.piece_size() << " bytes, ";
+        if (sched.rarest_first()) std::cout << "rarest first, ";
+        else std::cout << sched.steals() << " stolen, ";
+    } else {
+        std::cout << "Files: " << done_files << "/" << tasks.size() << " complete, " << total_pieces << " pieces, ";
+    }
+    std::cout << endgame << " endgame duplicates";
+    if (verify) std::cout << ", " << bad_pieces << " failed verification";
+    std::cout << "\n";
+    auto bufs = buffer_pool().stats();
+    std::cout << "Memory: peak RSS " << peak_rss_bytes() / (1024 * 1024) << " MiB, piece buffers peak "
+              << bufs.peak_in_use / (1024 * 1024) << " MiB";
+    if (bufs.budget) {
+        std::cout << " of " << bufs.budget / (1024 * 1024) << " MiB budget, " << bufs.waits << " waits";
+    }
+    std::cout << "\n";
+    for (auto &t : tasks) {
+        if (!t->out) continue;
+        std::cout << "Write path: " << write_mode_name(t->out->mode());
+        if (t->out->mode() == WriteMode::Uring) std::cout << " (" << t->out->batches() << " batches)";
+        std::cout << "\n";
+        break;
+    }
+
+    std::error_code ec;
+    for (size_t f = 0; f < tasks.size(); ++f) {
+        FileTask &t = *tasks[f];
+        // stop offering the file before its mapping and descriptor go away
+        if (t.seeding) opts.seed->remove(t.filename);
+        // pieces must be on disk before the sidecar that records them goes away
+        if (t.out) t.out->close();
+        if (!t.ready) continue;
+        if (t.sched->finished()) {
+            t.resume->remove();
+            fs::remove(t.base_path, ec);
+            report->completed[f] = true;
+            continue;
+        }
+        t.resume->flush();
+        std::cout << t.tag << "Progress saved to " << t.resume->path() << "; run get again to resume\n";
+    }
+    return done_files == tasks.size();
+}
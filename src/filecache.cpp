@@ -0,0 +1,184 @@
+#include "filecache.hpp"
+
+#include <vector>
+#include <cerrno>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Ranges asked for once are remembered up to this many; past that the list
+// starts over, so a scan of many distinct pieces can't grow it without bound.
+static constexpr size_t MAX_SEEN = 64 * 1024;
+
+OpenFile::~OpenFile() {
+    if (fd >= 0) close(fd);
+}
+
+
+// ---------------------------------------------------------------
+// Descriptor cache
+// ---------------------------------------------------------------
+FileCache::FileCache(size_t capacity) : capacity_(capacity) {}
+
+std::shared_ptr<const OpenFile> FileCache::open(const Catalog &catalog, std::string_view name, CatalogEntry &e) {
+    uint64_t version = catalog.version();
+    if (version != catalog_version_.load(std::memory_order_relaxed)) prune(catalog, version);
+    std::string key(name);
+    if (!catalog.lookup(name, e)) {
+        forget(key);
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            const OpenFile &f = *it->second->file;
+            if (f.size == e.size && f.mtime_ns == e.mtime_ns) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                hits_++;
+                return it->second->file;
+            }
+            // changed since it was opened; the old descriptor goes once its
+            // readers are done
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+    }
+    misses_++;
+
+    int fd = ::open(catalog.path_of(name).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    auto file = std::make_shared<OpenFile>(fd);
+    struct stat st{};
+    if (fstat(fd, &st) == 0) {
+        file->size = (uint64_t)st.st_size;
+        file->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    // a file that doesn't match its catalog entry yet (still being written,
+    // or inotify is behind) is served but not kept
+    if (capacity_ == 0 || file->size != e.size || file->mtime_ns != e.mtime_ns) return file;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    if (index_.count(key)) return file;    // another reactor got there first
+    while (lru_.size() >= capacity_) {
+        index_.erase(lru_.back().name);
+        lru_.pop_back();
+        evictions_++;
+    }
+    lru_.push_front({std::move(key), file});
+    index_[lru_.front().name] = lru_.begin();
+    return file;
+}
+
+void FileCache::forget(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(name);
+    if (it == index_.end()) return;
+    lru_.erase(it->second);
+    index_.erase(it);
+}
+
+// Drops the entries of files the catalog no longer lists as they were opened
+// (deleted or changed), once per catalog version.
+void FileCache::prune(const Catalog &catalog, uint64_t version) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (catalog_version_.load(std::memory_order_relaxed) == version) return;
+    catalog_version_.store(version, std::memory_order_relaxed);
+    for (auto it = lru_.begin(); it != lru_.end();) {
+        CatalogEntry e;
+        const OpenFile &f = *it->file;
+        if (catalog.lookup(it->name, e) && e.size == f.size && e.mtime_ns == f.mtime_ns) {
+            ++it;
+            continue;
+        }
+        index_.erase(it->name);
+        it = lru_.erase(it);
+    }
+}
+
+FileCache::Stats FileCache::stats() const {
+    Stats s;
+    s.hits = hits_;
+    s.misses = misses_;
+    s.evictions = evictions_;
+    std::lock_guard<std::mutex> lock(mu_);
+    s.open = lru_.size();
+    return s;
+}
+
+
+// ---------------------------------------------------------------
+// Hot ranges
+// ---------------------------------------------------------------
+HotPieces::HotPieces(size_t capacity) : capacity_(capacity) {}
+
+std::shared_ptr<const std::string> HotPieces::get(std::string_view name, int64_t mtime_ns, int fd,
+                                                  uint64_t start, uint64_t end) {
+    if (end <= start || end - start > MAX_HOT_RANGE || end - start > capacity_) {
+        misses_++;
+        return nullptr;
+    }
+    size_t len = (size_t)(end - start);
+
+    std::string key(name);
+    key += '\0';
+    key += std::to_string(mtime_ns) + ":" + std::to_string(start) + ":" + std::to_string(end);
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            hits_++;
+            return it->second->data;
+        }
+        // first request: only remember it
+        if (!seen_.count(key)) {
+            if (seen_.size() >= MAX_SEEN) seen_.clear();
+            seen_.insert(std::move(key));
+            misses_++;
+            return nullptr;
+        }
+    }
+    misses_++;
+
+    // read outside the lock; other reactors keep serving meanwhile. Only
+    // from the page cache: a range that isn't there yet stays "seen" and is
+    // sent from the file, which brings it in for the next request.
+    auto data = std::make_shared<std::string>(len, '\0');
+    size_t got = 0;
+    while (got < len) {
+        iovec iov{&(*data)[got], len - got};
+        ssize_t r = preadv2(fd, &iov, 1, (off_t)(start + got), RWF_NOWAIT);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return nullptr;     // EAGAIN: not cached; or no RWF_NOWAIT
+        got += (size_t)r;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    seen_.erase(key);
+    if (index_.count(key)) return data;    // another reactor got there first
+    size_t cost = key.size() + len;
+    while (used_ + cost > capacity_ && !lru_.empty()) {
+        Entry &old = lru_.back();
+        used_ -= old.key.size() + old.data->size();
+        index_.erase(old.key);
+        lru_.pop_back();
+    }
+    lru_.push_front({std::move(key), data});
+    index_[lru_.front().key] = lru_.begin();
+    used_ += cost;
+    admitted_++;
+    return data;
+}
+
+HotPieces::Stats HotPieces::stats() const {
+    Stats s;
+    s.hits = hits_;
+    s.misses = misses_;
+    s.admitted = admitted_;
+    std::lock_guard<std::mutex> lock(mu_);
+    s.bytes = used_;
+    return s;
+}
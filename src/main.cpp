@@ -2,211 +2,290 @@
 #include <string>
 #include <vector>
 #include <thread>
-#include <fstream>
-#include <sstream>
-#include <map>
 #include <algorithm>
 #include <chrono>
-#include <cstring>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <netinet/in.h>
+#include <cstdlib>
 
-#include "network.hpp"
-#include "peer.hpp"
+#include "p2p.hpp"
+#include "metrics.hpp"
+#include "bufpool.hpp"
 #include "utils.hpp"
 
-static Network *net = nullptr;
-static std::string shared_folder = ".";
+// The command line is a client of libp2p (p2p.hpp): share runs a P2PSeeder,
+// list and get a P2PClient.
 
 void print_help() {
     std::cout << "Usage:\n";
-    std::cout << "  p2p share <folder>             # start sharing folder (runs services)\n";
-    std::cout << "  p2p list                       # list discovered peers and files\n";
-    std::cout << "  p2p get <filename> [threads]   # download file using parallel threads\n";
-}
-
-std::vector<std::pair<std::string,uint64_t>> gather_available_files() {
-    std::vector<std::pair<std::string,uint64_t>> out;
-    if (!net) return out;
-    auto peers = net->get_peers_snapshot();
-    for (auto &p : peers) {
-        for (auto &kv : p.files) {
-            out.emplace_back(p.addr + ":" + std::to_string(p.port) + "|" + kv.first, kv.second);
-        }
-    }
-    return out;
-}
-
-bool download_range(const std::string& host, int port, const std::string& filename, uint64_t start, uint64_t end, std::fstream &ofs) {
-    // create socket and connect
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return false;
-
-    sockaddr_in srv{};
-    srv.sin_family = AF_INET;
-    srv.sin_port = htons(port);
-    if (inet_pton(AF_INET, host.c_str(), &srv.sin_addr) <= 0) { close(sock); return false; }
-
-    if (connect(sock, (sockaddr*)&srv, sizeof(srv)) < 0) { close(sock); return false; }
-
-    // send request: GET filename start end\n
-    {
-        std::stringstream ss;
-        ss << "GET " << filename << " " << start << " " << end << "\n";
-        std::string req = ss.str();
-        ssize_t s = send(sock, req.c_str(), (size_t)req.size(), 0);
-        if (s != (ssize_t)req.size()) { close(sock); return false; }
-    }
-
-    // Read header line "OK <len>\n" robustly (header is ASCII terminated by '\n')
-    std::string header;
-    char ch;
-    while (true) {
-        ssize_t r = recv(sock, &ch, 1, 0);
-        if (r <= 0) { close(sock); return false; }
-        header.push_back(ch);
-        if (ch == '\n') break;
-        // safety: avoid overly long header
-        if (header.size() > 1024) { close(sock); return false; }
-    }
-
-    if (header.rfind("OK ", 0) != 0) {
-        close(sock);
-        return false;
-    }
-    auto hparts = split(header, ' ');
-    if (hparts.size() < 2) { close(sock); return false; }
-    uint64_t expected = 0;
-    try {
-        expected = std::stoull(hparts[1]);
-    } catch(...) { close(sock); return false; }
-
-    // Now stream expected bytes from the socket into the file at offset `start`.
-    const size_t bufsize = 64 * 1024;
-    std::vector<char> buffer(bufsize);
-    uint64_t received = 0;
-
-    // If there is any extra data already in the socket's receive buffer after the '\n'
-    // we already consumed exactly up to '\n' and no extra data is in 'header' (we read byte-by-byte).
-    // So continue receiving the rest.
-    while (received < expected) {
-        ssize_t r = recv(sock, buffer.data(), (size_t)std::min<uint64_t>(bufsize, expected - received), 0);
-        if (r <= 0) break;
-        ofs.seekp((std::streampos)(start + received));
-        ofs.write(buffer.data(), r);
-        if (!ofs) break;
-        received += (uint64_t)r;
-    }
-
-    close(sock);
-    return received == expected;
+    std::cout << "  p2p share <folder> [options]   # start sharing folder (runs services)\n";
+    std::cout << "  p2p list [--discover <ms>]     # list discovered peers and files\n";
+    std::cout << "  p2p get <name>... [threads] [options] # download files from every peer that has them\n";
+    std::cout << "                                 # names may be globs or shared dirs; all share one connection pool\n";
+    std::cout << "                                 # (no threads: connections are added while throughput grows)\n";
+    std::cout << "  p2p stats <host[:port]> [--watch <secs>] # a seeder's metrics (Prometheus text), or rates every <secs>\n";
+    std::cout << "\nShare options:\n";
+    std::cout << "  --port <n>                     # TCP service port (default 12000)\n";
+    std::cout << "  --reactors <n>                 # event loop threads (default: one per core)\n";
+    std::cout << "  --max-conns <n>                # concurrent connection cap (default 4096)\n";
+    std::cout << "  --backlog <n>                  # listen backlog per reactor (default 1024)\n";
+    std::cout << "  --send-mode <mode>             # sendfile | splice | buffered (default sendfile)\n";
+    std::cout << "  --report <secs>                # per-reactor throughput report interval, 0 = off (default 10)\n";
+    std::cout << "  --recursive on|off             # also share files in subdirectories as dir/name (default off)\n";
+    std::cout << "  --rate <bytes/s>               # total upload limit, e.g. 50M (default unlimited)\n";
+    std::cout << "  --client-rate <bytes/s>        # upload limit per client IP (default unlimited)\n";
+    std::cout << "  --conn-rate <bytes/s>          # upload limit per connection (default unlimited)\n";
+    std::cout << "  --fair on|off                  # split --rate evenly between busy clients (default on)\n";
+    std::cout << "  --compress on|off              # serve LZ4 pieces to clients that ask (default on)\n";
+    std::cout << "  --zcache <bytes>               # compressed piece cache, e.g. 256M (default 64M)\n";
+    std::cout << "  --fd-cache <n>                 # shared files kept open between requests (default 256, 0 = off)\n";
+    std::cout << "  --hot-cache <bytes>            # serve popular ranges from memory, e.g. 128M (default off)\n";
+    std::cout << "\nGet options:\n";
+    std::cout << "  --discover <ms>                # how long to wait for peers to answer (default 3000)\n";
+    std::cout << "  --min-sources <n>              # start once this many peers have answered (default 1)\n";
+    std::cout << "  --from <file>                  # more names or globs, one per line\n";
+    std::cout << "  --piece-size <bytes>           # scheduling unit, 16K to 1G (default: from file size and peer speed)\n";
+    std::cout << "  --pipeline <n>                 # requests in flight per connection (default: rate x RTT)\n";
+    std::cout << "  --max-conns <n>                # cap on adaptive connections (default 32)\n";
+    std::cout << "  --verify on|off                # check pieces against the seeder's hashes (default on)\n";
+    std::cout << "  --write-mode <mode>            # pwrite | mmap | uring (default pwrite)\n";
+    std::cout << "  --compress lz4|off             # ask for LZ4-compressed pieces (default off)\n";
+    std::cout << "  --delta on|off                 # reuse unchanged pieces of an existing local copy (default on)\n";
+    std::cout << "  --seed on|off                  # serve finished pieces to other downloaders meanwhile (default on)\n";
+    std::cout << "  --port <n>                     # TCP port to seed from (default 12000)\n";
+    std::cout << "\nMemory options (share and get):\n";
+    std::cout << "  --mem-budget <bytes>           # cap on pooled transfer buffers, e.g. 256M (default unlimited)\n";
+    std::cout << "  --hugepages on|off             # back large buffers with huge pages (default off)\n";
 }
 
 int main(int argc, char** argv) {
     if (argc < 2) { print_help(); return 1; }
     std::string cmd = argv[1];
 
-    const int SERVICE_PORT = 12000;
-    net = new Network(SERVICE_PORT);
+    int service_port = 12000;
+    uint64_t mem_budget = 0;
+    bool hugepages = false;
+    for (int i = 2; i + 1 < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--port") service_port = atoi(argv[i + 1]);
+        else if (opt == "--hugepages") hugepages = std::string(argv[i + 1]) != "off";
+        else if (opt == "--mem-budget" && !parse_bytes(argv[i + 1], mem_budget)) {
+            std::cout << "Bad size: " << argv[i + 1] << "\n";
+            return 1;
+        }
+    }
+    buffer_pool().configure((size_t)mem_budget, hugepages);
 
     if (cmd == "share") {
         if (argc < 3) {
             std::cout << "Provide folder to share\n";
             return 1;
         }
-        shared_folder = argv[2];
+        std::string shared_folder = argv[2];
+        ServerConfig cfg;
+        bool recursive = false;
+        for (int i = 3; i < argc; ++i) {
+            std::string opt = argv[i];
+            if (i + 1 >= argc) { std::cout << "Missing value for " << opt << "\n"; return 1; }
+            if (opt == "--port" || opt == "--mem-budget" || opt == "--hugepages") ++i;   // handled above
+            else if (opt == "--reactors") cfg.reactors = atoi(argv[++i]);
+            else if (opt == "--max-conns") cfg.max_connections = std::max(1, atoi(argv[++i]));
+            else if (opt == "--backlog") cfg.backlog = std::max(1, atoi(argv[++i]));
+            else if (opt == "--send-mode") {
+                if (!parse_send_mode(argv[++i], cfg.send_mode)) {
+                    std::cout << "Unknown send mode: " << argv[i] << "\n";
+                    return 1;
+                }
+            }
+            else if (opt == "--report") cfg.report_interval = std::max(0, atoi(argv[++i]));
+            else if (opt == "--recursive") recursive = std::string(argv[++i]) != "off";
+            else if (opt == "--rate" || opt == "--client-rate" || opt == "--conn-rate") {
+                uint64_t &rate = opt == "--rate" ? cfg.shaping.server_rate
+                               : opt == "--client-rate" ? cfg.shaping.client_rate : cfg.shaping.conn_rate;
+                if (!parse_bytes(argv[++i], rate)) {
+                    std::cout << "Bad rate: " << argv[i] << "\n";
+                    return 1;
+                }
+            }
+            else if (opt == "--fair") cfg.shaping.fair = std::string(argv[++i]) != "off";
+            else if (opt == "--compress") cfg.compression = std::string(argv[++i]) != "off";
+            else if (opt == "--zcache") {
+                uint64_t bytes = 0;
+                if (!parse_bytes(argv[++i], bytes)) {
+                    std::cout << "Bad size: " << argv[i] << "\n";
+                    return 1;
+                }
+                cfg.compress_cache = (size_t)bytes;
+            }
+            else if (opt == "--fd-cache") cfg.fd_cache = (size_t)std::max(0, atoi(argv[++i]));
+            else if (opt == "--hot-cache") {
+                uint64_t bytes = 0;
+                if (!parse_bytes(argv[++i], bytes)) {
+                    std::cout << "Bad size: " << argv[i] << "\n";
+                    return 1;
+                }
+                cfg.hot_cache = (size_t)bytes;
+            }
+            else { std::cout << "Unknown option: " << opt << "\n"; return 1; }
+        }
         std::cout << "Sharing folder: " << shared_folder << "\n";
-        net->start_broadcast(shared_folder);
-        net->start_listen_peers();
-        net->start_tcp_server(shared_folder);
+        P2PSeeder seeder(service_port);
+        if (!seeder.start(shared_folder, cfg, recursive)) return 1;
 
         std::cout << "Services started. Press Ctrl+C to stop.\n";
         while (true) {
             std::this_thread::sleep_for(std::chrono::seconds(10));
         }
     } else if (cmd == "list") {
-        net->start_listen_peers();
-        std::cout << "Listening for peers for 4 seconds...\n";
-        std::this_thread::sleep_for(std::chrono::seconds(4));
-        auto peers = net->get_peers_snapshot();
+        int discover_ms = 4000;
+        for (int i = 2; i + 1 < argc; ++i) {
+            if (std::string(argv[i]) == "--discover") discover_ms = std::max(0, atoi(argv[++i]));
+        }
+        P2PClient client(service_port, false);
+        // every peer answers an empty query; give the rest of the segment a
+        // moment after the first reply
+        auto peers = client.discover("", std::chrono::milliseconds(discover_ms), 1, std::chrono::milliseconds(250));
         for (auto &p : peers) {
-            std::cout << p.addr << ":" << p.port << "\n";
-            for (auto &kv : p.files) {
+            std::cout << p->addr << ":" << p->port << "\n";
+            for (auto &kv : p->files) {
                 std::cout << "  - " << kv.first << " (" << kv.second << " bytes)\n";
             }
+            for (auto &kv : p->partial) {
+                std::cout << "  - " << kv.first << " (" << kv.second << " bytes, downloading)\n";
+            }
         }
         if (peers.empty()) std::cout << "No peers found.\n";
     } else if (cmd == "get") {
-        if (argc < 3) {
-            std::cout << "Usage: p2p get <filename> [threads]\n";
+        DownloadRequest req;
+        DownloadOptions &opts = req.options;   // threads default: adaptive
+        std::vector<std::string> &patterns = req.names;
+        std::string list_file;
+        bool seed = true;
+        int &discover_ms = req.discover_ms, &min_sources = req.min_sources;
+        for (int i = 2; i < argc; ++i) {
+            std::string opt = argv[i];
+            if (opt.rfind("--", 0) != 0) {
+                // a bare number after the names is the connection count
+                if (!patterns.empty() && opt.find_first_not_of("0123456789") == std::string::npos) {
+                    opts.threads = std::max(1, atoi(argv[i]));
+                } else {
+                    patterns.push_back(opt);
+                }
+                continue;
+            }
+            if (i + 1 >= argc) { std::cout << "Missing value for " << opt << "\n"; return 1; }
+            if (opt == "--piece-size") {
+                // the range seeders build manifests and HAVE maps for
+                if (!parse_bytes(argv[++i], opts.piece_size) || !valid_piece_size(opts.piece_size)) {
+                    std::cout << "Bad piece size: " << argv[i] << " (16K to 1G)\n";
+                    return 1;
+                }
+            }
+            else if (opt == "--pipeline") opts.pipeline = std::max(1, atoi(argv[++i]));
+            else if (opt == "--max-conns") opts.max_connections = std::max(1, atoi(argv[++i]));
+            else if (opt == "--verify") opts.verify = std::string(argv[++i]) != "off";
+            else if (opt == "--compress") opts.compress = std::string(argv[++i]) != "off";
+            else if (opt == "--delta") opts.delta = std::string(argv[++i]) != "off";
+            else if (opt == "--seed") seed = std::string(argv[++i]) != "off";
+            else if (opt == "--port" || opt == "--mem-budget" || opt == "--hugepages") ++i;   // handled above
+            else if (opt == "--discover") discover_ms = std::max(0, atoi(argv[++i]));
+            else if (opt == "--min-sources") min_sources = std::max(1, atoi(argv[++i]));
+            else if (opt == "--from") list_file = argv[++i];
+            else if (opt == "--write-mode") {
+                if (!parse_write_mode(argv[++i], opts.write_mode)) {
+                    std::cout << "Unknown write mode: " << argv[i] << "\n";
+                    return 1;
+                }
+            }
+            else { std::cout << "Unknown option: " << opt << "\n"; return 1; }
+        }
+        if (!list_file.empty() && !read_name_list(list_file, patterns)) {
+            std::cout << "Cannot read " << list_file << "\n";
+            return 1;
+        }
+        if (patterns.empty()) {
+            std::cout << "Usage: p2p get <filename|glob|dir/>... [threads] [--from <list>]\n";
             return 1;
         }
-        int threads = 4;
-        if (argc >= 4) threads = std::max(1, atoi(argv[3]));
-        std::string filename = argv[2];
 
-        net->start_listen_peers();
-        std::this_thread::sleep_for(std::chrono::seconds(3));
-        auto peers = net->get_peers_snapshot();
-        std::string host; int port = 0; uint64_t size = 0;
-        for (auto &p : peers) {
-            auto it = p.files.find(filename);
-            if (it != p.files.end()) {
-                host = p.addr; port = p.port; size = it->second;
-                break;
+        req.on_resolved = [](const DownloadResult &r) {
+            std::cout << "Discovery: " << r.peers << " peer(s) in " << (int64_t)r.discovery_ms << " ms\n";
+            for (auto &name : r.unmatched) std::cout << "No peer has " << name << "\n";
+            if (r.files.size() == 1) {
+                auto &f = r.files[0];
+                std::cout << "Found on " << f.sources.size() << " peer(s) size=" << f.size << " bytes\n";
+                for (auto &src : f.sources) {
+                    std::cout << "  " << src.host << ":" << src.port;
+                    if (src.partial) std::cout << " (partial)";
+                    if (src.stats.rtt_ms > 0) std::cout << " (rtt " << src.stats.rtt_ms << " ms)";
+                    std::cout << "\n";
+                }
+            } else if (!r.files.empty()) {
+                uint64_t total = 0;
+                for (auto &f : r.files) total += f.size;
+                std::cout << "Batch: " << r.files.size() << " files, " << total << " bytes\n";
             }
-        }
-        if (host.empty()) { std::cout << "No peer has that file.\n"; return 1; }
-        std::cout << "Found on " << host << ":" << port << " size=" << size << " bytes\n";
+        };
 
-        // prepare destination file (pre-allocate)
-        {
-            std::fstream ofs(filename, std::ios::binary | std::ios::out | std::ios::trunc);
-            if (!ofs) { std::cout << "Failed to create output file\n"; return 1; }
-            if (size > 0) {
-                // write a single zero byte at position size-1 to allocate file
-                ofs.seekp((std::streampos)(size - 1));
-                char zero = 0;
-                ofs.write(&zero, 1);
+        P2PClient client(service_port, seed);
+        auto download = client.download(std::move(req));
+        const DownloadResult &r = download->wait();
+        if (r.files.empty()) { std::cout << "No peer has that file.\n"; return 1; }
+        if (r.files.size() == 1) {
+            if (r.ok) std::cout << "Download completed: " << r.files[0].filename << "\n";
+            else std::cout << "Download incomplete or failed.\n";
+        } else {
+            auto &done = r.report.completed;
+            std::cout << "Downloaded " << std::count(done.begin(), done.end(), true) << "/" << r.files.size()
+                      << " files\n";
+            for (size_t f = 0; f < r.files.size(); ++f) {
+                if (!done[f]) std::cout << "  incomplete: " << r.files[f].filename << "\n";
             }
-            ofs.close();
         }
-
-        // compute ranges
-        uint64_t chunk = (size + threads - 1) / threads; // ceil division
-        std::vector<std::pair<uint64_t,uint64_t>> ranges;
-        uint64_t cur = 0;
-        for (int i = 0; i < threads; ++i) {
-            uint64_t start = cur;
-            uint64_t end = std::min<uint64_t>(size, cur + chunk);
-            if (start >= end) { ranges.emplace_back(0,0); } else ranges.emplace_back(start, end);
-            cur = end;
+        if (!r.ok) return 1;
+    } else if (cmd == "stats") {
+        if (argc < 3) {
+            std::cout << "Usage: p2p stats <host[:port]> [--watch <secs>]\n";
+            return 1;
+        }
+        std::string host = argv[2];
+        int port = service_port;
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos) {
+            port = atoi(host.c_str() + colon + 1);
+            host.resize(colon);
+        }
+        int watch = 0;
+        for (int i = 3; i + 1 < argc; ++i) {
+            if (std::string(argv[i]) == "--watch") watch = std::max(1, atoi(argv[++i]));
         }
 
-        std::vector<std::thread> ths;
-        std::vector<bool> success(threads,false);
-        for (int i=0;i<threads;++i) {
-            ths.emplace_back([&,i](){
-                auto [s,e] = ranges[i];
-                if (s >= e) { success[i] = true; return; } // nothing to do for this thread
-                std::fstream localfs(filename, std::ios::in | std::ios::out | std::ios::binary);
-                if (!localfs) { success[i]=false; return; }
-                bool ok = download_range(host, port, filename, s, e, localfs);
-                success[i] = ok;
-                std::cout << "Thread " << i << " finished " << (ok?"OK":"FAIL") << "\n";
-            });
+        std::string text;
+        if (!fetch_stats(host, port, text)) {
+            std::cout << "No stats from " << host << ":" << port << "\n";
+            return 1;
+        }
+        if (watch == 0) {
+            std::cout << text;
+        } else {
+            auto before = parse_metrics(text);
+            auto last = std::chrono::steady_clock::now();
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(watch));
+                if (!fetch_stats(host, port, text)) {
+                    std::cout << "Lost " << host << ":" << port << "\n";
+                    return 1;
+                }
+                auto now = std::chrono::steady_clock::now();
+                auto after = parse_metrics(text);
+                std::cout << "[stats] " << host << ":" << port << "\n"
+                          << describe_interval(before, after, std::chrono::duration<double>(now - last).count())
+                          << std::flush;
+                before = std::move(after);
+                last = now;
+            }
         }
-        for (auto &t: ths) if (t.joinable()) t.join();
-        bool allok = true;
-        for (auto v: success) if (!v) allok=false;
-        if (allok) std::cout << "Download completed: " << filename << "\n";
-        else std::cout << "Download incomplete or failed.\n";
     } else {
         print_help();
     }
 
-    delete net;
     return 0;
-}
\ No newline at end of file
+}
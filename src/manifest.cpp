@@ -0,0 +1,264 @@
+#include "manifest.hpp"
+#include "hash.hpp"
+#include "protocol.hpp"
+#include "delta.hpp"
+#include "utils.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static bool stat_file(const std::string &path, uint64_t &size, int64_t &mtime_ns) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) return false;
+    size = (uint64_t)st.st_size;
+    mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Text form
+// ---------------------------------------------------------------
+std::string serialize_manifest(const Manifest& m, bool with_weak) {
+    with_weak = with_weak && m.weak.size() == m.hashes.size();
+    std::string out = std::string(with_weak ? "P2PMANIFEST 2 " : "P2PMANIFEST 1 ") + std::to_string(m.file_size) +
+                      " " + std::to_string(m.piece_size) + " " + std::to_string(m.hashes.size()) + "\n";
+    out.reserve(out.size() + m.hashes.size() * (with_weak ? 26 : 17));
+    char weak[16];
+    for (size_t i = 0; i < m.hashes.size(); ++i) {
+        out += hash_hex(m.hashes[i]);
+        if (with_weak) {
+            snprintf(weak, sizeof(weak), " %08x", m.weak[i]);
+            out += weak;
+        }
+        out += '\n';
+    }
+    return out;
+}
+
+bool parse_manifest(const std::string& text, Manifest& m) {
+    std::istringstream iss(text);
+    std::string tag;
+    int version = 0;
+    size_t count = 0;
+    if (!(iss >> tag >> version >> m.file_size >> m.piece_size >> count)) return false;
+    if (tag != "P2PMANIFEST" || (version != 1 && version != 2) || m.piece_size == 0) return false;
+    if (count != (m.file_size + m.piece_size - 1) / m.piece_size) return false;
+
+    m.hashes.clear();
+    m.weak.clear();
+    m.hashes.reserve(count);
+    if (version == 2) m.weak.reserve(count);
+    std::string line;
+    while (m.hashes.size() < count && iss >> line) {
+        uint64_t h = 0;
+        if (!parse_hash_hex(line, h)) return false;
+        m.hashes.push_back(h);
+        if (version == 2) {
+            std::string w;
+            if (!(iss >> w) || w.empty() || w.size() > 8) return false;
+            char *end = nullptr;
+            unsigned long v = strtoul(w.c_str(), &end, 16);
+            if (*end != '\0') return false;
+            m.weak.push_back((uint32_t)v);
+        }
+    }
+    return m.hashes.size() == count;
+}
+
+
+// ---------------------------------------------------------------
+// Parallel hashing
+// ---------------------------------------------------------------
+bool compute_manifest(const std::string& path, uint64_t piece_size, Manifest& out, int threads) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st{};
+    if (fstat(fd, &st) < 0) { close(fd); return false; }
+
+    out.file_size = (uint64_t)st.st_size;
+    out.piece_size = piece_size;
+    size_t count = (size_t)((out.file_size + piece_size - 1) / piece_size);
+    out.hashes.assign(count, 0);
+    out.weak.assign(count, 0);
+
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = (int)std::min<size_t>((size_t)threads, std::max<size_t>(1, count));
+
+    // interleave pieces over threads; pread keeps the shared fd stateless
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> ths;
+    for (int t = 0; t < threads; ++t) {
+        ths.emplace_back([&, t]() {
+            std::vector<char> buf(piece_size);
+            for (size_t i = (size_t)t; i < count && ok; i += (size_t)threads) {
+                uint64_t start = (uint64_t)i * piece_size;
+                size_t len = (size_t)std::min<uint64_t>(piece_size, out.file_size - start);
+                size_t got = 0;
+                while (got < len) {
+                    ssize_t r = pread(fd, buf.data() + got, len - got, (off_t)(start + got));
+                    if (r <= 0) { ok = false; break; }
+                    got += (size_t)r;
+                }
+                if (got == len) {
+                    out.hashes[i] = xxh64(buf.data(), len);
+                    out.weak[i] = weak_sum(buf.data(), len);
+                }
+            }
+        });
+    }
+    for (auto &th : ths) th.join();
+    close(fd);
+    return ok;
+}
+
+
+// ---------------------------------------------------------------
+// Store
+// ---------------------------------------------------------------
+ManifestStore::ManifestStore(std::shared_ptr<const Catalog> catalog)
+    : catalog_(std::move(catalog)), folder_(catalog_->folder()) {
+    worker_ = std::thread(&ManifestStore::worker, this);
+}
+
+ManifestStore::~ManifestStore() {
+    stop();
+}
+
+void ManifestStore::stop() {
+    running_ = false;
+    cv_.notify_all();
+    if (worker_.joinable()) worker_.join();
+}
+
+std::string ManifestStore::cache_path(const Key& key) const {
+    return folder_ + "/.p2p/" + hash_hex(xxh64(key.first.data(), key.first.size())) +
+           "-" + std::to_string(key.second) + ".manifest";
+}
+
+bool ManifestStore::enqueue(const Key& key) {
+    // caller holds mu_
+    if (queued_.count(key)) return true;
+    size_t pending = 0;
+    for (auto it = queued_.lower_bound({key.first, 0}); it != queued_.end() && it->first == key.first; ++it) pending++;
+    if (pending >= MAX_VARIANTS) return false;
+    queued_.insert(key);
+    queue_.push_back(key);
+    cv_.notify_one();
+    return true;
+}
+
+std::shared_ptr<const Manifest> ManifestStore::get(const std::string& filename, uint64_t piece_size) {
+    CatalogEntry e;
+    if (!catalog_->lookup(filename, e) || !piece_count_ok(e.size, piece_size)) return nullptr;
+
+    Key key{filename, piece_size};
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = cache_.find(key);
+    if (it != cache_.end() && it->second.mtime_ns == e.mtime_ns && it->second.manifest->file_size == e.size) {
+        it->second.used = ++uses_;
+        return it->second.manifest;
+    }
+    enqueue(key);
+    return nullptr;
+}
+
+void ManifestStore::prewarm(uint64_t piece_size) {
+    auto files = catalog_->snapshot();
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto &kv : *files) {
+        if (piece_count_ok(kv.second.size, piece_size)) enqueue({kv.first, piece_size});
+    }
+}
+
+// Drops the least recently used piece sizes of `filename` past MAX_VARIANTS,
+// then its cache files on disk for sizes no longer kept or queued.
+void ManifestStore::trim(const std::string& filename) {
+    std::set<std::string> keep;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto first = cache_.lower_bound({filename, 0});
+        while (true) {
+            size_t n = 0;
+            auto victim = cache_.end();
+            for (auto it = first; it != cache_.end() && it->first.first == filename; ++it) {
+                n++;
+                if (it->first.second == DEFAULT_PIECE_SIZE) continue;
+                if (victim == cache_.end() || it->second.used < victim->second.used) victim = it;
+            }
+            if (n <= MAX_VARIANTS || victim == cache_.end()) break;
+            if (victim == first) first++;
+            cache_.erase(victim);
+        }
+        for (auto it = first; it != cache_.end() && it->first.first == filename; ++it) {
+            keep.insert(fs::path(cache_path(it->first)).filename().string());
+        }
+        // and whatever a queued build may still load
+        for (auto it = queued_.lower_bound({filename, 0}); it != queued_.end() && it->first == filename; ++it) {
+            keep.insert(fs::path(cache_path(*it)).filename().string());
+        }
+        keep.insert(fs::path(cache_path({filename, DEFAULT_PIECE_SIZE})).filename().string());
+    }
+
+    std::string prefix = hash_hex(xxh64(filename.data(), filename.size())) + "-";
+    std::error_code ec;
+    for (auto &entry : fs::directory_iterator(folder_ + "/.p2p", ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) == 0 && !keep.count(name)) fs::remove(entry.path(), ec);
+    }
+}
+
+void ManifestStore::worker() {
+    while (running_) {
+        Key key;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            cv_.wait(lock, [&]{ return !running_ || !queue_.empty(); });
+            if (!running_) return;
+            key = queue_.front();
+            queue_.pop_front();
+        }
+
+        std::string path = folder_ + "/" + key.first;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        auto m = std::make_shared<Manifest>();
+        bool ready = false;
+        if (stat_file(path, size, mtime)) {
+            // on-disk cache: "<mtime_ns>\n" followed by the manifest text
+            std::ifstream in(cache_path(key), std::ios::binary);
+            int64_t cached_mtime = -1;
+            if (in && in >> cached_mtime && cached_mtime == mtime) {
+                std::string rest((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                // caches from before weak sums are rebuilt
+                ready = parse_manifest(rest, *m) && m->file_size == size && m->piece_size == key.second &&
+                        m->weak.size() == m->hashes.size();
+            }
+            if (!ready && compute_manifest(path, key.second, *m)) {
+                ready = true;
+                std::error_code ec;
+                fs::create_directories(folder_ + "/.p2p", ec);
+                std::ofstream outf(cache_path(key), std::ios::binary | std::ios::trunc);
+                if (outf) outf << mtime << "\n" << serialize_manifest(*m, true);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            queued_.erase(key);
+            if (ready) cache_[key] = Entry{m, mtime, ++uses_};
+        }
+        if (ready) trim(key.first);
+    }
+}
@@ -0,0 +1,273 @@
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "connection.hpp"
+#include "bufpool.hpp"
+
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/resource.h>
+
+// set during static initialisation, i.e. at process start
+static const auto process_start = std::chrono::steady_clock::now();
+
+const double Histogram::BOUNDS[Histogram::BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+void Histogram::observe(double secs) {
+    int i = 0;
+    while (i < BUCKETS && secs > BOUNDS[i]) ++i;
+    counts_[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add((uint64_t)(secs * 1e6), std::memory_order_relaxed);
+}
+
+void Histogram::observe_since(std::chrono::steady_clock::time_point start) {
+    observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+void Histogram::render(std::string& out, const char *name) const {
+    char le[32];
+    uint64_t total = 0;
+    for (int i = 0; i <= BUCKETS; ++i) {
+        total += counts_[i].load(std::memory_order_relaxed);
+        if (i < BUCKETS) std::snprintf(le, sizeof(le), "%g", BOUNDS[i]);
+        out.append(name).append("_bucket{le=\"").append(i < BUCKETS ? le : "+Inf").append("\"} ");
+        append_u64(out, total);
+        out += '\n';
+    }
+    char sum[32];
+    std::snprintf(sum, sizeof(sum), "%.6f", (double)sum_us_.load(std::memory_order_relaxed) / 1e6);
+    out.append(name).append("_sum ").append(sum).append("\n");
+    out.append(name).append("_count ");
+    append_u64(out, total);
+    out += '\n';
+}
+
+
+// ---------------------------------------------------------------
+// Registry
+// ---------------------------------------------------------------
+uint64_t peak_rss_bytes() {
+    rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return (uint64_t)ru.ru_maxrss * 1024;     // Linux reports KiB
+}
+
+Metrics& metrics() {
+    static Metrics m;
+    return m;
+}
+
+std::shared_ptr<PeerCounters> Metrics::peer(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = peers_.find(name);
+    if (it != peers_.end()) return it->second;
+    auto &slot = peers_.size() < MAX_PEERS ? peers_[name] : peers_["other"];
+    if (!slot) slot = std::make_shared<PeerCounters>();
+    return slot;
+}
+
+namespace {
+
+void header(std::string& out, const char *name, const char *type, const char *help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void counter(std::string& out, const char *name, const char *help, const Counter& c) {
+    header(out, name, "counter", help);
+    out.append(name).append(" ");
+    append_u64(out, c.value());
+    out += '\n';
+}
+
+void gauge(std::string& out, const char *name, const char *help, int64_t v) {
+    header(out, name, "gauge", help);
+    out.append(name).append(" ").append(std::to_string(v)).append("\n");
+}
+
+// Label values are addresses, but keep the output well-formed regardless.
+std::string label(const std::string& v) {
+    std::string out;
+    for (char ch : v) {
+        if (ch == '"' || ch == '\\') out += '\\';
+        if (ch == '\n') { out += "\\n"; continue; }
+        out += ch;
+    }
+    return out;
+}
+
+} // namespace
+
+std::string Metrics::render() {
+    std::string out;
+    out.reserve(8192);
+    gauge(out, "p2p_uptime_seconds", "Seconds since the process started.",
+          (int64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - process_start).count());
+    gauge(out, "p2p_peak_rss_bytes", "Peak resident set size of the process.", (int64_t)peak_rss_bytes());
+
+    auto pool = buffer_pool().stats();
+    gauge(out, "p2p_buffer_pool_budget_bytes", "Cap on pooled transfer buffers (0 = unlimited).", (int64_t)pool.budget);
+    gauge(out, "p2p_buffer_pool_mapped_bytes", "Memory mapped for pooled transfer buffers.", (int64_t)pool.mapped);
+    gauge(out, "p2p_buffer_pool_in_use_bytes", "Pooled transfer buffers on loan.", (int64_t)pool.in_use);
+    gauge(out, "p2p_buffer_pool_peak_bytes", "Most pooled transfer buffer bytes on loan at once.",
+          (int64_t)pool.peak_in_use);
+    gauge(out, "p2p_buffer_pool_hugepage_bytes", "Pooled buffer memory backed by explicit huge pages.",
+          (int64_t)pool.huge);
+    header(out, "p2p_buffer_pool_waits_total", "counter", "Buffer requests held back by the memory budget.");
+    out.append("p2p_buffer_pool_waits_total ");
+    append_u64(out, pool.waits);
+    out += '\n';
+
+    counter(out, "p2p_bytes_served_total", "Body bytes sent by the file server.", bytes_served);
+    counter(out, "p2p_connections_accepted_total", "Connections accepted by the file server.", connections_accepted);
+    gauge(out, "p2p_connections_active", "Open file server connections.", connections_active.value());
+    header(out, "p2p_requests_total", "counter", "Requests handled by the file server, by command.");
+    const std::pair<const char*, const Counter*> requests[] = {
+        {"get", &requests_get}, {"manifest", &requests_manifest},
+        {"catalog", &requests_catalog}, {"have", &requests_have}, {"stats", &requests_stats},
+    };
+    for (auto &r : requests) {
+        out.append("p2p_requests_total{cmd=\"").append(r.first).append("\"} ");
+        append_u64(out, r.second->value());
+        out += '\n';
+    }
+    counter(out, "p2p_requests_malformed_total", "Request lines the file server could not parse.", requests_malformed);
+    counter(out, "p2p_replies_err_total", "ERR replies sent (nofile, range, busy, missing).", replies_err);
+    header(out, "p2p_request_seconds", "histogram", "GET latency on the file server, request to last body byte.");
+    request_seconds.render(out, "p2p_request_seconds");
+
+    counter(out, "p2p_bytes_received_total", "Body bytes received by downloads.", bytes_received);
+    counter(out, "p2p_pieces_received_total", "Pieces downloaded and written.", pieces_received);
+    counter(out, "p2p_ranges_failed_total", "Range requests that failed and were rescheduled.", ranges_failed);
+    counter(out, "p2p_pieces_bad_total", "Pieces that failed hash verification.", pieces_bad);
+    counter(out, "p2p_bytes_reused_total", "Bytes a delta transfer took from the old local copy.", bytes_reused);
+    header(out, "p2p_piece_seconds", "histogram", "Download latency per piece, request to write.");
+    piece_seconds.render(out, "p2p_piece_seconds");
+
+    counter(out, "p2p_announces_sent_total", "Discovery announces broadcast.", announces_sent);
+    counter(out, "p2p_announces_received_total", "Binary announces received from other peers.", announces_received);
+    counter(out, "p2p_announces_legacy_total", "Text announces received from older peers.", announces_legacy);
+    counter(out, "p2p_announces_rejected_total", "Discovery datagrams that failed to parse.", announces_rejected);
+    counter(out, "p2p_queries_sent_total", "Who-has queries broadcast.", queries_sent);
+    counter(out, "p2p_queries_received_total", "Who-has queries received from other peers.", queries_received);
+    counter(out, "p2p_queries_answered_total", "Who-has queries answered by unicast.", queries_answered);
+    counter(out, "p2p_queries_limited_total", "Who-has queries left unanswered by the per-source rate limit.",
+            queries_limited);
+    counter(out, "p2p_catalog_fetches_total", "Peer catalogs fetched over TCP.", catalog_fetches);
+    counter(out, "p2p_catalog_fetch_failures_total", "Peer catalog fetches that failed.", catalog_fetch_failures);
+    gauge(out, "p2p_peers", "Live peers in the peer table.", peers.value());
+
+    std::lock_guard<std::mutex> lock(mu_);
+    header(out, "p2p_peer_bytes_sent_total", "counter", "Body bytes sent to each peer.");
+    for (auto &kv : peers_) {
+        out.append("p2p_peer_bytes_sent_total{peer=\"").append(label(kv.first)).append("\"} ");
+        append_u64(out, kv.second->sent.value());
+        out += '\n';
+    }
+    header(out, "p2p_peer_bytes_received_total", "counter", "Body bytes received from each peer.");
+    for (auto &kv : peers_) {
+        out.append("p2p_peer_bytes_received_total{peer=\"").append(label(kv.first)).append("\"} ");
+        append_u64(out, kv.second->received.value());
+        out += '\n';
+    }
+    return out;
+}
+
+
+// ---------------------------------------------------------------
+// Client
+// ---------------------------------------------------------------
+bool fetch_stats(const std::string& host, int port, std::string& out) {
+    PeerConnection conn(host, port);
+    if (!conn.open()) return false;
+    Response r;
+    if (!conn.send_stats(1) || !conn.read_response(r) || !r.ok || r.id != 1 || r.length > (16u << 20)) return false;
+    out.assign(r.length, '\0');
+    return conn.read_body(&out[0], r.length);
+}
+
+std::map<std::string, double> parse_metrics(const std::string& text) {
+    std::map<std::string, double> out;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t nl = text.find('\n', pos);
+        if (nl == std::string::npos) nl = text.size();
+        std::string line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        if (line.empty() || line[0] == '#') continue;
+        size_t sp = line.rfind(' ');
+        if (sp == std::string::npos) continue;
+        out[line.substr(0, sp)] = std::strtod(line.c_str() + sp + 1, nullptr);
+    }
+    return out;
+}
+
+namespace {
+
+bool ends_with(const std::string& s, const char *suffix) {
+    size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Upper bound of the bucket holding quantile `q` of the observations made
+// between the two samples; negative if there were none.
+double interval_quantile(const std::map<std::string, double>& before,
+                         const std::map<std::string, double>& after, const std::string& name, double q) {
+    std::string prefix = name + "_bucket{le=\"";
+    std::vector<std::pair<double, double>> buckets;     // upper bound, cumulative count
+    for (auto it = after.lower_bound(prefix); it != after.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        std::string le = it->first.substr(prefix.size());
+        le = le.substr(0, le.find('"'));
+        auto b = before.find(it->first);
+        double delta = it->second - (b != before.end() ? b->second : 0);
+        buckets.push_back({le == "+Inf" ? INFINITY : std::strtod(le.c_str(), nullptr), delta});
+    }
+    std::sort(buckets.begin(), buckets.end());
+    if (buckets.empty() || buckets.back().second <= 0) return -1;
+    double want = q * buckets.back().second;
+    for (auto &b : buckets) {
+        if (b.second >= want) return b.first;
+    }
+    return buckets.back().first;
+}
+
+} // namespace
+
+std::string describe_interval(const std::map<std::string, double>& before,
+                              const std::map<std::string, double>& after, double secs) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    secs = std::max(secs, 1e-6);
+    for (auto &kv : after) {
+        const std::string &series = kv.first;
+        std::string name = series.substr(0, series.find('{'));
+        if (ends_with(name, "_bucket") || ends_with(name, "_sum") || ends_with(name, "_count")) continue;
+        if (ends_with(name, "_total")) {
+            auto b = before.find(series);
+            double delta = kv.second - (b != before.end() ? b->second : 0);
+            if (delta <= 0) continue;
+            if (name.find("bytes") != std::string::npos) {
+                out << "  " << series << ": " << delta / secs / (1024.0 * 1024.0) << " MiB/s\n";
+            } else {
+                out << "  " << series << ": " << delta / secs << "/s\n";
+            }
+        } else if (name != "p2p_uptime_seconds") {
+            out << "  " << series << ": " << (int64_t)kv.second << "\n";
+        }
+    }
+    for (const char *h : {"p2p_request_seconds", "p2p_piece_seconds"}) {
+        double p50 = interval_quantile(before, after, h, 0.50);
+        if (p50 < 0) continue;
+        double p99 = interval_quantile(before, after, h, 0.99);
+        out << "  " << h << ": p50 <= " << p50 * 1e3 << " ms, p99 <= " << p99 * 1e3 << " ms\n";
+    }
+    return out.str();
+}
@@ -1,62 +1,202 @@
 
 #include "network.hpp"
+#include "connection.hpp"
+#include "metrics.hpp"
 #include "utils.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
-#include <filesystem>
 #include <cstring>
 #include <chrono>
+#include <random>
+#include <algorithm>
+#include <set>
+#include <unordered_map>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
-
-namespace fs = std::filesystem;
+#include <poll.h>
+#include <sys/time.h>
 
 static constexpr int DISCOVERY_PORT = 10000; // UDP discovery port
+static constexpr size_t MAX_CATALOG_FETCHES = 16;   // concurrent CATALOG requests
+static constexpr uint64_t MAX_CATALOG_BYTES = 256u << 20;
+
+static uint64_t random_peer_id() {
+    std::random_device rd;
+    uint64_t id = ((uint64_t)rd() << 32) ^ rd();
+    return id ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+}
 
-Network::Network(int service_port) : service_port_(service_port) {}
+Network::Network(int service_port)
+    : service_port_(service_port), peer_id_(random_peer_id()), peers_(std::chrono::seconds(PEER_TTL_SECS)) {}
 Network::~Network() {
-    running_ = false;
+    {
+        std::lock_guard<std::mutex> lock(stop_mu_);
+        running_ = false;
+    }
+    stop_cv_.notify_all();
     // join threads if running
     try {
         if (broadcast_thread_.joinable()) broadcast_thread_.join();
         if (listener_thread_.joinable()) listener_thread_.join();
-        if (tcp_server_thread_.joinable()) tcp_server_thread_.join();
     } catch (...) {}
+    if (server_) server_->stop();
+    if (catalog_) catalog_->stop();
 }
 
 
 // ---------------------------------------------------------------
 // Start Threads
 // ---------------------------------------------------------------
+bool Network::share(const std::string& shared_folder, bool recursive) {
+    auto catalog = std::make_shared<Catalog>(shared_folder, recursive);
+    if (!catalog->start()) return false;
+    std::lock_guard<std::mutex> lock(announce_mu_);
+    catalog_ = std::move(catalog);
+    return true;
+}
 void Network::start_broadcast(const std::string& shared_folder) {
-    broadcast_thread_ = std::thread(&Network::broadcast_worker, this, shared_folder);
+    if (!catalog_ && !share(shared_folder)) return;
+    broadcast_thread_ = std::thread(&Network::broadcast_worker, this);
 }
 void Network::start_listen_peers() {
     listener_thread_ = std::thread(&Network::listener_worker, this);
 }
-void Network::start_tcp_server(const std::string& shared_folder) {
-    tcp_server_thread_ = std::thread(&Network::tcp_server_worker, this, shared_folder);
+bool Network::start_tcp_server(const std::string& shared_folder, const ServerConfig& cfg) {
+    if (!catalog_ && !share(shared_folder)) return false;
+    server_ = std::make_unique<FileServer>(service_port_, catalog_, cfg, partials_);
+    if (!server_->start()) server_.reset();
+    return server_ != nullptr;
+}
+bool Network::seed_partials(std::shared_ptr<PartialFiles> partials, const ServerConfig& cfg) {
+    {
+        std::lock_guard<std::mutex> lock(announce_mu_);
+        partials_ = std::move(partials);
+        // an empty catalog that is never started: nothing is shared in full
+        if (!catalog_) catalog_ = std::make_shared<Catalog>("");
+    }
+    if (!start_tcp_server("", cfg)) return false;
+    if (!broadcast_thread_.joinable()) start_broadcast("");
+    return true;
 }
 
 
 // ---------------------------------------------------------------
 // Thread-safe peer snapshot
 // ---------------------------------------------------------------
-std::vector<PeerInfo> Network::get_peers_snapshot() {
-    std::lock_guard<std::mutex> lock(peers_mutex_);
-    return peers_;
+std::shared_ptr<const PeerSnapshot> Network::get_peers_snapshot() {
+    sync_catalogs(nullptr);
+    return peers_.snapshot();
+}
+
+PeerList Network::find_peers(const std::string& filename) {
+    sync_catalogs(&filename);
+    return peers_.holders(filename);
+}
+
+PeerStats Network::peer_stats(const std::string& addr, int port) {
+    return peers_.stats(addr, port);
+}
+
+void Network::record_peer_stats(const std::string& addr, int port, const PeerStats& measured) {
+    peers_.record_rate(addr, port, measured.bytes_per_sec);
+    peers_.record_rtt(addr, port, measured.rtt_ms);
+}
+
+
+// ---------------------------------------------------------------
+// Catalog fetch (TCP)
+// ---------------------------------------------------------------
+static bool fetch_catalog(const std::string& host, int port, std::map<std::string, uint64_t>& files,
+                          std::map<std::string, uint64_t>& partial, uint64_t& digest, double& rtt_ms) {
+    PeerConnection conn(host, port);
+    if (!conn.open()) return false;
+    rtt_ms = conn.rtt_ms();
+    Response r;
+    if (!conn.send_catalog(1) || !conn.read_response(r) || !r.ok || r.id != 1 ||
+        r.length > MAX_CATALOG_BYTES) return false;
+    std::string text(r.length, '\0');
+    if (!conn.read_body(&text[0], r.length)) return false;
+
+    CatalogFiles cat, part;
+    if (!parse_catalog(text, cat, digest, &part)) return false;
+    files.clear();
+    for (auto &kv : cat) files.emplace_hint(files.end(), kv.first, kv.second.size);
+    partial.clear();
+    for (auto &kv : part) partial.emplace_hint(partial.end(), kv.first, kv.second.size);
+    return true;
+}
+
+// Brings stale catalogs up to date (only those that may list `filename`, if
+// given). Fetches run in parallel, outside the peer lock.
+void Network::sync_catalogs(const std::string *filename) {
+    auto stale = peers_.stale_catalogs(filename, std::chrono::seconds(CATALOG_RETRY_SECS));
+    if (stale.empty()) return;
+
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> ths;
+    for (size_t t = 0; t < std::min(stale.size(), MAX_CATALOG_FETCHES); ++t) {
+        ths.emplace_back([&]{
+            for (size_t i; (i = next++) < stale.size();) {
+                std::map<std::string, uint64_t> files, partial;
+                uint64_t digest = 0;
+                double rtt_ms = 0;
+                if (fetch_catalog(stale[i].addr, stale[i].port, files, partial, digest, rtt_ms)) {
+                    metrics().catalog_fetches.add();
+                    peers_.catalog_fetched(stale[i], std::move(files), digest, std::move(partial));
+                    peers_.record_rtt(stale[i].addr, stale[i].port, rtt_ms);
+                } else {
+                    metrics().catalog_fetch_failures.add();
+                }
+            }
+        });
+    }
+    for (auto &t : ths) t.join();
+}
+
+
+// ---------------------------------------------------------------
+// Announce datagram
+// ---------------------------------------------------------------
+std::string Network::announce_message(const std::string *filename) {
+    std::lock_guard<std::mutex> lock(announce_mu_);
+    if (!catalog_) return {};
+    if (filename && !filename->empty()) {
+        CatalogEntry e;
+        if (!catalog_->lookup(*filename, e) && !(partials_ && partials_->find(*filename))) return {};
+    }
+    uint64_t v = catalog_->version();
+    uint64_t pv = partials_ ? partials_->version() : 0;
+    if (announce_.empty() || v != announce_version_ || pv != announce_partial_version_) {
+        Announce a;
+        a.peer_id = peer_id_;
+        a.port = service_port_;
+        auto files = catalog_->snapshot();
+        auto partial = partials_ ? partials_->snapshot() : std::make_shared<const CatalogFiles>();
+        a.digest = catalog_digest(*files, *partial);
+        a.file_count = (uint32_t)(files->size() + partial->size());
+        std::vector<std::string> names;
+        names.reserve(a.file_count);
+        for (auto &kv : *files) names.push_back(kv.first);
+        for (auto &kv : *partial) names.push_back(kv.first);
+        bloom_build(names, a);
+        announce_ = encode_announce(a);
+        query_reply_ = encode_query_reply(a);
+        announce_version_ = v;
+        announce_partial_version_ = pv;
+    }
+    return filename ? query_reply_ : announce_;
 }
 
 
 // ---------------------------------------------------------------
 // Broadcast (UDP)
 // ---------------------------------------------------------------
-void Network::broadcast_worker(const std::string& shared_folder) {
+void Network::broadcast_worker() {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         std::cerr << "[broadcast] failed to create socket\n";
@@ -75,27 +215,80 @@ void Network::broadcast_worker(const std::string& shared_folder) {
     addr.sin_addr.s_addr = inet_addr("255.255.255.255");
 
     while (running_) {
-        std::stringstream ss;
-        // Format: "PEER <tcp_port> filename1:size1,filename2:size2,"
-        ss << "PEER " << service_port_ << " ";
-        bool first = true;
-        try {
-            for (auto &entry : fs::directory_iterator(shared_folder)) {
-                if (!entry.is_regular_file()) continue;
-                if (!first) ss << ",";
-                first = false;
-                ss << entry.path().filename().string() << ":" << fs::file_size(entry.path());
+        std::string msg = announce_message();
+        ssize_t sent = sendto(sock, msg.c_str(), msg.size(), 0, (sockaddr*)&addr, sizeof(addr));
+        if (sent > 0) metrics().announces_sent.add();
+        std::unique_lock<std::mutex> lock(stop_mu_);
+        stop_cv_.wait_for(lock, std::chrono::milliseconds(ANNOUNCE_INTERVAL_MS), [&] { return !running_; });
+    }
+    close(sock);
+}
+
+
+// ---------------------------------------------------------------
+// Active query (UDP)
+// ---------------------------------------------------------------
+PeerList Network::query_peers(const std::string& filename, int min_sources, std::chrono::milliseconds timeout,
+                              std::chrono::milliseconds grace) {
+    using clock = std::chrono::steady_clock;
+    auto result = [&]() { return filename.empty() ? get_peers_snapshot()->peers : find_peers(filename); };
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        std::cerr << "[query] failed to create socket\n";
+        std::this_thread::sleep_for(timeout);
+        return result();
+    }
+    int broadcastEnable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(DISCOVERY_PORT);
+    addr.sin_addr.s_addr = inet_addr("255.255.255.255");
+
+    Query q;
+    q.peer_id = peer_id_;
+    q.name = filename;
+    std::string msg = encode_query(q);
+
+    auto start = clock::now();
+    auto deadline = start + timeout;
+    auto settle = clock::time_point::max();    // set once enough peers have answered
+    auto next_send = start;
+    int sends = 0;
+    std::set<uint64_t> answered;
+    char buf[8192];
+    while (true) {
+        auto now = clock::now();
+        if (now >= deadline || now >= settle) break;
+        if (sends < QUERY_SENDS && now >= next_send) {
+            if (sendto(sock, msg.data(), msg.size(), 0, (sockaddr*)&addr, sizeof(addr)) > 0) {
+                metrics().queries_sent.add();
             }
-        } catch (const std::exception &e) {
-            // ignore errors reading folder
+            sends++;
+            next_send = now + std::chrono::milliseconds(QUERY_RESEND_MS);
         }
 
-        std::string msg = ss.str();
-        ssize_t sent = sendto(sock, msg.c_str(), msg.size(), 0, (sockaddr*)&addr, sizeof(addr));
-        (void)sent;
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+        auto until = std::min(deadline, settle);
+        if (sends < QUERY_SENDS) until = std::min(until, next_send);
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(until - now);
+        pollfd p{sock, POLLIN, 0};
+        if (poll(&p, 1, (int)std::max<int64_t>(0, wait.count())) <= 0) continue;
+
+        sockaddr_in src{};
+        socklen_t len = sizeof(src);
+        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)&src, &len);
+        Announce a;
+        if (n <= 0 || !decode_announce(buf, (size_t)n, a) || a.peer_id == peer_id_) continue;
+        peers_.announce(inet_ntoa(src.sin_addr), a);
+        if (answered.insert(a.peer_id).second && (int)answered.size() >= std::max(1, min_sources) &&
+            settle == clock::time_point::max()) {
+            settle = clock::now() + grace;
+        }
     }
     close(sock);
+    return result();
 }
 
 
@@ -108,6 +301,32 @@ static inline std::string ltrim(const std::string &s) {
     return s.substr(i);
 }
 
+// Text announce sent by older peers: "PEER <port> name:size,name2:size2,..."
+static bool parse_legacy_announce(const std::string &msg, PeerInfo &peer) {
+    if (msg.size() < 5 || msg.compare(0, 5, "PEER ") != 0) return false;
+
+    std::istringstream iss(msg);
+    std::string tag;
+    if (!(iss >> tag >> peer.port)) return false;
+
+    std::string rest;
+    std::getline(iss, rest);
+    rest = ltrim(rest); // removes leading spaces
+
+    // parse files: "name:size,name2:size2,..." (maybe trailing comma)
+    for (auto &item : split(rest, ',')) {
+        if (item.empty()) continue;
+        auto kv = split(item, ':');
+        if (kv.size() != 2) continue;
+        try {
+            peer.files[kv[0]] = std::stoull(kv[1]);
+        } catch (...) {
+            // ignore bad size parse
+        }
+    }
+    return true;
+}
+
 void Network::listener_worker() {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
@@ -115,6 +334,11 @@ void Network::listener_worker() {
         return;
     }
 
+    // several peers may run on one host (on different service ports);
+    // let all of them receive the broadcasts
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -126,186 +350,63 @@ void Network::listener_worker() {
         return;
     }
 
+    // wake up regularly to expire silent peers (once a second) and to
+    // notice shutdown without holding up the process
+    timeval tv{};
+    tv.tv_usec = 200 * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
     char buf[8192];
+    auto last_expire = std::chrono::steady_clock::now();
+    // query replies per source address this second
+    std::unordered_map<uint32_t, int> replied;
     while (running_) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_expire >= std::chrono::seconds(1)) {
+            peers_.expire();
+            metrics().peers.set((int64_t)peers_.size());
+            replied.clear();
+            last_expire = now;
+        }
+
         sockaddr_in src{};
         socklen_t len = sizeof(src);
         ssize_t n = recvfrom(sock, buf, sizeof(buf) - 1, 0, (sockaddr*)&src, &len);
         if (n <= 0) continue;
         buf[n] = '\0';
 
-        std::string msg(buf);
-        // ensure it starts with "PEER "
-        if (msg.size() < 5) continue;
-        if (msg.compare(0, 5, "PEER ") != 0) continue;
-
-        std::istringstream iss(msg);
-        std::string tag;
-        int peer_tcp_port = 0;
-        if (!(iss >> tag >> peer_tcp_port)) continue;
-
-        std::string rest;
-        std::getline(iss, rest);
-        rest = ltrim(rest); // removes leading spaces
-
         std::string ip = inet_ntoa(src.sin_addr);
-
-        PeerInfo peer;
-        peer.addr = ip;
-        peer.port = peer_tcp_port;
-
-        // parse files: "name:size,name2:size2,..." (maybe trailing comma)
-        if (!rest.empty()) {
-            // split by comma
-            auto items = split(rest, ',');
-            for (auto &item : items) {
-                if (item.empty()) continue;
-                auto kv = split(item, ':');
-                if (kv.size() != 2) continue;
-                std::string fname = kv[0];
-                std::string ssize = kv[1];
-                try {
-                    uint64_t fsize = std::stoull(ssize);
-                    peer.files[fname] = fsize;
-                } catch (...) {
-                    // ignore bad size parse
-                }
+        Announce a;
+        Query q;
+        PeerInfo legacy;
+        if (decode_query(buf, (size_t)n, q)) {
+            if (q.peer_id == peer_id_) continue;    // our own query
+            metrics().queries_received.add();
+            // answer the asker directly, not the whole segment, and not more
+            // than a few times a second: the source may be forged
+            std::string reply = announce_message(&q.name);
+            if (reply.empty()) continue;
+            auto slot = replied.find(src.sin_addr.s_addr);
+            bool allowed = slot != replied.end() ? slot->second < QUERY_REPLIES_PER_SEC
+                                                 : replied.size() < MAX_QUERY_SOURCES;
+            if (!allowed) {
+                metrics().queries_limited.add();
+                continue;
             }
-        }
-
-        {
-            std::lock_guard<std::mutex> lock(peers_mutex_);
-            bool found = false;
-            for (auto &existing : peers_) {
-                if (existing.addr == peer.addr && existing.port == peer.port) {
-                    existing.files = peer.files;
-                    found = true;
-                    break;
-                }
+            replied[src.sin_addr.s_addr]++;
+            if (sendto(sock, reply.data(), reply.size(), 0, (sockaddr*)&src, len) > 0) {
+                metrics().queries_answered.add();
             }
-            if (!found) peers_.push_back(peer);
+        } else if (decode_announce(buf, (size_t)n, a)) {
+            if (a.peer_id == peer_id_) continue;    // our own broadcast
+            metrics().announces_received.add();
+            peers_.announce(ip, a);
+        } else if (parse_legacy_announce(buf, legacy)) {
+            metrics().announces_legacy.add();
+            peers_.announce_legacy(ip, std::move(legacy));
+        } else {
+            metrics().announces_rejected.add();
         }
     }
     close(sock);
 }
-
-
-// ---------------------------------------------------------------
-// TCP Server (File Sender)
-// ---------------------------------------------------------------
-void Network::tcp_server_worker(const std::string& shared_folder) {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        std::cerr << "[tcp_server] socket create failed\n";
-        return;
-    }
-
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        // not fatal
-    }
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(service_port_);
-
-    if (bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
-        std::cerr << "[tcp_server] bind failed\n";
-        close(server_fd);
-        return;
-    }
-
-    if (listen(server_fd, 10) < 0) {
-        std::cerr << "[tcp_server] listen failed\n";
-        close(server_fd);
-        return;
-    }
-
-    std::cout << "[tcp_server] listening on port " << service_port_ << "\n";
-
-    while (running_) {
-        sockaddr_in client{};
-        socklen_t len = sizeof(client);
-        int cfd = accept(server_fd, (sockaddr*)&client, &len);
-        if (cfd < 0) {
-            // accept can be interrupted by signals; continue
-            continue;
-        }
-
-        // handle each client in detached thread
-        std::thread([cfd, shared_folder]() {
-            // Read a full line request (ends with '\n')
-            std::string req;
-            char ch;
-            ssize_t r;
-            // read until newline or buffer full
-            while (true) {
-                r = recv(cfd, &ch, 1, 0);
-                if (r <= 0) { close(cfd); return; }
-                req.push_back(ch);
-                if (ch == '\n') break;
-                if (req.size() > 4096) { close(cfd); return; }
-            }
-
-            // tokenize by whitespace robustly
-            std::istringstream iss(req);
-            std::string cmd;
-            if (!(iss >> cmd)) { close(cfd); return; }
-            if (cmd != "GET") { close(cfd); return; }
-
-            std::string filename;
-            uint64_t start = 0, end = 0;
-            if (!(iss >> filename >> start >> end)) {
-                // If client didn't send start/end, treat as entire file request
-                // Reset stream and try parsing filename only
-                iss.clear();
-                iss.str(req);
-                // re-extract
-                iss >> cmd >> filename;
-                // leave start=0; end=0 means send full file
-            }
-
-            std::string path = shared_folder + "/" + filename;
-            if (!fs::exists(path)) {
-                std::string err = "ERR nofile\n";
-                send(cfd, err.c_str(), (size_t)err.size(), 0);
-                close(cfd);
-                return;
-            }
-
-            uint64_t fsize = 0;
-            try { fsize = fs::file_size(path); } catch(...) { fsize = 0; }
-
-            if (end == 0 || end > fsize) end = fsize;
-            if (start >= end) { close(cfd); return; }
-
-            uint64_t tosend = end - start;
-            std::ifstream ifs(path, std::ios::binary);
-            if (!ifs) { close(cfd); return; }
-            ifs.seekg((std::streampos)start);
-
-            // send header
-            std::ostringstream hdr;
-            hdr << "OK " << tosend << "\n";
-            std::string hdrs = hdr.str();
-            send(cfd, hdrs.c_str(), hdrs.size(), 0);
-
-            const size_t bufsize = 64 * 1024;
-            std::vector<char> buffer(bufsize);
-            uint64_t sent = 0;
-            while (sent < tosend && ifs) {
-                size_t want = (size_t)std::min<uint64_t>(bufsize, tosend - sent);
-                ifs.read(buffer.data(), want);
-                size_t got = (size_t)ifs.gcount();
-                if (got == 0) break;
-                ssize_t s = send(cfd, buffer.data(), got, 0);
-                if (s <= 0) break;
-                sent += (uint64_t)s;
-            }
-            close(cfd);
-        }).detach();
-    }
-
-    close(server_fd);
-}
\ No newline at end of file
@@ -0,0 +1,241 @@
+#include "p2p.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <algorithm>
+
+#include <fnmatch.h>
+
+// ---------------------------------------------------------------
+// Name resolution
+// ---------------------------------------------------------------
+bool is_glob(const std::string& pattern) {
+    return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+bool read_name_list(const std::string& path, std::vector<std::string>& out) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t b = line.find_first_not_of(" \t\r");
+        if (b == std::string::npos || line[b] == '#') continue;
+        size_t e = line.find_last_not_of(" \t\r");
+        out.push_back(line.substr(b, e - b + 1));
+    }
+    return true;
+}
+
+std::vector<std::string> resolve_names(const PeerList& peers, const std::vector<std::string>& patterns,
+                                       std::vector<std::string> *unmatched) {
+    std::set<std::string> offered;
+    for (auto &p : peers) {
+        for (auto &kv : p->files) offered.insert(kv.first);
+        for (auto &kv : p->partial) offered.insert(kv.first);
+    }
+    std::vector<std::string> out;
+    std::set<std::string> seen;
+    for (auto &pat : patterns) {
+        size_t before = out.size();
+        auto take = [&](const std::string &name) { if (seen.insert(name).second) out.push_back(name); };
+        if (is_glob(pat)) {
+            for (auto &name : offered) {
+                if (fnmatch(pat.c_str(), name.c_str(), 0) == 0) take(name);
+            }
+        } else if (offered.count(pat)) {
+            take(pat);
+        } else {
+            std::string dir = pat.back() == '/' ? pat : pat + "/";
+            for (auto it = offered.lower_bound(dir); it != offered.end() && it->rfind(dir, 0) == 0; ++it) take(*it);
+        }
+        if (out.size() == before && !seen.count(pat) && unmatched) unmatched->push_back(pat);
+    }
+    return out;
+}
+
+
+// ---------------------------------------------------------------
+// Download handle
+// ---------------------------------------------------------------
+DownloadHandle::~DownloadHandle() {
+    cancel_ = true;
+    if (!thread_.joinable()) return;
+    // A callback held the last reference, so this runs on the download
+    // thread itself, which is finishing and no longer uses the handle.
+    if (thread_.get_id() == std::this_thread::get_id()) thread_.detach();
+    else thread_.join();
+}
+
+bool DownloadHandle::done() const {
+    return result_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+TransferProgress DownloadHandle::progress() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return progress_;
+}
+
+
+// ---------------------------------------------------------------
+// Client
+// ---------------------------------------------------------------
+P2PClient::P2PClient(int port, bool seed)
+    : port_(port), seed_(seed), net_(std::make_unique<Network>(port)) {}
+
+P2PClient::~P2PClient() = default;
+
+void P2PClient::start_listening() {
+    std::call_once(listening_, [&] { net_->start_listen_peers(); });
+}
+
+std::shared_ptr<PartialFiles> P2PClient::start_seeding() {
+    std::call_once(seeding_, [&] {
+        if (!seed_) return;
+        // one reactor is plenty for passing pieces on. The port must be
+        // free: sharing it with a `p2p share` on this host would hand half
+        // of that seeder's connections to a server that has next to nothing.
+        ServerConfig cfg;
+        cfg.reactors = 1;
+        cfg.exclusive_port = true;
+        cfg.report_interval = 0;
+        cfg.compression = false;
+        auto partials = std::make_shared<PartialFiles>();
+        if (net_->seed_partials(partials, cfg)) partials_ = partials;
+        else std::cout << "Port " << port_ << " is busy; downloading without seeding\n";
+    });
+    return partials_;
+}
+
+PeerList P2PClient::discover(const std::string& filename, std::chrono::milliseconds timeout, int min_sources,
+                             std::chrono::milliseconds grace) {
+    start_listening();
+    return net_->query_peers(filename, min_sources, timeout, grace);
+}
+
+std::shared_ptr<DownloadHandle> P2PClient::download(DownloadRequest req) {
+    std::shared_ptr<DownloadHandle> h(new DownloadHandle());
+    auto promise = std::make_shared<std::promise<DownloadResult>>();
+    h->result_ = promise->get_future().share();
+    DownloadHandle *raw = h.get();
+    // the thread only touches the handle, which joins it before going away
+    h->thread_ = std::thread([this, raw, promise, req = std::move(req)]() mutable {
+        DownloadResult r = run(req, *raw);
+        if (req.on_complete) req.on_complete(r);
+        promise->set_value(std::move(r));
+        // callbacks that capture the handle go now, while it is still safe
+        // for the destructor to run here (it detaches)
+        req = DownloadRequest();
+    });
+    return h;
+}
+
+DownloadResult P2PClient::run(DownloadRequest &req, DownloadHandle &handle) {
+    using clock = std::chrono::steady_clock;
+    DownloadResult result;
+    DownloadOptions opts = req.options;
+    opts.started = clock::now();
+    opts.cancel = &handle.cancel_;
+
+    // One query for the whole request: a single plain name waits for its
+    // holders, anything else (globs, "dir/") for every peer on the segment.
+    bool single = req.names.size() == 1 && !req.names[0].empty() && !is_glob(req.names[0]) &&
+                  req.names[0].back() != '/';
+    auto timeout = std::chrono::milliseconds(std::max(0, req.discover_ms));
+    PeerList peers = single ? discover(req.names[0], timeout, req.min_sources)
+                            : discover("", timeout, req.min_sources, std::chrono::milliseconds(250));
+    result.discovery_ms = std::chrono::duration<double, std::milli>(clock::now() - opts.started).count();
+    result.peers = peers.size();
+
+    uint64_t total = 0;
+    for (auto &name : resolve_names(peers, req.names, &result.unmatched)) {
+        FileRequest f;
+        f.filename = name;
+        f.sources = find_sources(peers, name, f.size);
+        // peers known to be fast first
+        for (auto &src : f.sources) src.stats = net_->peer_stats(src.host, src.port);
+        std::stable_sort(f.sources.begin(), f.sources.end(), [](const Source &a, const Source &b) {
+            return a.stats.bytes_per_sec > b.stats.bytes_per_sec;
+        });
+        total += f.size;
+        result.files.push_back(std::move(f));
+    }
+    {
+        std::lock_guard<std::mutex> lock(handle.mu_);
+        handle.progress_.bytes_total = total;
+    }
+    if (req.on_resolved) req.on_resolved(result);
+    if (result.files.empty()) {
+        result.error = "no peer has the requested files";
+        return result;
+    }
+    if (handle.cancel_) {
+        result.cancelled = true;
+        return result;
+    }
+
+    opts.seed = start_seeding();
+    // the downloader reports every 250 ms; pass on one per progress_ms, with
+    // the rate over that interval
+    auto last = clock::now();
+    uint64_t last_bytes = 0;
+    bool first = true;
+    auto publish = [&](uint64_t done, uint64_t total_bytes, bool final) {
+        auto now = clock::now();
+        if (first) {
+            last_bytes = done;      // resumed and reused bytes aren't throughput
+            first = false;
+        }
+        double dt = std::chrono::duration<double>(now - last).count();
+        bool due = final || dt * 1000.0 >= req.progress_ms;
+        TransferProgress p;
+        {
+            std::lock_guard<std::mutex> lock(handle.mu_);
+            p = handle.progress_;
+            p.bytes_done = done;
+            p.bytes_total = total_bytes;
+            p.seconds = std::chrono::duration<double>(now - opts.started).count();
+            if (due && dt > 0) {
+                p.bytes_per_sec = (double)(done - last_bytes) / dt;
+                last = now;
+                last_bytes = done;
+            }
+            handle.progress_ = p;
+        }
+        if (due && req.on_progress) req.on_progress(p);
+    };
+    opts.on_progress = [&](uint64_t done, uint64_t total_bytes) { publish(done, total_bytes, false); };
+
+    result.ok = download_files(result.files, opts, &result.report);
+    result.cancelled = result.report.cancelled;
+    TransferProgress end = handle.progress();
+    publish(end.bytes_done, end.bytes_total, true);
+    for (auto &src : result.report.sources) net_->record_peer_stats(src.host, src.port, src.stats);
+    return result;
+}
+
+
+// ---------------------------------------------------------------
+// Seeder
+// ---------------------------------------------------------------
+P2PSeeder::P2PSeeder(int port) : port_(port) {}
+
+P2PSeeder::~P2PSeeder() {
+    stop();
+}
+
+bool P2PSeeder::start(const std::string& folder, const ServerConfig& cfg, bool recursive) {
+    if (net_) return false;
+    auto net = std::make_unique<Network>(port_);
+    if (!net->share(folder, recursive)) return false;
+    net->start_broadcast(folder);
+    net->start_listen_peers();
+    if (!net->start_tcp_server(folder, cfg)) return false;
+    net_ = std::move(net);
+    return true;
+}
+
+void P2PSeeder::stop() {
+    // the Network's destructor stops its threads and the file server
+    net_.reset();
+}
@@ -0,0 +1,206 @@
+#include "peer_table.hpp"
+
+const PeerList& PeerSnapshot::holders(const std::string& filename) const {
+    static const PeerList none;
+    auto it = by_file.find(filename);
+    return it == by_file.end() ? none : it->second;
+}
+
+
+PeerTable::PeerTable(std::chrono::seconds ttl, Clock clock) : ttl_(ttl), clock_(std::move(clock)) {}
+
+std::string PeerTable::key(const std::string& addr, int port) {
+    return addr + ":" + std::to_string(port);
+}
+
+PeerTable::Record& PeerTable::touch(const std::string& addr, int port) {
+    // caller holds mu_
+    Record &r = peers_[key(addr, port)];
+    r.ep = {addr, port};
+    r.last_seen = now();
+    return r;
+}
+
+void PeerTable::announce(const std::string& addr, const Announce& a) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Record &r = touch(addr, a.port);
+    if (r.info && r.announce.peer_id != a.peer_id) {
+        // restarted: its old list says nothing about what it shares now
+        r.info.reset();
+        dirty_ = true;
+    }
+    // a query reply has no Bloom filter: keep the last broadcast's while it
+    // describes the same catalog
+    if (a.bloom.empty() && r.announce.peer_id == a.peer_id && r.announce.digest == a.digest) {
+        std::vector<uint8_t> bloom = std::move(r.announce.bloom);
+        uint8_t k = r.announce.bloom_k;
+        r.announce = a;
+        r.announce.bloom = std::move(bloom);
+        r.announce.bloom_k = k;
+    } else {
+        r.announce = a;
+    }
+    if (a.file_count == 0 && (!r.info || !r.info->files.empty() || !r.info->partial.empty())) {
+        // nothing to fetch
+        auto info = std::make_shared<PeerInfo>();
+        info->addr = addr;
+        info->port = a.port;
+        r.info = std::move(info);
+        r.digest = a.digest;
+        dirty_ = true;
+    }
+}
+
+void PeerTable::announce_legacy(const std::string& addr, PeerInfo info) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Record &r = touch(addr, info.port);
+    r.announce = Announce{};
+    r.digest = 0;
+    if (r.info && r.info->files == info.files) return;
+    info.addr = addr;
+    r.info = std::make_shared<const PeerInfo>(std::move(info));
+    dirty_ = true;
+}
+
+size_t PeerTable::expire() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return expire_locked(now());
+}
+
+size_t PeerTable::size() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return peers_.size();
+}
+
+size_t PeerTable::expire_locked(std::chrono::steady_clock::time_point now) {
+    size_t n = 0;
+    for (auto it = peers_.begin(); it != peers_.end();) {
+        if (now - it->second.last_seen > ttl_) {
+            if (it->second.info) dirty_ = true;
+            it = peers_.erase(it);
+            n++;
+        } else {
+            ++it;
+        }
+    }
+    return n;
+}
+
+std::vector<PeerTable::Endpoint> PeerTable::stale_catalogs(const std::string *filename, std::chrono::seconds retry) {
+    std::vector<Endpoint> out;
+    auto t = now();
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto &kv : peers_) {
+        Record &r = kv.second;
+        if (r.info && r.digest == r.announce.digest) continue;
+        if (filename && !bloom_may_contain(r.announce, *filename)) continue;
+        if (t - r.last_fetch < retry) continue;
+        r.last_fetch = t;
+        out.push_back(r.ep);
+    }
+    return out;
+}
+
+void PeerTable::catalog_fetched(const Endpoint& ep, std::map<std::string, uint64_t> files, uint64_t digest,
+                                std::map<std::string, uint64_t> partial) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = peers_.find(key(ep.addr, ep.port));
+    if (it == peers_.end()) return;   // expired meanwhile
+    auto info = std::make_shared<PeerInfo>();
+    info->addr = ep.addr;
+    info->port = ep.port;
+    info->files = std::move(files);
+    info->partial = std::move(partial);
+    // the catalog may already be newer than the announce we have
+    it->second.info = std::move(info);
+    it->second.digest = digest;
+    it->second.last_fetch = {};
+    dirty_ = true;
+}
+
+std::shared_ptr<const PeerSnapshot> PeerTable::snapshot() {
+    std::lock_guard<std::mutex> lock(mu_);
+    expire_locked(now());
+    if (!dirty_ && published_) return published_;
+
+    auto snap = std::make_shared<PeerSnapshot>();
+    for (auto &kv : peers_) {
+        if (!kv.second.info) continue;
+        snap->peers.push_back(kv.second.info);
+        for (auto &f : kv.second.info->files) snap->by_file[f.first].push_back(kv.second.info);
+        for (auto &f : kv.second.info->partial) snap->by_file[f.first].push_back(kv.second.info);
+    }
+    published_ = std::move(snap);
+    dirty_ = false;
+    return published_;
+}
+
+// Heap bytes behind a string; short ones live inside it.
+static size_t heap_bytes(const std::string& s) {
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+size_t PeerTable::memory_bytes() {
+    constexpr size_t MAP_NODE = 4 * sizeof(void*);     // tree links and colour
+    constexpr size_t HASH_NODE = sizeof(void*) + sizeof(size_t);   // next link, cached hash
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t n = peers_.bucket_count() * sizeof(void*);
+    auto names = [&](const std::map<std::string, uint64_t>& m) {
+        for (auto &kv : m) n += MAP_NODE + sizeof(kv) + heap_bytes(kv.first);
+    };
+    for (auto &kv : peers_) {
+        const Record &r = kv.second;
+        n += HASH_NODE + sizeof(kv) + heap_bytes(kv.first) + heap_bytes(r.ep.addr) + r.announce.bloom.capacity();
+        if (!r.info) continue;
+        n += sizeof(PeerInfo) + heap_bytes(r.info->addr);
+        names(r.info->files);
+        names(r.info->partial);
+    }
+    if (published_) {
+        n += sizeof(PeerSnapshot) + published_->peers.capacity() * sizeof(PeerList::value_type) +
+             published_->by_file.bucket_count() * sizeof(void*);
+        for (auto &kv : published_->by_file) {
+            n += HASH_NODE + sizeof(kv) + heap_bytes(kv.first) + kv.second.capacity() * sizeof(PeerList::value_type);
+        }
+    }
+    return n;
+}
+
+PeerList PeerTable::holders(const std::string& filename) {
+    auto snap = snapshot();
+    PeerList out;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto &p : snap->holders(filename)) {
+        auto it = peers_.find(key(p->addr, p->port));
+        // a stale list may still name a file the newer Bloom filter rules out
+        if (it != peers_.end() && bloom_may_contain(it->second.announce, filename)) out.push_back(p);
+    }
+    return out;
+}
+
+
+// ---------------------------------------------------------------
+// Telemetry
+// ---------------------------------------------------------------
+static void smooth(double &avg, double sample) {
+    if (sample <= 0) return;
+    avg = avg > 0 ? 0.7 * avg + 0.3 * sample : sample;
+}
+
+void PeerTable::record_rate(const std::string& addr, int port, double bytes_per_sec) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = peers_.find(key(addr, port));
+    if (it != peers_.end()) smooth(it->second.stats.bytes_per_sec, bytes_per_sec);
+}
+
+void PeerTable::record_rtt(const std::string& addr, int port, double rtt_ms) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = peers_.find(key(addr, port));
+    if (it != peers_.end()) smooth(it->second.stats.rtt_ms, rtt_ms);
+}
+
+PeerStats PeerTable::stats(const std::string& addr, int port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = peers_.find(key(addr, port));
+    return it == peers_.end() ? PeerStats{} : it->second.stats;
+}
@@ -0,0 +1,38 @@
+#include "protocol.hpp"
+
+#include <charconv>
+
+bool split_fields(std::string_view line, LineFields& out) {
+    out.n = 0;
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+
+    size_t i = 0;
+    while (i < line.size()) {
+        while (i < line.size() && line[i] == ' ') ++i;
+        if (i == line.size()) break;
+        size_t j = line.find(' ', i);
+        if (j == std::string_view::npos) j = line.size();
+        if (out.n == LineFields::MAX) return false;
+        out.f[out.n++] = line.substr(i, j - i);
+        i = j;
+    }
+    return true;
+}
+
+bool parse_u64(std::string_view s, uint64_t& out) {
+    if (s.empty()) return false;
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+bool parse_u32(std::string_view s, uint32_t& out) {
+    if (s.empty()) return false;
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+void append_u64(std::string& out, uint64_t v) {
+    char buf[20];
+    auto r = std::to_chars(buf, buf + sizeof(buf), v);
+    out.append(buf, (size_t)(r.ptr - buf));
+}
@@ -0,0 +1,94 @@
+#include "resume.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+ResumeState::ResumeState(const std::string& target, uint64_t size, uint64_t piece_size,
+                         std::chrono::milliseconds flush_interval)
+    : path_(target + ".p2pstate"), size_(size), piece_size_(piece_size),
+      count_(piece_size ? (size_t)((size + piece_size - 1) / piece_size) : 0),
+      bits_((count_ + 7) / 8, 0), flush_interval_(flush_interval),
+      last_flush_(std::chrono::steady_clock::now()) {}
+
+uint64_t ResumeState::stored_piece_size(const std::string& target, uint64_t size) {
+    std::ifstream in(target + ".p2pstate", std::ios::binary);
+    std::string tag;
+    int version = 0;
+    uint64_t stored = 0, piece_size = 0;
+    if (!(in >> tag >> version >> stored >> piece_size)) return 0;
+    if (tag != "P2PSTATE" || version != 1 || stored != size) return 0;
+    return piece_size;
+}
+
+bool ResumeState::load() {
+    std::ifstream in(path_, std::ios::binary);
+    if (!in) return false;
+
+    std::string header;
+    if (!std::getline(in, header)) return false;
+    std::istringstream iss(header);
+    std::string tag;
+    int version = 0;
+    uint64_t size = 0, piece_size = 0;
+    size_t count = 0;
+    if (!(iss >> tag >> version >> size >> piece_size >> count)) return false;
+    if (tag != "P2PSTATE" || version != 1) return false;
+    if (size != size_ || piece_size != piece_size_ || count != count_) return false;
+
+    std::vector<uint8_t> bits(bits_.size());
+    if (!bits.empty() && !in.read((char*)bits.data(), (std::streamsize)bits.size())) return false;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    bits_ = std::move(bits);
+    return true;
+}
+
+bool ResumeState::has(size_t index) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return index < count_ && (bits_[index / 8] >> (index % 8)) & 1;
+}
+
+size_t ResumeState::done_count() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t n = 0;
+    for (uint8_t b : bits_) n += (size_t)__builtin_popcount(b);
+    return n;
+}
+
+void ResumeState::mark(size_t index) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (index >= count_) return;
+    bits_[index / 8] |= (uint8_t)(1u << (index % 8));
+    if (std::chrono::steady_clock::now() - last_flush_ >= flush_interval_) flush_locked();
+}
+
+void ResumeState::unmark(size_t index) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (index >= count_) return;
+    bits_[index / 8] &= (uint8_t)~(1u << (index % 8));
+}
+
+bool ResumeState::flush() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return flush_locked();
+}
+
+bool ResumeState::flush_locked() {
+    last_flush_ = std::chrono::steady_clock::now();
+    // write-then-rename so a crash mid-write never leaves a torn bitmap
+    std::string tmp = path_ + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out << "P2PSTATE 1 " << size_ << " " << piece_size_ << " " << count_ << "\n";
+        out.write((const char*)bits_.data(), (std::streamsize)bits_.size());
+        if (!out) return false;
+    }
+    return std::rename(tmp.c_str(), path_.c_str()) == 0;
+}
+
+void ResumeState::remove() {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::remove(path_.c_str());
+}
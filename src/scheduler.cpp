@@ -0,0 +1,353 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <chrono>
+
+PieceScheduler::PieceScheduler(uint64_t size, uint64_t piece_size, int workers,
+                               int max_attempts, int endgame_copies)
+    : size_(size), piece_size_(std::max<uint64_t>(1, piece_size)),
+      max_attempts_(std::max(1, max_attempts)), endgame_copies_(std::max(1, endgame_copies)) {
+    size_t n = (size_t)((size_ + piece_size_ - 1) / piece_size_);
+    pieces_.resize(n);
+    done_.reset(new std::atomic<bool>[n]);
+    for (size_t i = 0; i < n; ++i) done_[i] = false;
+    remaining_ = n;
+    free_.reset(n);
+    dup_.reset(n);
+
+    // contiguous runs per worker keep each connection reading sequentially
+    workers = std::max(1, workers);
+    queues_.resize(workers);
+    for (size_t i = 0; i < n; ++i) {
+        queues_[i * workers / n].push_back((int)i);
+    }
+}
+
+// ---------------------------------------------------------------
+// Buckets
+// ---------------------------------------------------------------
+void PieceScheduler::Buckets::reset(size_t pieces) {
+    lists_.clear();
+    bucket_.assign(pieces, -1);
+    pos_.assign(pieces, 0);
+    size_ = 0;
+}
+
+void PieceScheduler::Buckets::insert(int index, uint32_t count) {
+    if (lists_.size() <= count) lists_.resize(count + 1);
+    pos_[index] = (uint32_t)lists_[count].size();
+    lists_[count].push_back((uint32_t)index);
+    bucket_[index] = (int32_t)count;
+    size_++;
+}
+
+void PieceScheduler::Buckets::erase(int index) {
+    if (bucket_[index] < 0) return;
+    auto &list = lists_[bucket_[index]];
+    uint32_t last = list.back();
+    list[pos_[index]] = last;
+    pos_[last] = pos_[index];
+    list.pop_back();
+    bucket_[index] = -1;
+    size_--;
+}
+
+int PieceScheduler::Buckets::first(const std::vector<bool> *have) const {
+    for (auto &list : lists_) {
+        // from the back: the initial order is the random tie-break order
+        for (size_t k = list.size(); k-- > 0;) {
+            uint32_t i = list[k];
+            if (!have || (i < have->size() && (*have)[i])) return (int)i;
+        }
+    }
+    return -1;
+}
+
+
+// ---------------------------------------------------------------
+// Pieces
+// ---------------------------------------------------------------
+void PieceScheduler::unlist(int index) {
+    free_.erase(index);
+    dup_.erase(index);
+}
+
+void PieceScheduler::list(int index) {
+    const PieceState &st = pieces_[index];
+    if (st.done) return;
+    if (st.inflight == 0) {
+        if (rarest_) free_.insert(index, holders_[index]);
+    } else if (st.inflight < endgame_copies_) {
+        dup_.insert(index, (uint32_t)st.inflight);
+    }
+}
+
+bool PieceScheduler::take(int index, Piece &out) {
+    PieceState &st = pieces_[index];
+    if (st.done) return false;
+    unlist(index);
+    st.inflight++;
+    list(index);
+    out.index = index;
+    out.start = (uint64_t)index * piece_size_;
+    out.end = std::min(size_, out.start + piece_size_);
+    return true;
+}
+
+// Free piece (not done, nobody on it) with the fewest holders among those in
+// `have`; -1 if there is none. `any_free` tells whether any piece at all is
+// free, i.e. whether it is too early for the endgame.
+int PieceScheduler::pick_rarest(const std::vector<bool> *have, bool &any_free) const {
+    any_free = !free_.empty();
+    return free_.first(have);
+}
+
+// The least-covered piece still in flight, for an endgame duplicate.
+int PieceScheduler::pick_endgame(const std::vector<bool> *have) const {
+    return dup_.first(have);
+}
+
+bool PieceScheduler::next(int worker, Piece &out, bool wait, const std::vector<bool> *have, bool endgame) {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto &own = queues_[worker % queues_.size()];
+
+    while (true) {
+        if (aborted_ || remaining_ == 0) return false;
+
+        if (rarest_) {
+            bool any_free = false;
+            int i = pick_rarest(have, any_free);
+            if (i >= 0 && take(i, out)) return true;
+            if (!any_free && endgame) {
+                i = pick_endgame(have);
+                if (i >= 0 && take(i, out)) { endgame_++; return true; }
+            }
+            if (!wait) return false;
+            cv_.wait(lock);
+            continue;
+        }
+
+        while (!retry_.empty()) {
+            int i = retry_.front();
+            retry_.pop_front();
+            if (take(i, out)) return true;
+        }
+
+        while (!own.empty()) {
+            int i = own.front();
+            own.pop_front();
+            if (take(i, out)) return true;
+        }
+
+        // steal from the back of the fullest deque
+        auto victim = std::max_element(queues_.begin(), queues_.end(),
+                                       [](auto &a, auto &b) { return a.size() < b.size(); });
+        bool stole = false;
+        while (!victim->empty()) {
+            int i = victim->back();
+            victim->pop_back();
+            if (take(i, out)) { stole = true; break; }
+        }
+        if (stole) { steals_++; return true; }
+        if (std::any_of(queues_.begin(), queues_.end(), [](auto &q) { return !q.empty(); })) {
+            continue;
+        }
+
+        // endgame: duplicate the least-covered piece still in flight
+        int best = endgame ? pick_endgame(nullptr) : -1;
+        if (best >= 0 && take(best, out)) { endgame_++; return true; }
+
+        if (!wait) return false;
+        cv_.wait(lock);
+    }
+}
+
+bool PieceScheduler::complete(const Piece &p) {
+    std::lock_guard<std::mutex> lock(mu_);
+    PieceState &st = pieces_[p.index];
+    if (st.done) {
+        st.inflight--;
+        return false;
+    }
+    unlist(p.index);
+    st.inflight--;
+    st.done = true;
+    done_[p.index].store(true, std::memory_order_release);
+    remaining_--;
+    cv_.notify_all();
+    return true;
+}
+
+void PieceScheduler::fail(const Piece &p, bool count_attempt) {
+    std::lock_guard<std::mutex> lock(mu_);
+    PieceState &st = pieces_[p.index];
+    if (st.done) {
+        st.inflight--;
+        return;
+    }
+    unlist(p.index);
+    st.inflight--;
+    list(p.index);
+    if (count_attempt && ++st.attempts >= max_attempts_) {
+        aborted_ = true;
+    } else if (st.inflight == 0 && !rarest_) {
+        // no duplicate still working on it: queue it for another try
+        // (rarest-first finds it again by itself)
+        retry_.push_back(p.index);
+    }
+    cv_.notify_all();
+}
+
+void PieceScheduler::mark_done(int index) {
+    std::lock_guard<std::mutex> lock(mu_);
+    PieceState &st = pieces_[index];
+    if (st.done) return;
+    // stays in its queue; take() skips done pieces
+    unlist(index);
+    st.done = true;
+    done_[index].store(true, std::memory_order_release);
+    remaining_--;
+    cv_.notify_all();
+}
+
+void PieceScheduler::set_rarest_first() {
+    set_rarest_first(std::random_device{}());
+}
+
+void PieceScheduler::set_rarest_first(uint64_t seed) {
+    std::lock_guard<std::mutex> lock(mu_);
+    rarest_ = true;
+    holders_.assign(pieces_.size(), 0);
+    std::vector<int> order(pieces_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937_64 rng(seed);
+    std::shuffle(order.begin(), order.end(), rng);
+    // Buckets::first() takes from the back: the shuffle is the tie-break order
+    for (size_t k = order.size(); k-- > 0;) {
+        unlist(order[k]);
+        list(order[k]);
+    }
+}
+
+void PieceScheduler::add_holder(const std::vector<bool> *have) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!rarest_ || !have) return;
+    for (size_t i = 0; i < holders_.size() && i < have->size(); ++i) {
+        if (!(*have)[i]) continue;
+        unlist((int)i);
+        holders_[i]++;
+        list((int)i);
+    }
+}
+
+void PieceScheduler::update_holder(const std::vector<bool> &before, const std::vector<bool> &after) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!rarest_) return;
+    bool grew = false;
+    for (size_t i = 0; i < holders_.size() && i < after.size(); ++i) {
+        bool had = i < before.size() && before[i];
+        if (after[i] == had || (!after[i] && holders_[i] == 0)) continue;
+        unlist((int)i);
+        if (after[i]) { holders_[i]++; grew = true; }
+        else holders_[i]--;
+        list((int)i);
+    }
+    if (grew) cv_.notify_all();
+}
+
+void PieceScheduler::abort() {
+    std::lock_guard<std::mutex> lock(mu_);
+    aborted_ = true;
+    cv_.notify_all();
+}
+
+bool PieceScheduler::finished() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return remaining_ == 0;
+}
+
+bool PieceScheduler::aborted() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return aborted_;
+}
+
+uint64_t PieceScheduler::steals() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return steals_;
+}
+
+uint64_t PieceScheduler::endgame_requests() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return endgame_;
+}
+
+
+// ---------------------------------------------------------------
+// Batches
+// ---------------------------------------------------------------
+size_t BatchScheduler::add(std::unique_ptr<PieceScheduler> file) {
+    size_t i = files_.size();
+    auto pos = std::upper_bound(order_.begin(), order_.end(), file->size(),
+                                [&](uint64_t size, size_t k) { return size < files_[k]->size(); });
+    files_.push_back(std::move(file));
+    order_.insert(pos, i);
+    return i;
+}
+
+BatchScheduler::Pick BatchScheduler::next(int worker, BatchPiece &out, const Usable &usable) {
+    bool busy = false;
+    size_t n = order_.size();
+    bool from_large = turn_.fetch_add(1, std::memory_order_relaxed) & 1;
+    // fresh pieces from any file first, endgame duplicates only after that
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = order_[from_large ? n - 1 - k : k];
+            PieceScheduler &f = *files_[i];
+            const std::vector<bool> *have = nullptr;
+            if (settled(i) || !usable(i, have)) continue;
+            busy = true;
+            if (f.next(worker, out.piece, false, have, pass == 1)) {
+                out.file = i;
+                return Pick::Got;
+            }
+        }
+    }
+    return busy ? Pick::Busy : Pick::Empty;
+}
+
+bool BatchScheduler::complete(const BatchPiece &p) {
+    bool won = files_[p.file]->complete(p.piece);
+    std::lock_guard<std::mutex> lock(mu_);
+    cv_.notify_all();
+    return won;
+}
+
+void BatchScheduler::fail(const BatchPiece &p, bool count_attempt) {
+    files_[p.file]->fail(p.piece, count_attempt);
+    std::lock_guard<std::mutex> lock(mu_);
+    cv_.notify_all();
+}
+
+void BatchScheduler::wait(int ms) {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait_for(lock, std::chrono::milliseconds(ms));
+}
+
+void BatchScheduler::abort() {
+    for (auto &f : files_) f->abort();
+    std::lock_guard<std::mutex> lock(mu_);
+    cv_.notify_all();
+}
+
+bool BatchScheduler::settled(size_t i) {
+    return files_[i]->finished() || files_[i]->aborted();
+}
+
+bool BatchScheduler::finished() {
+    for (size_t i = 0; i < files_.size(); ++i) {
+        if (!settled(i)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,1051 @@
+#include "server.hpp"
+#include "protocol.hpp"
+#include "shaper.hpp"
+#include "compress.hpp"
+#include "filecache.hpp"
+#include "bufpool.hpp"
+#include "metrics.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t MAX_REQUEST_LINE = 4096;
+constexpr size_t READ_CHUNK = 4096;
+constexpr size_t BODY_BUFFER = 64 * 1024;
+// Bytes pushed to one connection per wakeup, so a single fast reader can't
+// monopolise its reactor.
+constexpr size_t WRITE_BUDGET = 1024 * 1024;
+// Persistent (v2) connections with no traffic for this long are closed.
+constexpr int IDLE_TIMEOUT_SECS = 120;
+// A buffered body that can't get a pooled buffer (memory budget exhausted)
+// tries again after this long.
+constexpr int BUFFER_RETRY_MS = 5;
+
+enum class ConnState { ReadRequest, WriteResponse };
+// Throttled: out of rate-limit tokens or pooled buffers; retry at Connection::retry_at.
+enum class IoResult { Done, Pending, Closed, Throttled };
+
+struct Connection {
+    int fd = -1;
+    uint64_t serial = 0;        // tells a connection from a later one reusing its fd
+    ConnState state = ConnState::ReadRequest;
+    int version = 1;            // 2 once the client sent HELLO
+    bool close_after = true;    // drop the connection once the response is out
+    uint32_t events = 0;        // current epoll interest set
+    std::chrono::steady_clock::time_point last_active;
+
+    std::string in;             // request bytes received so far
+    size_t in_off = 0;          // start of the next unhandled request in `in`
+    size_t in_scan = 0;         // bytes of `in` already searched for '\n'
+    std::string out;            // response header still to send
+    size_t out_off = 0;
+
+    std::shared_ptr<const OpenFile> file;   // body source, null if header-only response
+    int file_fd = -1;           // file->fd
+    uint64_t file_off = 0;      // next file offset to read
+    uint64_t file_left = 0;     // body bytes not yet read from the file
+
+    SendMode mode = SendMode::Buffered;
+
+    PooledBuffer buf;           // buffered mode: body staging buffer, held for one response
+    size_t buf_off = 0;
+    size_t buf_len = 0;
+
+    int pipe_fds[2] = {-1, -1}; // splice mode: file -> pipe -> socket
+    size_t pipe_len = 0;        // bytes sitting in the pipe
+
+    std::shared_ptr<const std::string> zbody;  // compressed or hot body, instead of file_fd
+    size_t zbody_off = 0;
+
+    // A "GET ... lz4" that missed the compressed cache: the range is being
+    // compressed on a worker, and the reply waits for it. The raw body is
+    // already set up above, for when it doesn't compress.
+    bool lz4_wait = false;
+    std::string lz4_id;
+    std::string lz4_name;
+    int64_t lz4_mtime = 0;
+
+    std::shared_ptr<PeerCounters> peer;     // per-client byte counters
+    bool timed = false;         // a GET whose latency is being measured
+    std::chrono::steady_clock::time_point started;
+
+    std::unique_ptr<Flow> flow; // rate limiting, null when the server is unlimited
+    bool throttled = false;     // parked in the reactor's throttled queue
+    std::chrono::steady_clock::time_point retry_at;
+
+    ~Connection() {
+        if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+        if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        if (fd >= 0) close(fd);
+    }
+};
+
+void set_events(int ep, Connection &c, uint32_t events) {
+    if (c.events == events) return;
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = c.fd;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+    c.events = events;
+}
+
+// Back to reading; the connection is reused for the next request (v2).
+void reset_response(Connection &c) {
+    c.file.reset();
+    c.file_fd = -1;
+    c.file_off = c.file_left = 0;
+    c.zbody.reset();
+    c.zbody_off = 0;
+    c.lz4_wait = false;
+    c.out.clear();
+    c.out_off = 0;
+    c.buf.reset();
+    c.buf_off = c.buf_len = 0;
+    c.state = ConnState::ReadRequest;
+}
+
+// What request handling needs from the server, shared by all reactors.
+struct ServeContext {
+    const Catalog &catalog;
+    CompressedPieces *compressed;   // null: compression is off
+    FileCache &files;
+    HotPieces *hot;                 // null: hot cache is off
+    ManifestStore &manifests;
+    const PartialFiles *partials;   // null: not seeding any downloads
+};
+
+// "OK <id> <len>[ <codec>]\n" (v2) or "OK <len>\n" (v1 when `id` is empty),
+// reusing the capacity c.out kept from the previous response.
+void set_ok(Connection &c, std::string_view id, uint64_t len, std::string_view codec = {}) {
+    c.out.assign("OK ");
+    if (!id.empty()) {
+        c.out.append(id);
+        c.out += ' ';
+    }
+    append_u64(c.out, len);
+    if (!codec.empty()) {
+        c.out += ' ';
+        c.out.append(codec);
+    }
+    c.out += '\n';
+}
+
+void set_err(Connection &c, std::string_view id, std::string_view reason) {
+    metrics().replies_err.add();
+    c.out.assign("ERR ");
+    if (!id.empty()) {
+        c.out.append(id);
+        c.out += ' ';
+    }
+    c.out.append(reason);
+    c.out += '\n';
+}
+
+// STATS body: the process-wide metrics plus what only the server knows.
+std::string stats_text(const ServeContext &ctx) {
+    std::string out = metrics().render();
+    out += "# HELP p2p_shared_files Files in the shared catalog.\n# TYPE p2p_shared_files gauge\n";
+    out += "p2p_shared_files ";
+    append_u64(out, ctx.catalog.snapshot()->size());
+    out += '\n';
+    if (ctx.partials) {
+        out += "# HELP p2p_partial_files Downloads in progress whose finished pieces are served.\n"
+               "# TYPE p2p_partial_files gauge\np2p_partial_files ";
+        append_u64(out, ctx.partials->snapshot()->size());
+        out += '\n';
+    }
+    if (ctx.compressed) {
+        auto z = ctx.compressed->stats();
+        const std::pair<const char*, uint64_t> lz4[] = {
+            {"p2p_lz4_ranges_compressed_total", z.compressed}, {"p2p_lz4_cache_hits_total", z.hits},
+            {"p2p_lz4_ranges_skipped_total", z.skipped}, {"p2p_lz4_ranges_overflow_total", z.overflow},
+            {"p2p_lz4_raw_bytes_total", z.raw_bytes}, {"p2p_lz4_wire_bytes_total", z.wire_bytes},
+        };
+        for (auto &kv : lz4) {
+            out.append("# TYPE ").append(kv.first).append(" counter\n").append(kv.first).append(" ");
+            append_u64(out, kv.second);
+            out += '\n';
+        }
+    }
+    auto fc = ctx.files.stats();
+    std::vector<std::pair<const char*, uint64_t>> cache = {
+        {"p2p_fd_cache_hits_total", fc.hits}, {"p2p_fd_cache_misses_total", fc.misses},
+        {"p2p_fd_cache_evictions_total", fc.evictions},
+    };
+    if (ctx.hot) {
+        auto h = ctx.hot->stats();
+        cache.insert(cache.end(), {{"p2p_hot_cache_hits_total", h.hits}, {"p2p_hot_cache_misses_total", h.misses},
+                                   {"p2p_hot_cache_admitted_total", h.admitted}});
+    }
+    for (auto &kv : cache) {
+        out.append("# TYPE ").append(kv.first).append(" counter\n").append(kv.first).append(" ");
+        append_u64(out, kv.second);
+        out += '\n';
+    }
+    out += "# HELP p2p_fd_cache_open Shared files kept open between requests.\n"
+           "# TYPE p2p_fd_cache_open gauge\np2p_fd_cache_open ";
+    append_u64(out, fc.open);
+    out += '\n';
+    if (ctx.hot) {
+        out += "# HELP p2p_hot_cache_bytes Bytes of popular ranges held in memory.\n"
+               "# TYPE p2p_hot_cache_bytes gauge\np2p_hot_cache_bytes ";
+        append_u64(out, ctx.hot->stats().bytes);
+        out += '\n';
+    }
+    return out;
+}
+
+// Turns a request line into a pending response on `c`. Fields are parsed in
+// place from the connection's input buffer.
+// Returns false if the connection should just be dropped.
+bool prepare_response(Connection &c, std::string_view req, const ServeContext &ctx) {
+    LineFields f;
+    if (!split_fields(req, f) || f.n == 0) return false;
+    std::string_view cmd = f.f[0];
+
+    if (cmd == "HELLO") {
+        uint32_t v = 0;
+        if (f.n < 2 || !parse_u32(f.f[1], v) || v < 2) return false;
+        c.version = PROTOCOL_VERSION;
+        c.close_after = false;
+        c.out = HELLO_LINE;
+        return true;
+    }
+    if (cmd == "MANIFEST" && c.version >= 2) {
+        // MANIFEST <id> <file> <piece_size> [weak]
+        metrics().requests_manifest.add();
+        uint64_t piece_size = 0;
+        if (f.n < 4 || !parse_u64(f.f[3], piece_size)) return false;
+        std::string_view id = f.f[1];
+        std::shared_ptr<const Manifest> m;
+        CatalogEntry e;
+        if (ctx.catalog.lookup(f.f[2], e)) {
+            // checked before anything is queued: a tiny piece size on a big
+            // file would otherwise build a manifest that doesn't fit memory
+            if (!piece_count_ok(e.size, piece_size)) {
+                set_err(c, id, "range");
+                return true;
+            }
+            m = ctx.manifests.get(std::string(f.f[2]), piece_size);
+        } else if (auto part = ctx.partials ? ctx.partials->find(f.f[2]) : nullptr) {
+            // the downloader's copy of its seeder's manifest, if the piece size matches
+            if (part->manifest && part->manifest->piece_size == piece_size) m = part->manifest;
+        }
+        if (!m) {
+            set_err(c, id, ctx.catalog.lookup(f.f[2], e) ? "busy" : "nofile");
+            return true;
+        }
+        // small enough to go out with the header
+        std::string body = serialize_manifest(*m, f.n >= 5 && f.f[4] == "weak");
+        set_ok(c, id, body.size());
+        c.out += body;
+        return true;
+    }
+    if (cmd == "CATALOG" && c.version >= 2) {
+        if (f.n < 2) return false;
+        metrics().requests_catalog.add();
+        uint64_t digest = 0;
+        auto files = ctx.catalog.snapshot(&digest);
+        std::string body;
+        auto partial = ctx.partials ? ctx.partials->snapshot() : nullptr;
+        if (partial && !partial->empty()) {
+            body = serialize_catalog(*files, catalog_digest(*files, *partial), *partial);
+        } else {
+            body = serialize_catalog(*files, digest);
+        }
+        set_ok(c, f.f[1], body.size());
+        c.out += body;
+        return true;
+    }
+    if (cmd == "HAVE" && c.version >= 2) {
+        // HAVE <id> <file> <piece_size>
+        metrics().requests_have.add();
+        uint64_t piece_size = 0;
+        if (f.n < 4 || !parse_u64(f.f[3], piece_size) || piece_size == 0) return false;
+        std::string_view id = f.f[1];
+        CatalogEntry e;
+        std::string body;
+        auto part = ctx.partials ? ctx.partials->find(f.f[2]) : nullptr;
+        bool listed = ctx.catalog.lookup(f.f[2], e);
+        if (!listed && part) e.size = part->pieces.file_size();
+        if ((listed || part) && !piece_count_ok(e.size, piece_size)) {
+            set_err(c, id, "range");
+            return true;
+        }
+        if (listed) {
+            body = serialize_have(have_all(e.size, piece_size));
+        } else if (part) {
+            body = serialize_have(part->pieces.view(piece_size));
+        } else {
+            set_err(c, id, "nofile");
+            return true;
+        }
+        set_ok(c, id, body.size());
+        c.out += body;
+        return true;
+    }
+    if (cmd == "STATS") {
+        // STATS <id> (v2), or bare STATS on a v1 connection
+        if (c.version >= 2 && f.n < 2) return false;
+        metrics().requests_stats.add();
+        std::string body = stats_text(ctx);
+        set_ok(c, c.version >= 2 ? f.f[1] : std::string_view{}, body.size());
+        c.out += body;
+        return true;
+    }
+    if (cmd != "GET") return false;
+    metrics().requests_get.add();
+    c.timed = true;
+    c.started = std::chrono::steady_clock::now();
+
+    // v2: GET <id> <file> <start> <end> [lz4]
+    // v1: GET <file> <start> <end>, or GET <file> for the whole file
+    std::string_view id, filename;
+    uint64_t start = 0, end = 0;
+    bool want_lz4 = false;
+    if (c.version >= 2) {
+        if (f.n < 5 || !parse_u64(f.f[3], start) || !parse_u64(f.f[4], end)) return false;
+        id = f.f[1];
+        filename = f.f[2];
+        want_lz4 = f.n >= 6 && f.f[5] == "lz4";
+    } else {
+        if (f.n < 2) return false;
+        filename = f.f[1];
+        if (f.n < 4 || !parse_u64(f.f[2], start) || !parse_u64(f.f[3], end)) start = end = 0;
+    }
+
+    CatalogEntry entry;
+    auto file = ctx.files.open(ctx.catalog, filename, entry);
+    bool partial = false;
+    if (!file && ctx.partials && c.version >= 2) {
+        if (auto part = ctx.partials->find(filename)) {
+            // only ranges made entirely of finished pieces
+            uint64_t size = part->pieces.file_size();
+            if (end == 0 || end > size) end = size;
+            if (start < end && !part->pieces.covers(start, end)) {
+                set_err(c, id, "missing");
+                return true;
+            }
+            // opened per request: the file is still growing
+            int pfd = open(part->path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (pfd >= 0) file = std::make_shared<OpenFile>(pfd);
+            entry.size = size;
+            partial = true;
+            want_lz4 = false;       // the compressed cache keys on a stable mtime
+        }
+    }
+    if (!file) {
+        set_err(c, id, "nofile");
+        return true;
+    }
+    uint64_t fsize = entry.size;
+    if (end == 0 || end > fsize) end = fsize;
+    if (start >= end) {
+        if (c.version < 2) return false;
+        set_err(c, id, "range");
+        return true;
+    }
+    if (want_lz4 && ctx.compressed) {
+        // falls through to a raw reply if the range doesn't compress
+        std::shared_ptr<const std::string> z;
+        if (!ctx.compressed->cached(filename, entry.mtime_ns, start, end, z)) {
+            // the reactor hands it to a worker (see finish_lz4)
+            c.lz4_wait = true;
+            c.lz4_id.assign(id);
+            c.lz4_name.assign(filename);
+            c.lz4_mtime = entry.mtime_ns;
+            c.file_fd = file->fd;
+            c.file = std::move(file);
+            c.file_off = start;
+            c.file_left = end - start;
+            return true;
+        }
+        if (z) {
+            c.zbody = std::move(z);
+            c.zbody_off = 0;
+            set_ok(c, id, c.zbody->size(), "lz4");
+            return true;
+        }
+    }
+    if (ctx.hot && !partial) {
+        if (auto hot = ctx.hot->get(filename, entry.mtime_ns, file->fd, start, end)) {
+            c.zbody = std::move(hot);
+            c.zbody_off = 0;
+            set_ok(c, id, end - start);
+            return true;
+        }
+    }
+    c.file_fd = file->fd;
+    c.file = std::move(file);
+    c.file_off = start;
+    c.file_left = end - start;
+    set_ok(c, id, end - start);
+    return true;
+}
+
+IoResult read_request(Connection &c, const ServeContext &ctx) {
+    // a pipelining client may already have the next request buffered;
+    // only bytes not yet searched are scanned for the newline
+    size_t nl;
+    while ((nl = c.in.find('\n', c.in_scan)) == std::string::npos) {
+        c.in_scan = c.in.size();
+        if (c.in.size() - c.in_off > MAX_REQUEST_LINE) return IoResult::Closed;
+        if (c.in_off > 0) {
+            // everything before in_off has been handled
+            c.in.erase(0, c.in_off);
+            c.in_scan -= c.in_off;
+            c.in_off = 0;
+        }
+        size_t old = c.in.size();
+        c.in.resize(old + READ_CHUNK);
+        ssize_t r = recv(c.fd, &c.in[old], READ_CHUNK, 0);
+        c.in.resize(old + (r > 0 ? (size_t)r : 0));
+        if (r == 0) return IoResult::Closed;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IoResult::Pending;
+            return IoResult::Closed;
+        }
+    }
+
+    std::string_view line(c.in.data() + c.in_off, nl + 1 - c.in_off);
+    if (!prepare_response(c, line, ctx)) {
+        metrics().requests_malformed.add();
+        return IoResult::Closed;
+    }
+    c.in_off = c.in_scan = nl + 1;
+    if (c.in_off == c.in.size()) c.in_off = c.in_scan = 0, c.in.clear();
+    c.state = ConnState::WriteResponse;
+    return IoResult::Done;
+}
+
+// The compressed body of a waiting GET is back: reply with it, or with the
+// raw range if it's null.
+void finish_lz4(Connection &c, std::shared_ptr<const std::string> z) {
+    c.lz4_wait = false;
+    if (!z) {
+        set_ok(c, c.lz4_id, c.file_left);
+        return;
+    }
+    c.zbody = std::move(z);
+    c.zbody_off = 0;
+    c.file.reset();
+    c.file_fd = -1;
+    c.file_left = 0;
+    set_ok(c, c.lz4_id, c.zbody->size(), "lz4");
+}
+
+// Compressed bodies on their way from the workers back to one reactor; the
+// eventfd wakes its epoll loop. Shared with the pending jobs, so a reactor
+// that stops first leaves them somewhere to post.
+struct Mailbox {
+    struct Item {
+        int fd;
+        uint64_t serial;
+        std::shared_ptr<const std::string> body;
+    };
+
+    int efd = -1;
+    std::mutex mu;
+    std::vector<Item> items;
+
+    ~Mailbox() {
+        if (efd >= 0) close(efd);
+    }
+    void post(Item item) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            items.push_back(std::move(item));
+        }
+        uint64_t one = 1;
+        ssize_t r = write(efd, &one, sizeof(one));
+        (void)r;    // the counter can't overflow in practice
+    }
+};
+
+IoResult send_result(ssize_t s) {
+    if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return IoResult::Pending;
+    return IoResult::Closed;
+}
+
+bool body_pending(const Connection &c) {
+    return c.file_left > 0 || c.buf_off < c.buf_len || c.pipe_len > 0;
+}
+
+IoResult write_memory(Connection &c, size_t &budget, uint64_t &sent) {
+    const std::string &body = *c.zbody;
+    while (budget > 0 && c.zbody_off < body.size()) {
+        size_t want = std::min(body.size() - c.zbody_off, budget);
+        ssize_t s = send(c.fd, body.data() + c.zbody_off, want, MSG_NOSIGNAL);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0) return send_result(s);
+        c.zbody_off += (size_t)s;
+        budget -= std::min(budget, (size_t)s);
+        sent += (uint64_t)s;
+    }
+    return c.zbody_off < body.size() ? IoResult::Pending : IoResult::Done;
+}
+
+IoResult write_buffered(Connection &c, size_t &budget, uint64_t &sent) {
+    while (budget > 0 && body_pending(c)) {
+        if (c.buf_off == c.buf_len) {
+            if (c.buf.empty()) {
+                c.buf = buffer_pool().try_acquire(BODY_BUFFER);
+                if (c.buf.empty()) {
+                    c.retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(BUFFER_RETRY_MS);
+                    return IoResult::Throttled;
+                }
+            }
+            size_t want = (size_t)std::min<uint64_t>(c.buf.size(), c.file_left);
+            ssize_t got = pread(c.file_fd, c.buf.data(), want, (off_t)c.file_off);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return IoResult::Closed;   // file shrank or I/O error
+            c.file_off += (uint64_t)got;
+            c.file_left -= (uint64_t)got;
+            c.buf_off = 0;
+            c.buf_len = (size_t)got;
+        }
+        ssize_t s = send(c.fd, c.buf.data() + c.buf_off, std::min(c.buf_len - c.buf_off, budget), MSG_NOSIGNAL);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0) return send_result(s);
+        c.buf_off += (size_t)s;
+        budget -= std::min(budget, (size_t)s);
+        sent += (uint64_t)s;
+    }
+    return body_pending(c) ? IoResult::Pending : IoResult::Done;
+}
+
+IoResult write_splice(Connection &c, size_t &budget, uint64_t &sent) {
+    if (c.pipe_fds[0] < 0 && pipe2(c.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        c.mode = SendMode::Buffered;
+        return write_buffered(c, budget, sent);
+    }
+    while (budget > 0 && body_pending(c)) {
+        if (c.pipe_len == 0) {
+            loff_t off = (loff_t)c.file_off;
+            size_t want = (size_t)std::min<uint64_t>(BODY_BUFFER, c.file_left);
+            ssize_t got = splice(c.file_fd, &off, c.pipe_fds[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // file system can't splice; nothing is in the pipe yet, so switch over
+                c.mode = SendMode::Buffered;
+                return write_buffered(c, budget, sent);
+            }
+            if (got <= 0) return IoResult::Closed;
+            c.file_off += (uint64_t)got;
+            c.file_left -= (uint64_t)got;
+            c.pipe_len = (size_t)got;
+        }
+        ssize_t s = splice(c.pipe_fds[0], nullptr, c.fd, nullptr, std::min(c.pipe_len, budget),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (c.file_left > 0 ? SPLICE_F_MORE : 0));
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0) return send_result(s);
+        c.pipe_len -= (size_t)s;
+        budget -= std::min(budget, (size_t)s);
+        sent += (uint64_t)s;
+    }
+    return body_pending(c) ? IoResult::Pending : IoResult::Done;
+}
+
+IoResult write_sendfile(Connection &c, size_t &budget, uint64_t &sent) {
+    while (budget > 0 && c.file_left > 0) {
+        off_t off = (off_t)c.file_off;
+        size_t want = (size_t)std::min<uint64_t>(budget, c.file_left);
+        ssize_t s = sendfile(c.fd, c.file_fd, &off, want);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            c.mode = SendMode::Splice;
+            return write_splice(c, budget, sent);
+        }
+        if (s < 0) return send_result(s);
+        if (s == 0) return IoResult::Closed;      // file shrank under us
+        c.file_off += (uint64_t)s;
+        c.file_left -= (uint64_t)s;
+        budget -= std::min(budget, (size_t)s);
+        sent += (uint64_t)s;
+    }
+    return c.file_left > 0 ? IoResult::Pending : IoResult::Done;
+}
+
+// Pushes the pending header and up to WRITE_BUDGET body bytes (fewer if the
+// connection's rate limits say so); `sent` accumulates body bytes for the
+// reactor's throughput report.
+IoResult write_response(Connection &c, uint64_t &sent) {
+    while (c.out_off < c.out.size()) {
+        int flags = MSG_NOSIGNAL | (c.file_left > 0 || c.zbody ? MSG_MORE : 0);
+        ssize_t s = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, flags);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0) return send_result(s);
+        c.out_off += (size_t)s;
+    }
+
+    size_t budget = WRITE_BUDGET;
+    if (c.flow) {
+        if (!body_pending(c) && !c.zbody) return IoResult::Done;
+        c.flow->set_busy(true);
+        budget = (size_t)c.flow->allowance(budget, std::chrono::steady_clock::now(), c.retry_at);
+        if (budget == 0) return IoResult::Throttled;
+    }
+
+    uint64_t before = sent;
+    IoResult r;
+    if (c.zbody) r = write_memory(c, budget, sent);
+    else switch (c.mode) {
+        case SendMode::Sendfile: r = write_sendfile(c, budget, sent); break;
+        case SendMode::Splice:   r = write_splice(c, budget, sent); break;
+        default:                 r = write_buffered(c, budget, sent); break;
+    }
+    if (c.flow) {
+        c.flow->consumed(sent - before);
+        if (r != IoResult::Pending) c.flow->set_busy(false);
+    }
+    if (sent > before) {
+        metrics().bytes_served.add(sent - before);
+        if (c.peer) c.peer->sent.add(sent - before);
+    }
+    return r;
+}
+
+double thread_cpu_seconds() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+} // namespace
+
+
+const char* send_mode_name(SendMode m) {
+    switch (m) {
+        case SendMode::Sendfile: return "sendfile";
+        case SendMode::Splice:   return "splice";
+        default:                 return "buffered";
+    }
+}
+
+bool parse_send_mode(const std::string& s, SendMode& out) {
+    if (s == "sendfile") out = SendMode::Sendfile;
+    else if (s == "splice") out = SendMode::Splice;
+    else if (s == "buffered") out = SendMode::Buffered;
+    else return false;
+    return true;
+}
+
+
+FileServer::FileServer(int port, std::shared_ptr<Catalog> catalog, const ServerConfig& cfg,
+                       std::shared_ptr<const PartialFiles> partials)
+    : port_(port), catalog_(std::move(catalog)), partials_(std::move(partials)), cfg_(cfg) {}
+
+FileServer::~FileServer() {
+    stop();
+}
+
+
+// ---------------------------------------------------------------
+// Start / Stop
+// ---------------------------------------------------------------
+int FileServer::open_listener() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (!cfg_.exclusive_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        std::cerr << "[tcp_server] SO_REUSEPORT not supported\n";
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port_);
+
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, std::max(1, cfg_.backlog)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool FileServer::start() {
+    int n = cfg_.reactors;
+    if (n <= 0) n = (int)std::max(1u, std::thread::hardware_concurrency());
+    // sharding the listener needs SO_REUSEPORT
+    if (cfg_.exclusive_port) n = 1;
+    size_t total = (size_t)std::max(1, cfg_.max_connections);
+    size_t per_reactor = std::max<size_t>(1, (total + n - 1) / n);
+
+    for (int i = 0; i < n; ++i) {
+        int fd = open_listener();
+        if (fd < 0) {
+            if (i == 0) {
+                std::cerr << "[tcp_server] bind/listen failed on port " << port_ << "\n";
+                return false;
+            }
+            std::cerr << "[tcp_server] could not shard listener, running " << i << " reactors\n";
+            break;
+        }
+        listen_fds_.push_back(fd);
+    }
+
+    if (cfg_.shaping.enabled()) shaper_ = std::make_unique<Shaper>(cfg_.shaping);
+    if (cfg_.compression) compressed_ = std::make_unique<CompressedPieces>(cfg_.compress_cache);
+    files_ = std::make_unique<FileCache>(cfg_.fd_cache);
+    if (cfg_.hot_cache) hot_ = std::make_unique<HotPieces>(cfg_.hot_cache);
+
+    // hash files for the default piece size up front, off the reactors
+    manifests_ = std::make_unique<ManifestStore>(catalog_);
+    manifests_->prewarm(DEFAULT_PIECE_SIZE);
+
+    running_ = true;
+    for (size_t i = 0; i < listen_fds_.size(); ++i) {
+        reactor_threads_.emplace_back(&FileServer::reactor_worker, this, (int)i, listen_fds_[i], per_reactor);
+    }
+
+    std::cout << "[tcp_server] listening on port " << port_
+              << " (" << listen_fds_.size() << " reactors, max "
+              << per_reactor * listen_fds_.size() << " connections, "
+              << send_mode_name(cfg_.send_mode) << ")\n";
+    if (shaper_) {
+        const ShaperConfig &s = cfg_.shaping;
+        auto rate = [](uint64_t r) { return r ? std::to_string(r / 1024) + " KiB/s" : std::string("unlimited"); };
+        std::cout << "[tcp_server] upload limits: server " << rate(s.server_rate) << ", per client "
+                  << rate(s.client_rate) << ", per connection " << rate(s.conn_rate)
+                  << (s.fair && s.server_rate ? ", fair share between clients" : "") << "\n";
+    }
+    return true;
+}
+
+void FileServer::stop() {
+    running_ = false;
+    for (auto &t : reactor_threads_) if (t.joinable()) t.join();
+    reactor_threads_.clear();
+    for (int fd : listen_fds_) close(fd);
+    listen_fds_.clear();
+    if (manifests_) manifests_->stop();
+}
+
+
+// ---------------------------------------------------------------
+// Reactor (one epoll loop per thread)
+// ---------------------------------------------------------------
+void FileServer::reactor_worker(int index, int listen_fd, size_t max_conns) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        std::cerr << "[tcp_server] epoll_create1 failed\n";
+        return;
+    }
+
+    epoll_event lev{};
+    lev.events = EPOLLIN;
+    lev.data.fd = listen_fd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &lev);
+    bool accepting = true;
+
+    std::unordered_map<int, std::unique_ptr<Connection>> conns;
+    uint64_t next_serial = 0;
+    ServeContext ctx{*catalog_, compressed_.get(), *files_, hot_.get(), *manifests_, partials_.get()};
+
+    auto mailbox = std::make_shared<Mailbox>();
+    if (compressed_) {
+        mailbox->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event mev{};
+        mev.events = EPOLLIN;
+        mev.data.fd = mailbox->efd;
+        if (mailbox->efd >= 0) epoll_ctl(ep, EPOLL_CTL_ADD, mailbox->efd, &mev);
+    }
+
+    auto drop = [&](int fd) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        if (conns.erase(fd)) metrics().connections_active.sub();
+        if (!accepting && conns.size() < max_conns) {
+            // back under the cap: resume pulling from the accept queue
+            epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &lev);
+            accepting = true;
+        }
+    };
+
+    // throughput accounting for the periodic report
+    uint64_t sent = 0;
+    uint64_t report_sent = 0;
+    double report_cpu = thread_cpu_seconds();
+    auto report_wall = std::chrono::steady_clock::now();
+    uint64_t memory_served = 0;
+
+    auto report = [&]() {
+        auto now = std::chrono::steady_clock::now();
+        double wall = std::chrono::duration<double>(now - report_wall).count();
+        double cpu = thread_cpu_seconds();
+        uint64_t bytes = sent - report_sent;
+        if (bytes > 0) {
+            double mib = (double)bytes / (1024.0 * 1024.0);
+            std::ostringstream line;
+            line.setf(std::ios::fixed);
+            line.precision(1);
+            line << "[tcp_server] reactor " << index << " (" << send_mode_name(cfg_.send_mode) << "): "
+                 << mib << " MiB, " << mib / std::max(wall, 1e-9) << " MiB/s, "
+                 << mib / std::max(cpu - report_cpu, 1e-6) << " MiB per CPU-second\n";
+            std::cout << line.str() << std::flush;
+        }
+        // the shaper and compression cache are shared, so one reactor reports them
+        if (index == 0 && shaper_) std::cout << shaper_->report() << std::flush;
+        if (index == 0 && compressed_) {
+            auto s = compressed_->stats();
+            if (s.hits + s.compressed + s.skipped > 0) {
+                std::ostringstream z;
+                z.setf(std::ios::fixed);
+                z.precision(2);
+                z << "[tcp_server] lz4: " << s.compressed << " ranges compressed, " << s.hits << " cache hits, "
+                  << s.skipped << " incompressible, " << s.overflow << " raw while busy; " << (double)s.raw_bytes / (1024.0 * 1024.0) << " MiB sent as "
+                  << (double)s.wire_bytes / (1024.0 * 1024.0) << " MiB\n";
+                std::cout << z.str() << std::flush;
+            }
+        }
+        if (index == 0 && metrics().bytes_served.value() != memory_served) {
+            // only while serving: the peak can't change much when idle
+            memory_served = metrics().bytes_served.value();
+            auto pool = buffer_pool().stats();
+            std::ostringstream m;
+            m.setf(std::ios::fixed);
+            m.precision(1);
+            m << "[tcp_server] memory: peak RSS " << (double)peak_rss_bytes() / (1024.0 * 1024.0) << " MiB, buffers "
+              << (double)pool.in_use / (1024.0 * 1024.0) << " MiB in use (peak "
+              << (double)pool.peak_in_use / (1024.0 * 1024.0) << " MiB";
+            if (pool.budget) m << " of " << (double)pool.budget / (1024.0 * 1024.0) << " MiB budget";
+            m << "), " << pool.waits << " waits\n";
+            std::cout << m.str() << std::flush;
+        }
+        if (index == 0) {
+            auto pct = [](uint64_t hits, uint64_t misses) { return 100.0 * (double)hits / (double)(hits + misses); };
+            auto f = files_->stats();
+            if (f.hits + f.misses > 0) {
+                std::ostringstream c;
+                c.setf(std::ios::fixed);
+                c.precision(1);
+                c << "[tcp_server] fd cache: " << pct(f.hits, f.misses) << "% hits (" << f.hits << "/"
+                  << f.hits + f.misses << "), " << f.open << " open, " << f.evictions << " evicted";
+                if (hot_) {
+                    auto h = hot_->stats();
+                    if (h.hits + h.misses > 0) {
+                        c << "; hot ranges: " << pct(h.hits, h.misses) << "% hits (" << h.hits << "/"
+                          << h.hits + h.misses << "), " << (double)h.bytes / (1024.0 * 1024.0) << " MiB held";
+                    }
+                }
+                std::cout << c.str() << "\n" << std::flush;
+            }
+        }
+        report_sent = sent;
+        report_cpu = cpu;
+        report_wall = now;
+    };
+
+    // Connections waiting for rate-limit tokens or a pooled buffer, in the
+    // order they ran out, so every one gets its turn once they come back.
+    std::deque<int> throttled;
+
+    // Hands a compressed-cache miss to the workers; false if it has to go
+    // out raw right away (workers backed up, or no eventfd).
+    auto compress_async = [&](Connection &c) {
+        if (mailbox->efd < 0) return false;
+        auto box = mailbox;
+        int fd = c.fd;
+        uint64_t serial = c.serial;
+        return compressed_->compress(c.lz4_name, c.lz4_mtime, c.file, c.file_off, c.file_off + c.file_left,
+                                     [box, fd, serial](std::shared_ptr<const std::string> z) {
+                                         box->post({fd, serial, std::move(z)});
+                                     });
+    };
+
+    // Runs the connection's state machine as far as it can go without
+    // blocking. Pending: wait for the next event; Done/Closed: drop it.
+    auto advance = [&](Connection &c) {
+        while (true) {
+            if (c.state == ConnState::ReadRequest) {
+                IoResult r = read_request(c, ctx);
+                if (r == IoResult::Pending) set_events(ep, c, EPOLLIN | EPOLLRDHUP);
+                if (r != IoResult::Done) return r;
+                if (c.lz4_wait) {
+                    if (compress_async(c)) {
+                        // only a hang-up matters until the body is back
+                        set_events(ep, c, EPOLLRDHUP);
+                        return IoResult::Pending;
+                    }
+                    finish_lz4(c, nullptr);
+                }
+            }
+            IoResult r = write_response(c, sent);
+            if (r == IoResult::Throttled) {
+                // stop polling for writability until the tokens are back
+                set_events(ep, c, EPOLLRDHUP);
+                c.throttled = true;
+                throttled.push_back(c.fd);
+                return IoResult::Pending;
+            }
+            if (r == IoResult::Pending) set_events(ep, c, EPOLLOUT);
+            if (r != IoResult::Done) return r;
+            if (c.timed) {
+                metrics().request_seconds.observe_since(c.started);
+                c.timed = false;
+            }
+            // v1: one response per connection, then close
+            if (c.close_after) return IoResult::Done;
+            reset_response(c);
+        }
+    };
+
+    auto last_sweep = std::chrono::steady_clock::now();
+
+    std::vector<epoll_event> events(256);
+    while (running_) {
+        if (cfg_.report_interval > 0 &&
+            std::chrono::steady_clock::now() - report_wall >= std::chrono::seconds(cfg_.report_interval)) {
+            report();
+        }
+
+        int timeout = 500;
+        if (!throttled.empty()) {
+            auto now = std::chrono::steady_clock::now();
+            for (int fd : throttled) {
+                auto it = conns.find(fd);
+                if (it == conns.end() || !it->second->throttled) continue;
+                // rounded up: waking early would only spin until retry_at
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(it->second->retry_at - now);
+                timeout = std::min<int>(timeout, (int)std::max<int64_t>(0, wait.count()));
+            }
+        }
+
+        int n = epoll_wait(ep, events.data(), (int)events.size(), timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "[tcp_server] epoll_wait failed\n";
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == listen_fd) {
+                while (conns.size() < max_conns) {
+                    sockaddr_in peer{};
+                    socklen_t peer_len = sizeof(peer);
+                    int cfd = accept4(listen_fd, (sockaddr*)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (cfd < 0) break;   // EAGAIN or transient error
+                    auto c = std::make_unique<Connection>();
+                    c->fd = cfd;
+                    c->serial = ++next_serial;
+                    if (shaper_) c->flow = std::make_unique<Flow>(*shaper_, peer.sin_addr.s_addr);
+                    char ip[INET_ADDRSTRLEN] = "?";
+                    inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+                    c->peer = metrics().peer(ip);
+                    c->mode = cfg_.send_mode;
+                    c->last_active = std::chrono::steady_clock::now();
+                    c->events = EPOLLIN | EPOLLRDHUP;
+                    epoll_event cev{};
+                    cev.events = c->events;
+                    cev.data.fd = cfd;
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &cev) < 0) continue;
+                    conns.emplace(cfd, std::move(c));
+                    metrics().connections_accepted.add();
+                    metrics().connections_active.add();
+                }
+                if (conns.size() >= max_conns && accepting) {
+                    // leave further clients queued in the backlog
+                    epoll_ctl(ep, EPOLL_CTL_DEL, listen_fd, nullptr);
+                    accepting = false;
+                }
+                continue;
+            }
+
+            if (fd == mailbox->efd) {
+                uint64_t count = 0;
+                ssize_t r = read(fd, &count, sizeof(count));
+                (void)r;
+                std::vector<Mailbox::Item> items;
+                {
+                    std::lock_guard<std::mutex> lock(mailbox->mu);
+                    items.swap(mailbox->items);
+                }
+                for (auto &item : items) {
+                    auto it = conns.find(item.fd);
+                    if (it == conns.end() || it->second->serial != item.serial || !it->second->lz4_wait) continue;
+                    Connection &c = *it->second;
+                    finish_lz4(c, std::move(item.body));
+                    c.last_active = std::chrono::steady_clock::now();
+                    if (advance(c) != IoResult::Pending) drop(item.fd);
+                }
+                continue;
+            }
+
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            Connection &c = *it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) { drop(fd); continue; }
+            if (c.throttled || c.lz4_wait) {
+                // only hang-ups are of interest until its turn comes
+                if (events[i].events & EPOLLRDHUP) drop(fd);
+                continue;
+            }
+
+            c.last_active = std::chrono::steady_clock::now();
+            IoResult r = advance(c);
+            if (r != IoResult::Pending) drop(fd);
+        }
+
+        // give throttled connections whose tokens are back another go
+        auto now = std::chrono::steady_clock::now();
+        for (size_t k = throttled.size(); k > 0; --k) {
+            int fd = throttled.front();
+            throttled.pop_front();
+            auto it = conns.find(fd);
+            if (it == conns.end() || !it->second->throttled) continue;
+            Connection &c = *it->second;
+            if (c.retry_at > now) {
+                throttled.push_back(fd);
+                continue;
+            }
+            c.throttled = false;
+            c.last_active = now;
+            if (advance(c) != IoResult::Pending) drop(fd);
+        }
+
+        // close persistent connections that have gone quiet
+        if (now - last_sweep >= std::chrono::seconds(5)) {
+            last_sweep = now;
+            std::vector<int> idle;
+            for (auto &kv : conns) {
+                if (now - kv.second->last_active >= std::chrono::seconds(IDLE_TIMEOUT_SECS)) idle.push_back(kv.first);
+            }
+            for (int fd : idle) drop(fd);
+        }
+    }
+
+    if (cfg_.report_interval > 0) report();
+    metrics().connections_active.sub((int64_t)conns.size());
+    conns.clear();
+    close(ep);
+}
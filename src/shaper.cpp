@@ -0,0 +1,179 @@
+#include "shaper.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+
+#include <arpa/inet.h>
+
+// Smallest grant worth a send() call; a connection with less available waits.
+static constexpr uint64_t MIN_GRANT = 16 * 1024;
+
+bool parse_bytes(const std::string& s, uint64_t& out) {
+    if (s.empty() || !std::isdigit((unsigned char)s[0])) return false;
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+    if (errno == ERANGE) return false;
+    std::string suffix(end);
+    uint64_t mult = 1;
+    if (suffix == "K" || suffix == "k") mult = 1ull << 10;
+    else if (suffix == "M" || suffix == "m") mult = 1ull << 20;
+    else if (suffix == "G" || suffix == "g") mult = 1ull << 30;
+    else if (!suffix.empty()) return false;
+    if ((uint64_t)v > UINT64_MAX / mult) return false;   // would wrap
+    out = (uint64_t)v * mult;
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Token bucket
+// ---------------------------------------------------------------
+TokenBucket::TokenBucket(double rate)
+    : rate_(rate), burst_(std::max(rate * 0.05, 4.0 * MIN_GRANT)), tokens_(burst_),
+      last_(std::chrono::steady_clock::now()) {}
+
+double TokenBucket::available(std::chrono::steady_clock::time_point now, double rate) {
+    double r = rate > 0 ? rate : rate_;
+    double dt = std::chrono::duration<double>(now - last_).count();
+    if (dt > 0) {
+        tokens_ = std::min(burst_, tokens_ + dt * r);
+        last_ = now;
+    }
+    return tokens_;
+}
+
+double TokenBucket::seconds_until(double n, double rate) const {
+    double r = rate > 0 ? rate : rate_;
+    if (tokens_ >= n || r <= 0) return 0;
+    return (n - tokens_) / r;
+}
+
+
+// ---------------------------------------------------------------
+// Shaper
+// ---------------------------------------------------------------
+Shaper::Shaper(const ShaperConfig& cfg)
+    : cfg_(cfg), server_(cfg.server_rate ? TokenBucket((double)cfg.server_rate) : TokenBucket()),
+      last_report_(std::chrono::steady_clock::now()) {}
+
+std::string Shaper::report() {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto now = std::chrono::steady_clock::now();
+    double secs = std::max(1e-6, std::chrono::duration<double>(now - last_report_).count());
+    last_report_ = now;
+
+    std::ostringstream lines;
+    lines.setf(std::ios::fixed);
+    lines.precision(2);
+    double total = 0, squares = 0;
+    int n = 0;
+    for (auto &kv : clients_) {
+        Client &c = *kv.second;
+        uint64_t delta = c.bytes - c.reported;
+        c.reported = c.bytes;
+        if (delta == 0) continue;
+        double mib = (double)delta / (1024.0 * 1024.0) / secs;
+        total += mib;
+        squares += mib * mib;
+        n++;
+        char ip[INET_ADDRSTRLEN] = "?";
+        in_addr a{};
+        a.s_addr = c.addr;
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        lines << "[shaper]   " << ip << ": " << mib << " MiB/s over " << c.flows << " connection(s)\n";
+    }
+    if (n == 0) return "";
+
+    std::ostringstream head;
+    head.setf(std::ios::fixed);
+    head.precision(2);
+    head << "[shaper] " << n << " client(s), " << total << " MiB/s total";
+    if (cfg_.server_rate) head << " (limit " << (double)cfg_.server_rate / (1024.0 * 1024.0) << " MiB/s)";
+    head << ", fairness " << total * total / (n * squares) << "\n";
+    return head.str() + lines.str();
+}
+
+
+// ---------------------------------------------------------------
+// Flow
+// ---------------------------------------------------------------
+Flow::Flow(Shaper& shaper, uint32_t addr) : shaper_(shaper) {
+    const ShaperConfig &cfg = shaper_.cfg_;
+    if (cfg.conn_rate) conn_ = TokenBucket((double)cfg.conn_rate);
+
+    std::lock_guard<std::mutex> lock(shaper_.mu_);
+    auto &slot = shaper_.clients_[addr];
+    if (!slot) {
+        slot = std::make_shared<Shaper::Client>();
+        slot->addr = addr;
+        if (cfg.client_rate) slot->limit = TokenBucket((double)cfg.client_rate);
+        if (cfg.server_rate) slot->fair = TokenBucket((double)cfg.server_rate);
+    }
+    slot->flows++;
+    client_ = slot;
+}
+
+Flow::~Flow() {
+    set_busy(false);
+    std::lock_guard<std::mutex> lock(shaper_.mu_);
+    if (--client_->flows == 0) shaper_.clients_.erase(client_->addr);
+}
+
+void Flow::set_busy(bool busy) {
+    if (busy == busy_) return;
+    busy_ = busy;
+    std::lock_guard<std::mutex> lock(shaper_.mu_);
+    if (busy) {
+        if (client_->busy++ == 0) shaper_.active_++;
+    } else if (--client_->busy == 0) {
+        shaper_.active_--;
+    }
+}
+
+uint64_t Flow::allowance(uint64_t want, std::chrono::steady_clock::time_point now,
+                         std::chrono::steady_clock::time_point& retry) {
+    double need = (double)std::min<uint64_t>(want, MIN_GRANT);
+    double grant = (double)want;
+    double wait = 0;
+    auto check = [&](TokenBucket &b, double rate) {
+        double t = b.available(now, rate);
+        grant = std::min(grant, t);
+        if (t < need) wait = std::max(wait, b.seconds_until(need, rate));
+    };
+
+    if (conn_.limited()) check(conn_, 0);
+    {
+        std::lock_guard<std::mutex> lock(shaper_.mu_);
+        const ShaperConfig &cfg = shaper_.cfg_;
+        if (client_->limit.limited()) check(client_->limit, 0);
+        if (shaper_.server_.limited()) {
+            check(shaper_.server_, 0);
+            if (cfg.fair && shaper_.active_ > 1) {
+                double share = (double)cfg.server_rate / shaper_.active_;
+                // Tokens piling up in the server bucket mean some busy client
+                // isn't using its share; until they drain, anyone may use them.
+                bool spare = shaper_.server_.available(now) >= shaper_.server_.burst() / 2;
+                if (spare) client_->fair.available(now, share);
+                else check(client_->fair, share);
+            }
+        }
+    }
+    if (grant >= need) return (uint64_t)grant;
+    retry = now + std::chrono::microseconds(std::max<int64_t>(1000, (int64_t)(wait * 1e6)));
+    return 0;
+}
+
+void Flow::consumed(uint64_t n) {
+    if (n == 0) return;
+    conn_.consume((double)n);
+    std::lock_guard<std::mutex> lock(shaper_.mu_);
+    shaper_.server_.consume((double)n);
+    client_->limit.consume((double)n);
+    client_->fair.consume((double)n);
+    client_->bytes += n;
+}
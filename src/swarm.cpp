@@ -0,0 +1,118 @@
+#include "swarm.hpp"
+
+#include <sstream>
+#include <algorithm>
+
+// ---------------------------------------------------------------
+// HAVE text form
+// ---------------------------------------------------------------
+std::string serialize_have(const HaveMap& h) {
+    std::string out = "P2PHAVE 1 " + std::to_string(h.file_size) + " " + std::to_string(h.piece_size) + " " +
+                      std::to_string(h.pieces.size()) + "\n";
+    size_t header = out.size();
+    out.resize(header + (h.pieces.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < h.pieces.size(); ++i) {
+        if (h.pieces[i]) out[header + i / 8] = (char)((uint8_t)out[header + i / 8] | (1u << (i % 8)));
+    }
+    return out;
+}
+
+bool parse_have(const std::string& text, HaveMap& h) {
+    size_t nl = text.find('\n');
+    if (nl == std::string::npos) return false;
+    std::istringstream in(text.substr(0, nl));
+    std::string tag;
+    int version = 0;
+    uint64_t size = 0, piece_size = 0;
+    size_t count = 0;
+    if (!(in >> tag >> version >> size >> piece_size >> count) || tag != "P2PHAVE" || version != 1) return false;
+    if (piece_size == 0 || count != (size_t)((size + piece_size - 1) / piece_size)) return false;
+    if (text.size() - nl - 1 != (count + 7) / 8) return false;
+
+    const char *bits = text.data() + nl + 1;
+    h.file_size = size;
+    h.piece_size = piece_size;
+    h.pieces.assign(count, false);
+    for (size_t i = 0; i < count; ++i) h.pieces[i] = ((uint8_t)bits[i / 8] >> (i % 8)) & 1;
+    return true;
+}
+
+HaveMap have_all(uint64_t file_size, uint64_t piece_size) {
+    HaveMap h;
+    h.file_size = file_size;
+    h.piece_size = piece_size;
+    h.pieces.assign(piece_size ? (size_t)((file_size + piece_size - 1) / piece_size) : 0, true);
+    return h;
+}
+
+
+// ---------------------------------------------------------------
+// PieceMap
+// ---------------------------------------------------------------
+PieceMap::PieceMap(uint64_t file_size, uint64_t piece_size)
+    : file_size_(file_size), piece_size_(std::max<uint64_t>(1, piece_size)),
+      count_((size_t)((file_size + piece_size_ - 1) / piece_size_)),
+      words_(new std::atomic<uint64_t>[(count_ + 63) / 64]) {
+    for (size_t i = 0; i < (count_ + 63) / 64; ++i) words_[i] = 0;
+}
+
+void PieceMap::set(size_t index) {
+    // release: the piece's bytes are in the file before anyone sees the bit
+    if (index < count_) words_[index / 64].fetch_or(1ull << (index % 64), std::memory_order_release);
+}
+
+bool PieceMap::has(size_t index) const {
+    return index < count_ && (words_[index / 64].load(std::memory_order_acquire) >> (index % 64)) & 1;
+}
+
+bool PieceMap::covers(uint64_t start, uint64_t end) const {
+    if (start >= end || end > file_size_) return false;
+    for (uint64_t i = start / piece_size_; i <= (end - 1) / piece_size_; ++i) {
+        if (!has((size_t)i)) return false;
+    }
+    return true;
+}
+
+HaveMap PieceMap::view(uint64_t piece_size) const {
+    HaveMap h = have_all(file_size_, piece_size);
+    for (size_t i = 0; i < h.pieces.size(); ++i) {
+        uint64_t start = (uint64_t)i * piece_size;
+        h.pieces[i] = covers(start, std::min(file_size_, start + piece_size));
+    }
+    return h;
+}
+
+
+// ---------------------------------------------------------------
+// Registry
+// ---------------------------------------------------------------
+PartialFiles::PartialFiles() : listing_(std::make_shared<CatalogFiles>()) {}
+
+void PartialFiles::add(const std::string& name, std::shared_ptr<const PartialFile> file) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto listing = std::make_shared<CatalogFiles>(*listing_);
+    (*listing)[name].size = file->pieces.file_size();
+    files_[name] = std::move(file);
+    listing_ = std::move(listing);
+    version_++;
+}
+
+void PartialFiles::remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!files_.erase(name)) return;
+    auto listing = std::make_shared<CatalogFiles>(*listing_);
+    listing->erase(name);
+    listing_ = std::move(listing);
+    version_++;
+}
+
+std::shared_ptr<const PartialFile> PartialFiles::find(std::string_view name) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = files_.find(name);
+    return it == files_.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<const CatalogFiles> PartialFiles::snapshot() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return listing_;
+}
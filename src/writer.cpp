@@ -0,0 +1,366 @@
+#include "writer.hpp"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Submission queue depth; also the largest batch handed to the kernel at once.
+static constexpr unsigned RING_ENTRIES = 64;
+
+const char* write_mode_name(WriteMode m) {
+    switch (m) {
+        case WriteMode::Mmap:  return "mmap";
+        case WriteMode::Uring: return "uring";
+        default:               return "pwrite";
+    }
+}
+
+bool parse_write_mode(const std::string& s, WriteMode& out) {
+    if (s == "pwrite") out = WriteMode::Pwrite;
+    else if (s == "mmap") out = WriteMode::Mmap;
+    else if (s == "uring") out = WriteMode::Uring;
+    else return false;
+    return true;
+}
+
+
+// Minimal io_uring set up through the raw syscalls (no liburing needed).
+// Only the ring thread touches it, so the sole synchronisation is with the
+// kernel through the head/tail indices.
+struct OutputFile::Ring {
+    int fd = -1;
+    void *sq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    void *cq_ptr = MAP_FAILED;
+    size_t cq_len = 0;
+    io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_len = 0;
+
+    unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned entries = 0;
+
+    bool setup(unsigned depth) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+        if (fd < 0) return false;
+        entries = p.sq_entries;
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_len = cq_len = std::max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        if (single) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) return false;
+        }
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = (char*)sq_ptr, *cq = (char*)cq_ptr;
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        if (fd >= 0) ::close(fd);
+    }
+
+    void queue_write(int file_fd, uint64_t off, const char *data, size_t len, void *tag) {
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[idx];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = file_fd;
+        sqe.off = off;
+        sqe.addr = (uint64_t)(uintptr_t)data;
+        sqe.len = (uint32_t)len;
+        sqe.user_data = (uint64_t)(uintptr_t)tag;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete) {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+
+    // Pops one completion if available.
+    bool reap(uint64_t &tag, int &res) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        io_uring_cqe &cqe = cqes[head & *cq_mask];
+        tag = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+
+OutputFile::OutputFile(const std::string& path, uint64_t size, WriteMode mode)
+    : path_(path), size_(size), mode_(mode) {}
+
+OutputFile::~OutputFile() {
+    close();
+}
+
+bool OutputFile::open(bool truncate) {
+    close();
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+    fd_ = ::open(path_.c_str(), flags, 0644);
+    if (fd_ < 0) {
+        std::cout << "Failed to open " << path_ << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    if (!preallocate()) { close(); return false; }
+
+    if (mode_ == WriteMode::Mmap && size_ > 0) {
+        void *p = mmap(nullptr, (size_t)size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) {
+            std::cout << "mmap of " << path_ << " failed, using pwrite\n";
+            mode_ = WriteMode::Pwrite;
+        } else {
+            map_ = (char*)p;
+            madvise(map_, (size_t)size_, MADV_RANDOM);   // pieces arrive out of order
+        }
+    }
+    if (mode_ == WriteMode::Uring && !start_ring()) {
+        std::cout << "io_uring unavailable, using pwrite\n";
+        mode_ = WriteMode::Pwrite;
+    }
+    return true;
+}
+
+bool OutputFile::preallocate() {
+    if (size_ == 0) return true;
+    // Reserve real blocks up front: fewer extents than filling in holes piece
+    // by piece, and ENOSPC shows up now instead of mid-download (or as SIGBUS
+    // through the mapping).
+    if (fallocate(fd_, 0, 0, (off_t)size_) != 0) {
+        if (errno == ENOSPC) {
+            std::cout << "Not enough disk space for " << path_ << " (" << size_ << " bytes)\n";
+            return false;
+        }
+        // file system without fallocate: a plain resize still works
+    }
+    if (ftruncate(fd_, (off_t)size_) != 0) {
+        std::cout << "Failed to size " << path_ << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+void OutputFile::close() {
+    if (ring_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        ring_thread_.join();
+    }
+    ring_.reset();
+    stopping_ = false;
+    ring_failed_ = false;
+    if (map_) munmap(map_, (size_t)size_);
+    map_ = nullptr;
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+}
+
+bool OutputFile::write(uint64_t off, const char *data, size_t len) {
+    if (fd_ < 0 || off + len > size_) return false;
+
+    if (map_) {
+        std::memcpy(map_ + off, data, len);
+        return true;
+    }
+
+    if (ring_) {
+        Request req{off, data, len};
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!ring_failed_) {
+            queue_.push_back(&req);
+            cv_.notify_one();
+            done_cv_.wait(lock, [&]{ return req.done; });
+            return req.err == 0;
+        }
+    }
+
+    return write_at(off, data, len) == 0;
+}
+
+// pwrite()s the whole range; 0 or an errno.
+int OutputFile::write_at(uint64_t off, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd_, data, len, (off_t)off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return w < 0 ? errno : EIO;
+        data += w;
+        off += (uint64_t)w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+bool OutputFile::read(uint64_t off, char *dst, size_t len) {
+    if (fd_ < 0 || off + len > size_) return false;
+    while (len > 0) {
+        ssize_t r = pread(fd_, dst, len, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        dst += r;
+        off += (uint64_t)r;
+        len -= (size_t)r;
+    }
+    return true;
+}
+
+bool OutputFile::start_ring() {
+    auto ring = std::make_unique<Ring>();
+    if (!ring->setup(RING_ENTRIES)) return false;
+    ring_ = std::move(ring);
+    ring_thread_ = std::thread(&OutputFile::ring_worker, this);
+    return true;
+}
+
+// Collects whatever writes are queued, submits them with a single
+// io_uring_enter() and wakes the writers as their completions come in.
+// Short writes are requeued for the remainder.
+void OutputFile::ring_worker() {
+    std::vector<Request*> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            cv_.wait(lock, [&]{ return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) return;   // stopping with nothing left to write
+            while (!queue_.empty() && batch.size() < ring_->entries) {
+                batch.push_back(queue_.front());
+                queue_.pop_front();
+            }
+            batches_++;
+        }
+
+        for (Request *r : batch) ring_->queue_write(fd_, r->off, r->data, r->len, r);
+        unsigned to_submit = (unsigned)batch.size();
+        size_t outstanding = batch.size();
+        std::vector<Request*> finished, retry;
+        while (outstanding > 0) {
+            int n = ring_->enter(to_submit, 1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // The ring is unusable. The kernel never took the last
+                // `to_submit` entries; the rest may still be reading their
+                // buffers, and their writers wait until they have completed.
+                int err = errno;
+                std::lock_guard<std::mutex> lock(mu_);
+                for (Request *r : finished) r->done = true;
+                done_cv_.notify_all();
+                retry.insert(retry.end(), batch.end() - to_submit, batch.end());
+                abandon_ring(std::move(retry), outstanding - to_submit, err);
+                return;
+            }
+            to_submit -= std::min<unsigned>(to_submit, (unsigned)n);
+
+            uint64_t tag;
+            int res;
+            while (outstanding > 0 && ring_->reap(tag, res)) {
+                outstanding--;
+                Request *r = (Request*)(uintptr_t)tag;
+                if (res == -EINTR || res == -EAGAIN || (res > 0 && (size_t)res < r->len)) {
+                    if (res > 0) {
+                        r->off += (uint64_t)res;
+                        r->data += res;
+                        r->len -= (size_t)res;
+                    }
+                    retry.push_back(r);
+                    continue;
+                }
+                if (res < 0) r->err = -res;
+                else if (res == 0) r->err = EIO;
+                finished.push_back(r);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (Request *r : finished) r->done = true;
+            for (auto it = retry.rbegin(); it != retry.rend(); ++it) queue_.push_front(*it);
+        }
+        done_cv_.notify_all();
+        batch.clear();
+    }
+}
+
+// Called with mu_ held once io_uring_enter() has failed: switches the file to
+// pwrite. The `inflight` writes the kernel accepted are waited for before
+// their buffers go back to the writers; everything else (`pending`, and
+// whatever is queued) is written here.
+void OutputFile::abandon_ring(std::vector<Request*> pending, size_t inflight, int err) {
+    std::cout << "io_uring failed on " << path_ << " (" << std::strerror(err) << "), using pwrite\n";
+    ring_failed_ = true;
+    pending.insert(pending.end(), queue_.begin(), queue_.end());
+    queue_.clear();
+
+    while (inflight > 0) {
+        uint64_t tag;
+        int res;
+        if (ring_->reap(tag, res)) {
+            inflight--;
+            Request *r = (Request*)(uintptr_t)tag;
+            if (res > 0 && (size_t)res < r->len) {
+                r->off += (uint64_t)res;
+                r->data += res;
+                r->len -= (size_t)res;
+                pending.push_back(r);
+            } else if (res == -EINTR || res == -EAGAIN) {
+                pending.push_back(r);
+            } else {
+                if (res < 0) r->err = -res;
+                else if (res == 0) r->err = EIO;
+                r->done = true;
+            }
+            continue;
+        }
+        // every accepted entry gets a completion; only waiting can fail, and
+        // then only for a moment
+        if (ring_->enter(0, 1) < 0 && errno != EINTR) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    for (Request *r : pending) {
+        r->err = write_at(r->off, r->data, r->len);
+        r->done = true;
+    }
+    done_cv_.notify_all();
+}